@@ -0,0 +1,261 @@
+#ifndef ACCESS_LOG_H
+#define ACCESS_LOG_H
+
+#include <stdint.h>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include "locker.h"
+#include "trace.h"
+
+// 二进制访问日志（-A file[:MB]）：每个请求结束时写一条定长记录（后面跟URL），不做任何格式化，
+// 用tools/decode_access_log.cpp离线转换成文本、CSV或JSON。
+// 文件预先分配好大小（默认64MB）后mmap进来，按BLOCK_SIZE分块：第0块是文件头，之后每块由一个线程独占，
+// 线程在自己的块里顺序追加记录，只有换块时对文件尾做一次原子加，写记录本身不加锁。
+// 文件写满时改名为 file.1（覆盖上一个）并新建文件，正在写旧文件的线程在下一条记录时换到新文件。
+// 记录的各字段先写好，最后写len；没写完的记录len为0，和块中未使用的部分一样被解码器跳过。
+// 记录按主机字节序写入，解码器需要在同一种架构上运行。
+const char ACCESS_LOG_MAGIC[8] = {'W', 'S', 'L', 'O', 'G', '1', 0, 0};
+
+struct access_log_header
+{
+    char magic[8];
+    uint32_t block_size;
+    uint32_t record_size; // sizeof(access_record)，URL紧跟在定长部分之后
+    uint64_t start_us;    // 文件创建时的墙上时间（微秒）
+};
+
+enum access_flags
+{
+    ACCESS_UNIX = 1,  // 连接来自Unix域套接字，addr和port为0
+    ACCESS_CLOSED = 2 // 响应没有完成连接就关闭了
+};
+
+struct access_record
+{
+    uint16_t len;                  // 整条记录的长度（含URL，按8字节对齐），0表示块中之后没有记录
+    uint16_t url_off;              // URL相对记录开头的偏移
+    uint16_t url_len;              // 超过MAX_URL的部分被截掉
+    uint16_t status;               // 响应状态码，0表示没有生成响应
+    uint64_t time_us;              // 请求开始（reactor读到第一批数据）时的墙上时间（微秒）
+    uint64_t bytes;                // 发给客户端的字节数（含响应头）
+    uint32_t addr;                 // 客户端IPv4地址，网络字节序
+    uint16_t port;                 // 网络字节序
+    uint8_t method;                // http_conn::METHOD
+    uint8_t flags;                 // access_flags
+    uint32_t conn;                 // 连接句柄中的代数，同一连接上的请求相同
+    uint32_t stage_us[TS_COUNT - 1]; // 从每个阶段到下一个经过的阶段所用的时间（见trace_stage），没有经过的阶段为0
+};
+static_assert(sizeof(access_record) == 64, "access_record layout changed");
+
+class access_log
+{
+public:
+    static const int BLOCK_SIZE = 1 << 16;
+    static const int MAX_URL = 1024;
+
+    // 只能在启动阶段调用，size为文件大小（字节）
+    static bool open(const char *path, size_t size)
+    {
+        state &s = get();
+        snprintf(s.path, sizeof(s.path), "%s", path);
+        s.size = size < (size_t)BLOCK_SIZE * 2 ? (size_t)BLOCK_SIZE * 2 : size / BLOCK_SIZE * BLOCK_SIZE;
+        s.current = map_file(s);
+        return s.current != NULL;
+    }
+
+    static bool enabled() { return get().current != NULL; }
+
+    // 写一条记录，url不必以'\0'结尾。rec的len、url_off、url_len由这里填写
+    static void write(access_record &rec, const char *url, int url_len)
+    {
+        if (url_len > MAX_URL)
+        {
+            url_len = MAX_URL;
+        }
+        uint16_t len = (sizeof(access_record) + url_len + 7) & ~7;
+        char *p = reserve(len);
+        if (!p)
+        {
+            return;
+        }
+        rec.url_off = sizeof(access_record);
+        rec.url_len = url_len;
+        rec.len = 0;
+        memcpy(p, &rec, sizeof(rec));
+        memcpy(p + sizeof(rec), url, url_len);
+        __atomic_store_n((uint16_t *)p, len, __ATOMIC_RELEASE);
+    }
+
+    static void close()
+    {
+        state &s = get();
+        s.lock.lock();
+        unmap(s.retired);
+        unmap(s.current);
+        s.retired = s.current = NULL;
+        s.lock.unlock();
+    }
+
+    static long long rotations() { return __atomic_load_n(&get().rotations, __ATOMIC_RELAXED); }
+    static long long dropped() { return __atomic_load_n(&get().dropped, __ATOMIC_RELAXED); }
+
+    static uint64_t wall_us()
+    {
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+    }
+
+private:
+    struct mapping
+    {
+        char *base;
+        size_t size;
+        size_t tail;   // 下一个未分配的块
+        long long id;  // 第几个文件，线程用它判断自己的块是否属于当前文件
+    };
+
+    struct state
+    {
+        char path[256];
+        size_t size;
+        mapping *current;
+        mapping *retired; // 上一个文件，下次轮转时才解除映射，给还在往里写的线程留出时间
+        locker lock;      // 只在轮转时使用
+        long long rotations; // 同时是当前文件的id
+        long long dropped;
+    };
+
+    // 线程当前独占的块
+    struct block
+    {
+        long long id; // 所属文件的id，-1表示还没有块
+        char *cur;
+        char *end;
+    };
+
+    static state &get()
+    {
+        static state s = {{0}, 0, NULL, NULL};
+        return s;
+    }
+
+    static char *reserve(uint16_t len)
+    {
+        static thread_local block b = {-1, NULL, NULL};
+        state &s = get();
+        mapping *m = __atomic_load_n(&s.current, __ATOMIC_ACQUIRE);
+        if (!m || b.id != m->id || b.cur + len > b.end)
+        {
+            if (!next_block(s, b))
+            {
+                __atomic_add_fetch(&s.dropped, 1, __ATOMIC_RELAXED);
+                return NULL;
+            }
+        }
+        char *p = b.cur;
+        b.cur += len;
+        return p;
+    }
+
+    static bool next_block(state &s, block &b)
+    {
+        while (true)
+        {
+            mapping *m = __atomic_load_n(&s.current, __ATOMIC_ACQUIRE);
+            if (!m)
+            {
+                return false;
+            }
+            size_t off = __atomic_fetch_add(&m->tail, (size_t)BLOCK_SIZE, __ATOMIC_RELAXED);
+            if (off + BLOCK_SIZE <= m->size)
+            {
+                b.id = m->id;
+                b.cur = m->base + off;
+                b.end = b.cur + BLOCK_SIZE;
+                return true;
+            }
+            // 文件写满，第一个发现的线程负责轮转，其他线程等它完成后重新分配
+            s.lock.lock();
+            bool ok = true;
+            if (s.current == m)
+            {
+                ok = rotate(s);
+            }
+            s.lock.unlock();
+            if (!ok)
+            {
+                return false;
+            }
+        }
+    }
+
+    static bool rotate(state &s)
+    {
+        char old_path[270];
+        snprintf(old_path, sizeof(old_path), "%s.1", s.path);
+        if (rename(s.path, old_path) < 0)
+        {
+            return false;
+        }
+        mapping *m = map_file(s);
+        if (!m)
+        {
+            return false;
+        }
+        __atomic_add_fetch(&s.rotations, 1, __ATOMIC_RELAXED);
+        m->id = s.rotations;
+        unmap(s.retired);
+        s.retired = s.current;
+        __atomic_store_n(&s.current, m, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    static mapping *map_file(state &s)
+    {
+        int fd = ::open(s.path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+        {
+            return NULL;
+        }
+        // 预先分配磁盘空间：稀疏文件在磁盘满时写映射会收到SIGBUS
+        if (posix_fallocate(fd, 0, s.size) != 0)
+        {
+            ::close(fd);
+            return NULL;
+        }
+        void *p = mmap(NULL, s.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED)
+        {
+            return NULL;
+        }
+        access_log_header *h = (access_log_header *)p;
+        memcpy(h->magic, ACCESS_LOG_MAGIC, 8);
+        h->block_size = BLOCK_SIZE;
+        h->record_size = sizeof(access_record);
+        h->start_us = wall_us();
+        mapping *m = new mapping;
+        m->base = (char *)p;
+        m->size = s.size;
+        m->tail = BLOCK_SIZE;
+        m->id = 0;
+        return m;
+    }
+
+    static void unmap(mapping *m)
+    {
+        if (m)
+        {
+            munmap(m->base, m->size);
+            delete m;
+        }
+    }
+};
+
+#endif
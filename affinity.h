@@ -0,0 +1,258 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <pthread.h>
+#include <sched.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <new>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/filter.h>
+
+// CPU绑定与NUMA相关的工具函数
+
+#ifndef SO_INCOMING_CPU
+#define SO_INCOMING_CPU 49
+#endif
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF 51
+#endif
+
+#define AFFINITY_MPOL_PREFERRED 1 // 与<numaif.h>中的MPOL_PREFERRED一致，这里直接调用系统调用，不依赖libnuma
+
+// 解析形如 "0-3,8,10-11" 的CPU列表，结果追加到cpus中，格式错误返回false
+inline bool parse_cpu_list(const char *text, std::vector<int> &cpus)
+{
+    const char *p = text;
+    while (*p)
+    {
+        char *end = NULL;
+        long first = strtol(p, &end, 10);
+        if (end == p || first < 0)
+        {
+            return false;
+        }
+        long last = first;
+        p = end;
+        if (*p == '-')
+        {
+            ++p;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first)
+            {
+                return false;
+            }
+            p = end;
+        }
+        for (long cpu = first; cpu <= last; ++cpu)
+        {
+            cpus.push_back((int)cpu);
+        }
+        if (*p == ',')
+        {
+            ++p;
+        }
+        else if (*p != '\0')
+        {
+            return false;
+        }
+    }
+    return !cpus.empty();
+}
+
+// 将线程绑定到指定的CPU上，成功返回true
+inline bool bind_thread_cpu(pthread_t thread, int cpu)
+{
+    if (cpu < 0 || cpu >= CPU_SETSIZE)
+    {
+        return false;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(thread, sizeof(set), &set) == 0;
+}
+
+// 查询CPU所在的NUMA节点，无法确定时返回0（非NUMA机器上所有CPU都在节点0）
+inline int cpu_to_node(int cpu)
+{
+    if (cpu < 0)
+    {
+        return 0;
+    }
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR *dir = opendir(path);
+    if (!dir)
+    {
+        return 0;
+    }
+    int node = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] >= '0' && entry->d_name[4] <= '9')
+        {
+            node = atoi(entry->d_name + 4);
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+// 系统中NUMA节点的数量（最大节点号+1）
+inline int numa_node_count()
+{
+    DIR *dir = opendir("/sys/devices/system/node");
+    if (!dir)
+    {
+        return 1;
+    }
+    int count = 1;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] >= '0' && entry->d_name[4] <= '9')
+        {
+            int node = atoi(entry->d_name + 4);
+            if (node + 1 > count)
+            {
+                count = node + 1;
+            }
+        }
+    }
+    closedir(dir);
+    return count;
+}
+
+// 建立CPU号到NUMA节点号的映射表，避免在请求路径上反复读取sysfs
+inline void build_cpu_node_map(std::vector<int> &cpu_nodes)
+{
+    long count = sysconf(_SC_NPROCESSORS_CONF);
+    if (count <= 0)
+    {
+        count = 1;
+    }
+    cpu_nodes.resize(count);
+    for (long cpu = 0; cpu < count; ++cpu)
+    {
+        cpu_nodes[cpu] = cpu_to_node((int)cpu);
+    }
+}
+
+// 在指定NUMA节点上分配内存：先mmap出尚未触碰的匿名页，再用mbind设置首选节点，
+// 这样第一次写入时缺页分配的物理页就落在该节点上。node<0时不设置策略
+inline void *node_alloc(size_t size, int node)
+{
+    void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED)
+    {
+        return NULL;
+    }
+#ifdef SYS_mbind
+    if (node >= 0 && node < (int)(sizeof(unsigned long) * 8))
+    {
+        unsigned long mask = 1UL << node;
+        // mbind失败（比如内核不支持NUMA）时退化为普通内存，不影响正确性
+        syscall(SYS_mbind, addr, size, AFFINITY_MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0);
+    }
+#endif
+    return addr;
+}
+
+inline void node_free(void *addr, size_t size)
+{
+    if (addr)
+    {
+        munmap(addr, size);
+    }
+}
+
+// 按NUMA节点划分的对象池，对象以CHUNK个为一组在节点本地内存上分配，释放后放回所属节点的空闲链表。
+// 对象只构造一次、永不析构，适合http_conn这种常驻并反复init()的对象。非线程安全，只在主线程中使用
+template <typename T, int CHUNK = 64>
+class node_pool
+{
+public:
+    node_pool() : m_free(numa_node_count()) {}
+    ~node_pool()
+    {
+        for (size_t i = 0; i < m_chunks.size(); ++i)
+        {
+            node_free(m_chunks[i], sizeof(T) * CHUNK);
+        }
+    }
+
+    // node<0表示不关心节点，从0号链表分配且不设置内存策略
+    T *alloc(int node)
+    {
+        int index = (node < 0 || node >= (int)m_free.size()) ? 0 : node;
+        std::vector<T *> &list = m_free[index];
+        if (list.empty())
+        {
+            void *chunk = node_alloc(sizeof(T) * CHUNK, node);
+            if (!chunk)
+            {
+                return NULL;
+            }
+            m_chunks.push_back(chunk);
+            for (int i = CHUNK - 1; i >= 0; --i)
+            {
+                list.push_back(new ((char *)chunk + sizeof(T) * i) T());
+            }
+        }
+        T *obj = list.back();
+        list.pop_back();
+        return obj;
+    }
+
+    void release(T *obj, int node)
+    {
+        int index = (node < 0 || node >= (int)m_free.size()) ? 0 : node;
+        m_free[index].push_back(obj);
+    }
+
+private:
+    std::vector<std::vector<T *> > m_free; // 每个节点的空闲对象
+    std::vector<void *> m_chunks;          // 所有已分配的内存块
+};
+
+// 查询网卡中断（软中断）在哪个CPU上处理了这个socket的数据包，失败返回-1
+inline int get_incoming_cpu(int sockfd)
+{
+    int cpu = -1;
+    socklen_t len = sizeof(cpu);
+    if (getsockopt(sockfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) < 0)
+    {
+        return -1;
+    }
+    return cpu;
+}
+
+// 给fd所在的SO_REUSEPORT组挂上经典BPF程序：新连接交给组中第 (处理该SYN的CPU - base_cpu) % n 个socket，
+// 组内的顺序即各socket bind的顺序。程序挂在组上，组内任何socket都可以用来挂，之后加入的socket同样生效
+inline bool attach_cpu_steering(int fd, int base_cpu, int n)
+{
+    struct sock_filter code[] = {
+        {BPF_LD | BPF_W | BPF_ABS, 0, 0, (__u32)(SKF_AD_OFF + SKF_AD_CPU)}, // A = 当前CPU
+        {BPF_ALU | BPF_SUB | BPF_K, 0, 0, (__u32)base_cpu},
+        {BPF_ALU | BPF_MOD | BPF_K, 0, 0, (__u32)n},
+        {BPF_RET | BPF_A, 0, 0, 0},
+    };
+    struct sock_fprog prog;
+    prog.len = sizeof(code) / sizeof(code[0]);
+    prog.filter = code;
+    return setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == 0;
+}
+
+#endif
@@ -0,0 +1,428 @@
+#include "asset_arena.h"
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifndef MAP_HUGETLB
+#define MAP_HUGETLB 0x40000
+#endif
+
+static const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+// 与http_conn::add_headers生成的响应头保持一致
+static const char *asset_header_format = "HTTP/1.1 200 OK\r\nContent-Length: %d\r\nContent-Type:text/html\r\nConnection: %s\r\n\r\n";
+static const char *asset_linger[2] = {"close", "keep-alive"};
+
+#ifdef EMBED_ASSETS
+// 资源包由 tools/pack_assets 生成，编译时通过 .incbin 原样放进只读数据段
+#ifndef ASSET_BUNDLE_PATH
+#define ASSET_BUNDLE_PATH "resources.bundle"
+#endif
+__asm__(".section .rodata\n"
+        ".balign 64\n"
+        ".global asset_bundle_start\n"
+        "asset_bundle_start:\n"
+        ".incbin \"" ASSET_BUNDLE_PATH "\"\n"
+        ".global asset_bundle_end\n"
+        "asset_bundle_end:\n"
+        ".previous\n");
+extern "C" const char asset_bundle_start[];
+extern "C" const char asset_bundle_end[];
+
+bool embedded_bundle(const char **data, size_t *size)
+{
+    *data = asset_bundle_start;
+    *size = asset_bundle_end - asset_bundle_start;
+    return true;
+}
+#else
+bool embedded_bundle(const char **data, size_t *size)
+{
+    return false;
+}
+#endif
+
+asset_arena::asset_arena() : m_base(NULL), m_size(0)
+{
+}
+
+asset_arena::~asset_arena()
+{
+    if (m_base)
+    {
+        munmap(m_base, m_size);
+    }
+}
+
+uint32_t asset_arena::hash(const char *key, size_t len, uint32_t seed) // 带种子的FNV-1a
+{
+    uint32_t h = 2166136261u ^ (seed * 16777619u);
+    for (size_t i = 0; i < len; ++i)
+    {
+        h ^= (unsigned char)key[i];
+        h *= 16777619u;
+    }
+    h ^= h >> 15;
+    h *= 0x2c1b3c6du;
+    h ^= h >> 12;
+    return h;
+}
+
+// 递归收集root/prefix下所有对其他用户可读的普通文件，与do_request的访问权限检查一致
+bool asset_arena::collect(const char *root, const char *prefix, std::vector<source> &sources)
+{
+    char dir_path[512];
+    snprintf(dir_path, sizeof(dir_path), "%s%s", root, prefix);
+    DIR *dir = opendir(dir_path);
+    if (!dir)
+    {
+        perror("opendir");
+        return false;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        {
+            continue;
+        }
+        source src;
+        src.data = NULL;
+        int url_len = snprintf(src.url, sizeof(src.url), "%s/%s", prefix, entry->d_name);
+        int path_len = snprintf(src.path, sizeof(src.path), "%s%s", root, src.url);
+        if (url_len >= (int)sizeof(src.url) || path_len >= (int)sizeof(src.path))
+        {
+            continue;
+        }
+        struct stat st;
+        if (stat(src.path, &st) < 0)
+        {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode))
+        {
+            if (!collect(root, src.url, sources))
+            {
+                closedir(dir);
+                return false;
+            }
+            continue;
+        }
+        if (!S_ISREG(st.st_mode) || !(st.st_mode & S_IROTH))
+        {
+            continue;
+        }
+        src.len = st.st_size;
+        sources.push_back(src);
+    }
+    closedir(dir);
+    return true;
+}
+
+bool asset_arena::load_dir(const char *root, bool hugepage, bool lock)
+{
+    std::vector<source> sources;
+    if (!collect(root, "", sources))
+    {
+        return false;
+    }
+    return build(sources, hugepage, lock);
+}
+
+bool asset_arena::load_bundle(const char *data, size_t size, bool hugepage, bool lock)
+{
+    std::vector<source> sources;
+    size_t pos = 0;
+    while (pos < size)
+    {
+        source src;
+        uint32_t url_len;
+        uint64_t body_len;
+        if (size - pos < sizeof(url_len))
+        {
+            return false;
+        }
+        memcpy(&url_len, data + pos, sizeof(url_len));
+        pos += sizeof(url_len);
+        if (url_len >= sizeof(src.url) || size - pos < url_len + sizeof(body_len))
+        {
+            return false;
+        }
+        memcpy(src.url, data + pos, url_len);
+        src.url[url_len] = '\0';
+        pos += url_len;
+        memcpy(&body_len, data + pos, sizeof(body_len));
+        pos += sizeof(body_len);
+        if (size - pos < body_len)
+        {
+            return false;
+        }
+        src.data = data + pos;
+        src.path[0] = '\0';
+        src.len = body_len;
+        pos += body_len;
+        sources.push_back(src);
+    }
+    return build(sources, hugepage, lock);
+}
+
+bool asset_arena::write_bundle(const char *root, const char *out_path)
+{
+    std::vector<source> sources;
+    if (!collect(root, "", sources))
+    {
+        return false;
+    }
+    FILE *out = fopen(out_path, "wb");
+    if (!out)
+    {
+        perror("fopen");
+        return false;
+    }
+    bool ok = true;
+    char buf[8192];
+    for (size_t i = 0; i < sources.size() && ok; ++i)
+    {
+        uint32_t url_len = strlen(sources[i].url);
+        uint64_t body_len = sources[i].len;
+        fwrite(&url_len, sizeof(url_len), 1, out);
+        fwrite(sources[i].url, 1, url_len, out);
+        fwrite(&body_len, sizeof(body_len), 1, out);
+        FILE *in = fopen(sources[i].path, "rb");
+        if (!in)
+        {
+            ok = false;
+            break;
+        }
+        size_t copied = 0;
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), in)) > 0)
+        {
+            fwrite(buf, 1, n, out);
+            copied += n;
+        }
+        fclose(in);
+        ok = (copied == body_len); // 打包期间文件被修改
+    }
+    if (fclose(out) != 0)
+    {
+        ok = false;
+    }
+    return ok;
+}
+
+static bool read_file(const char *path, char *dst, size_t len)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+    size_t done = 0;
+    while (done < len)
+    {
+        ssize_t n = read(fd, dst + done, len - done);
+        if (n <= 0)
+        {
+            close(fd);
+            return false;
+        }
+        done += n;
+    }
+    close(fd);
+    return true;
+}
+
+bool asset_arena::build(std::vector<source> &sources, bool hugepage, bool lock)
+{
+    // 第一遍：计算arena的总大小。每个资源依次存放URL、两个版本的响应头和文件内容
+    size_t total = 0;
+    for (size_t i = 0; i < sources.size(); ++i)
+    {
+        total += strlen(sources[i].url) + 1;
+        for (int k = 0; k < 2; ++k)
+        {
+            total += snprintf(NULL, 0, asset_header_format, (int)sources[i].len, asset_linger[k]);
+        }
+        total += sources[i].len;
+    }
+    if (total == 0)
+    {
+        total = 1;
+    }
+
+    char *base = (char *)MAP_FAILED;
+    size_t size = total;
+    if (hugepage)
+    {
+        size = (total + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+        base = (char *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (base == MAP_FAILED)
+        {
+            // 没有预留大页时退化为透明大页
+            printf("hugetlb mapping failed, fall back to transparent huge pages\n");
+        }
+    }
+    if (base == MAP_FAILED)
+    {
+        size = total;
+        base = (char *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED)
+        {
+            perror("mmap");
+            return false;
+        }
+#ifdef MADV_HUGEPAGE
+        if (hugepage)
+        {
+            madvise(base, size, MADV_HUGEPAGE);
+        }
+#endif
+    }
+
+    // 第二遍：填充内容
+    std::vector<asset> assets(sources.size());
+    char *p = base;
+    for (size_t i = 0; i < sources.size(); ++i)
+    {
+        asset &a = assets[i];
+        a.url_len = strlen(sources[i].url);
+        memcpy(p, sources[i].url, a.url_len + 1);
+        a.url = p;
+        p += a.url_len + 1;
+        for (int k = 0; k < 2; ++k)
+        {
+            a.header_len[k] = sprintf(p, asset_header_format, (int)sources[i].len, asset_linger[k]);
+            a.header[k] = p;
+            p += a.header_len[k];
+        }
+        a.body = p;
+        a.body_len = sources[i].len;
+        if (sources[i].data)
+        {
+            memcpy(p, sources[i].data, a.body_len);
+        }
+        else if (!read_file(sources[i].path, p, a.body_len))
+        {
+            printf("preload %s failed\n", sources[i].path);
+            munmap(base, size);
+            return false;
+        }
+        p += a.body_len;
+    }
+
+    mprotect(base, size, PROT_READ);
+    if (lock && mlock(base, size) < 0)
+    {
+        perror("mlock");
+    }
+
+    if (m_base)
+    {
+        munmap(m_base, m_size);
+    }
+    m_base = base;
+    m_size = size;
+    m_assets.swap(assets);
+    return build_index();
+}
+
+// 哈希加位移（hash and displace）构造完美哈希：先把URL分到若干桶，
+// 从最大的桶开始，为每个桶寻找一个种子，使桶内所有URL落在互不冲突的空槽上
+bool asset_arena::build_index()
+{
+    size_t n = m_assets.size();
+    size_t bucket_count = n / 4 + 1;
+    size_t slot_count = n + n / 4 + 1;
+
+    while (true)
+    {
+        std::vector<std::vector<int> > buckets(bucket_count);
+        for (size_t i = 0; i < n; ++i)
+        {
+            buckets[hash(m_assets[i].url, m_assets[i].url_len, 0) % bucket_count].push_back(i);
+        }
+        std::vector<size_t> order(bucket_count);
+        for (size_t b = 0; b < bucket_count; ++b)
+        {
+            order[b] = b;
+        }
+        std::sort(order.begin(), order.end(), [&buckets](size_t x, size_t y) {
+            return buckets[x].size() > buckets[y].size();
+        });
+
+        m_seeds.assign(bucket_count, 0);
+        m_slots.assign(slot_count, -1);
+        bool ok = true;
+        std::vector<size_t> taken;
+        for (size_t o = 0; o < bucket_count && ok; ++o)
+        {
+            std::vector<int> &bucket = buckets[order[o]];
+            if (bucket.empty())
+            {
+                break;
+            }
+            uint32_t seed = 1;
+            for (; seed < 100000; ++seed)
+            {
+                taken.clear();
+                bool fit = true;
+                for (size_t k = 0; k < bucket.size() && fit; ++k)
+                {
+                    const asset &a = m_assets[bucket[k]];
+                    size_t slot = hash(a.url, a.url_len, seed) % slot_count;
+                    if (m_slots[slot] >= 0 || std::find(taken.begin(), taken.end(), slot) != taken.end())
+                    {
+                        fit = false;
+                    }
+                    taken.push_back(slot);
+                }
+                if (fit)
+                {
+                    break;
+                }
+            }
+            if (seed == 100000)
+            {
+                ok = false;
+                break;
+            }
+            m_seeds[order[o]] = seed;
+            for (size_t k = 0; k < bucket.size(); ++k)
+            {
+                m_slots[taken[k]] = bucket[k];
+            }
+        }
+        if (ok)
+        {
+            return true;
+        }
+        // 找不到种子时放大槽位表重试
+        slot_count = slot_count * 2;
+    }
+}
+
+const asset_arena::asset *asset_arena::find(const char *url, size_t len) const
+{
+    if (m_slots.empty())
+    {
+        return NULL;
+    }
+    uint32_t seed = m_seeds[hash(url, len, 0) % m_seeds.size()];
+    int index = m_slots[hash(url, len, seed) % m_slots.size()];
+    if (index < 0)
+    {
+        return NULL;
+    }
+    const asset &a = m_assets[index];
+    if ((size_t)a.url_len != len || memcmp(a.url, url, len) != 0)
+    {
+        return NULL;
+    }
+    return &a;
+}
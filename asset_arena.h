@@ -0,0 +1,63 @@
+#ifndef ASSET_ARENA_H
+#define ASSET_ARENA_H
+
+#include <cstddef>
+#include <stdint.h>
+#include <vector>
+
+// 静态资源预加载区：启动时把网站根目录下的所有文件读入一块连续内存（可选大页、mlock），
+// 同时为每个文件预先生成好响应头，并用完美哈希建立 URL -> 资源 的只读索引。
+// 预加载模式下处理请求只需一次哈希探测，不再有stat/open/mmap。
+// 资源目录在运行期间必须保持不变，索引建立后不再修改，可被所有工作线程无锁读取。
+class asset_arena
+{
+public:
+    struct asset
+    {
+        const char *url;          // 以'/'开头的URL，位于arena中
+        int url_len;
+        const char *header[2];    // 预生成的响应头，下标0为Connection: close，1为Connection: keep-alive
+        int header_len[2];
+        const char *body;         // 文件内容
+        size_t body_len;
+    };
+
+    asset_arena();
+    ~asset_arena();
+
+    // 遍历root目录加载所有可读的普通文件
+    bool load_dir(const char *root, bool hugepage, bool lock);
+    // 从打包好的资源包加载（见write_bundle），用于编译时嵌入到可执行文件中的资源
+    bool load_bundle(const char *data, size_t size, bool hugepage, bool lock);
+    // 把root目录打包成资源包文件，格式为若干条记录：u32 URL长度、URL、u64 文件长度、文件内容
+    static bool write_bundle(const char *root, const char *out_path);
+
+    // 查找URL对应的资源，不存在返回NULL
+    const asset *find(const char *url, size_t len) const;
+    int size() const { return (int)m_assets.size(); }
+
+private:
+    struct source
+    {
+        char url[256];
+        const char *data;   // 非NULL时资源内容来自内存（资源包）
+        char path[512];     // 否则从该文件读取
+        size_t len;
+    };
+
+    char *m_base;                  // arena起始地址
+    size_t m_size;                 // arena大小
+    std::vector<asset> m_assets;
+    std::vector<uint32_t> m_seeds; // 完美哈希第一级：每个桶的位移种子
+    std::vector<int> m_slots;      // 完美哈希第二级：槽位 -> m_assets下标，-1为空
+
+    static uint32_t hash(const char *key, size_t len, uint32_t seed);
+    static bool collect(const char *root, const char *prefix, std::vector<source> &sources);
+    bool build(std::vector<source> &sources, bool hugepage, bool lock);
+    bool build_index();
+};
+
+// 编译时用 -DEMBED_ASSETS 把资源包嵌入可执行文件，返回嵌入的资源包，没有时返回false
+bool embedded_bundle(const char **data, size_t *size);
+
+#endif
@@ -0,0 +1,100 @@
+#ifndef BODY_HANDLER_H
+#define BODY_HANDLER_H
+
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include "http_request.h"
+
+// 请求体（POST/PUT）处理器。请求体按块流式交给处理器，不会整体缓存在内存中：
+// 要么每读到一块就回调on_data（数据位于连接的读缓冲区中，回调返回后即被覆盖），
+// 要么由begin返回一个文件描述符，请求体经 socket -> pipe -> 文件 的splice直接落盘。
+// 每个请求创建一个处理器对象，请求体结束（或连接中断）后调用finish并delete。
+class body_handler
+{
+public:
+    virtual ~body_handler() {}
+
+    // 请求头解析完毕时调用，length为Content-Length。返回false表示拒绝该请求体（回复403，不再调用finish），
+    // 需要直接写入文件时把*file_fd设为已打开的文件，由处理器负责关闭
+    virtual bool begin(const http_request &req, long long length, int *file_fd) = 0;
+
+    // 回调模式下每收到一块请求体调用一次，返回false中止接收
+    virtual bool on_data(const char *data, int len) { return true; }
+
+    // 请求体接收完毕（ok为true）或被中止（ok为false），返回响应的状态码
+    virtual int finish(bool ok) = 0;
+};
+
+// 为一个请求创建处理器，返回NULL表示该URL/方法不接受请求体（405）
+typedef body_handler *(*body_handler_factory)(const http_request &req);
+
+// 内置的上传处理器：PUT/POST的请求体原样保存为 upload_dir + URL，经splice直接写入文件
+class file_upload_handler : public body_handler
+{
+public:
+    static const char *upload_dir; // 上传目录，为NULL时不接受上传
+
+    static body_handler *create(const http_request &req)
+    {
+        if (!upload_dir)
+        {
+            return NULL;
+        }
+        return new file_upload_handler;
+    }
+
+    file_upload_handler() : m_fd(-1), m_existed(false) {}
+    virtual ~file_upload_handler()
+    {
+        if (m_fd >= 0)
+        {
+            close(m_fd);
+        }
+    }
+
+    virtual bool begin(const http_request &req, long long length, int *file_fd)
+    {
+        std::string_view url = req.url();
+        // 不允许跳出上传目录
+        if (url.find("..") != std::string_view::npos || url.size() <= 1)
+        {
+            return false;
+        }
+        char path[512];
+        int len = snprintf(path, sizeof(path), "%s%.*s", upload_dir, (int)url.size(), url.data());
+        if (len >= (int)sizeof(path))
+        {
+            return false;
+        }
+        m_existed = access(path, F_OK) == 0;
+        m_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (m_fd < 0)
+        {
+            return false;
+        }
+        *file_fd = m_fd;
+        return true;
+    }
+
+    virtual int finish(bool ok)
+    {
+        if (m_fd >= 0)
+        {
+            close(m_fd);
+            m_fd = -1;
+        }
+        if (!ok)
+        {
+            return 500;
+        }
+        return m_existed ? 200 : 201;
+    }
+
+private:
+    int m_fd;
+    bool m_existed; // 文件原本已存在时返回200，新建时返回201
+};
+
+#endif
@@ -0,0 +1,168 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <cstddef>
+#include <cstdlib>
+#include <vector>
+#include "locker.h"
+#include "affinity.h"
+
+// 连接读写缓冲区的共享池：固定大小的块只在请求读取/处理/发送期间被连接持有，连接空闲时归还，
+// 内存随活跃请求数而不是打开的连接数增长。
+// 块按NUMA节点划分：以SLAB个为一组用node_alloc在节点本地内存上分配，块头记录所属节点，
+// 取的时候指定连接所在的节点，归还时回到块所属节点的链表，不会流到别的节点上。
+// 每个线程对每个节点有本地缓存，取还不加锁；本地缓存为空时从该节点的全局池批量取，过多时把一半交还。
+// 在reactor中取、在工作线程中还（或反过来）都可以。块的内容不清零。
+class buffer_pool
+{
+public:
+    static const int CHUNK_SIZE = 2048;
+    static const int CACHE_MAX = 128; // 线程本地缓存（每个节点）的上限
+    static const int BATCH = 32;      // 本地缓存为空时一次从全局池取的数量
+    static const int SLAB = 32;       // 一次在节点上分配的块数
+
+    // 取一个块，node为使用者（连接）所在的NUMA节点，-1表示未知。内存不足时返回NULL
+    static char *acquire(int node = -1)
+    {
+        node = node_index(node);
+        std::vector<chunk *> &c = local().free[node];
+        if (c.empty())
+        {
+            refill(c, node);
+        }
+        if (c.empty() && !grow(c, node))
+        {
+            return NULL;
+        }
+        chunk *ch = c.back();
+        c.pop_back();
+        __atomic_fetch_add(&counters().in_use, 1, __ATOMIC_RELAXED);
+        return ch->data;
+    }
+
+    // 归还，放进调用线程中块所属节点的缓存
+    static void release(char *buf)
+    {
+        chunk *ch = header(buf);
+        __atomic_fetch_sub(&counters().in_use, 1, __ATOMIC_RELAXED);
+        std::vector<chunk *> &c = local().free[ch->node];
+        c.push_back(ch);
+        if ((int)c.size() > CACHE_MAX)
+        {
+            spill(c, ch->node, CACHE_MAX / 2);
+        }
+    }
+
+    static int in_use() { return __atomic_load_n(&counters().in_use, __ATOMIC_RELAXED); }
+    static int allocated() { return __atomic_load_n(&counters().allocated, __ATOMIC_RELAXED); }
+
+private:
+    struct chunk
+    {
+        int node;                          // 所属节点的下标，分配后不变
+        alignas(64) char data[CHUNK_SIZE]; // 数据从单独的缓存行开始
+    };
+
+    struct depot
+    {
+        locker lock;
+        std::vector<chunk *> free;
+    };
+
+    struct cache
+    {
+        std::vector<std::vector<chunk *> > free; // 每个节点一个
+        cache() : free(node_count()) {}
+        ~cache() // 线程退出（线程池缩容）时交还全局池
+        {
+            for (size_t i = 0; i < free.size(); ++i)
+            {
+                spill(free[i], i, free[i].size());
+            }
+        }
+    };
+
+    struct stats
+    {
+        int in_use;
+        int allocated;
+    };
+
+    static chunk *header(char *buf)
+    {
+        return (chunk *)(buf - offsetof(chunk, data));
+    }
+
+    static int node_count()
+    {
+        static int n = numa_node_count();
+        return n;
+    }
+
+    // 未知或超出范围的节点都归到0号
+    static int node_index(int node)
+    {
+        return (node < 0 || node >= node_count()) ? 0 : node;
+    }
+
+    static cache &local()
+    {
+        static thread_local cache c;
+        return c;
+    }
+
+    static depot &global(int node)
+    {
+        static std::vector<depot> d(node_count());
+        return d[node];
+    }
+
+    static stats &counters()
+    {
+        static stats s = {0, 0};
+        return s;
+    }
+
+    // 在节点上新分配SLAB个块放进本地缓存。块在进程退出前不释放
+    static bool grow(std::vector<chunk *> &c, int node)
+    {
+        chunk *slab = (chunk *)node_alloc(sizeof(chunk) * SLAB, node);
+        if (!slab)
+        {
+            return false;
+        }
+        for (int i = SLAB - 1; i >= 0; --i)
+        {
+            slab[i].node = node;
+            c.push_back(&slab[i]);
+        }
+        __atomic_fetch_add(&counters().allocated, SLAB, __ATOMIC_RELAXED);
+        return true;
+    }
+
+    static void refill(std::vector<chunk *> &c, int node)
+    {
+        depot &d = global(node);
+        d.lock.lock();
+        for (int i = 0; i < BATCH && !d.free.empty(); ++i)
+        {
+            c.push_back(d.free.back());
+            d.free.pop_back();
+        }
+        d.lock.unlock();
+    }
+
+    static void spill(std::vector<chunk *> &c, int node, size_t count)
+    {
+        depot &d = global(node);
+        d.lock.lock();
+        for (size_t i = 0; i < count && !c.empty(); ++i)
+        {
+            d.free.push_back(c.back());
+            c.pop_back();
+        }
+        d.lock.unlock();
+    }
+};
+
+#endif
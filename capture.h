@@ -0,0 +1,178 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+#include <cstdio>
+#include <cstring>
+#include <time.h>
+#include <sys/time.h>
+#include "locker.h"
+
+// 流量录制（-W file）：把每个连接收到的请求字节和到达时间写入紧凑的二进制文件，
+// 用test_presure/replay.cpp按原来的节奏（或N倍速）回放，得到与线上相同的请求组成、头部大小和keep-alive模式。
+// 文件格式（小端）：
+//   文件头  8字节魔数 "WSCAP1\0\0"，8字节录制开始时的墙上时间（微秒）
+//   记录    4字节与上一条记录的时间差（微秒） 4字节连接号 1字节类型 4字节长度，随后是长度个字节的数据
+// 类型：CAP_OPEN 连接建立，CAP_DATA 读到的数据（TLS连接为解密后的明文），CAP_CLOSE 连接关闭。
+// 连接号取连接句柄中的代数，一次录制中不会重复。
+// 以splice直接写入文件的上传请求体不经过用户态，不被录制。
+// 记录先写进内存缓冲区，满了、距上次写出超过1秒或reactor空闲1秒时写入文件；进程被杀死时最后不到1秒的记录可能丢失，回放时忽略不完整的记录。
+enum capture_type
+{
+    CAP_OPEN = 1,
+    CAP_DATA = 2,
+    CAP_CLOSE = 3
+};
+
+const char CAPTURE_MAGIC[8] = {'W', 'S', 'C', 'A', 'P', '1', 0, 0};
+const int CAPTURE_HEADER_LEN = 16;
+const int CAPTURE_RECORD_LEN = 13;
+
+class traffic_capture
+{
+public:
+    static const int BUFFER_SIZE = 1 << 16;
+    static const long long FLUSH_US = 1000000;
+
+    // 只能在启动阶段调用
+    static bool open(const char *path)
+    {
+        state &s = get();
+        s.fp = fopen(path, "wb");
+        if (!s.fp)
+        {
+            return false;
+        }
+        setvbuf(s.fp, NULL, _IONBF, 0); // 自己按块缓冲，write_out之后数据就在文件里
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        char header[CAPTURE_HEADER_LEN];
+        memcpy(header, CAPTURE_MAGIC, 8);
+        put64(header + 8, (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec);
+        fwrite(header, 1, sizeof(header), s.fp);
+        s.last_us = s.flush_us = now_us();
+        return true;
+    }
+
+    static bool enabled() { return get().fp != NULL; }
+
+    static void record(int type, uint32_t conn, const char *data, uint32_t len)
+    {
+        state &s = get();
+        s.lock.lock();
+        long long now = now_us();
+        long long delta = now - s.last_us;
+        s.last_us = now;
+        char head[CAPTURE_RECORD_LEN];
+        put32(head, delta > 0xffffffffLL ? 0xffffffffu : (uint32_t)delta);
+        put32(head + 4, conn);
+        head[8] = (char)type;
+        put32(head + 9, len);
+        append(s, head, sizeof(head));
+        append(s, data, len);
+        if (now - s.flush_us >= FLUSH_US)
+        {
+            write_out(s);
+            s.flush_us = now;
+        }
+        s.lock.unlock();
+    }
+
+    static void flush()
+    {
+        state &s = get();
+        if (!s.fp)
+        {
+            return;
+        }
+        s.lock.lock();
+        write_out(s);
+        fflush(s.fp);
+        s.lock.unlock();
+    }
+
+    static void put32(char *p, uint32_t v)
+    {
+        for (int i = 0; i < 4; ++i)
+        {
+            p[i] = (char)(v >> (8 * i));
+        }
+    }
+
+    static void put64(char *p, uint64_t v)
+    {
+        for (int i = 0; i < 8; ++i)
+        {
+            p[i] = (char)(v >> (8 * i));
+        }
+    }
+
+    static uint32_t get32(const char *p)
+    {
+        uint32_t v = 0;
+        for (int i = 0; i < 4; ++i)
+        {
+            v |= (uint32_t)(unsigned char)p[i] << (8 * i);
+        }
+        return v;
+    }
+
+    static uint64_t get64(const char *p)
+    {
+        return get32(p) | (uint64_t)get32(p + 4) << 32;
+    }
+
+private:
+    struct state
+    {
+        FILE *fp;
+        locker lock;
+        long long last_us;  // 上一条记录的时间
+        long long flush_us; // 上次写入文件的时间
+        int used;
+        char buf[BUFFER_SIZE];
+    };
+
+    static state &get()
+    {
+        static state s = {NULL};
+        return s;
+    }
+
+    static long long now_us()
+    {
+        struct timespec t;
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        return t.tv_sec * 1000000LL + t.tv_nsec / 1000;
+    }
+
+    static void append(state &s, const char *data, uint32_t len)
+    {
+        if (s.used + len > (uint32_t)BUFFER_SIZE)
+        {
+            write_out(s);
+        }
+        if (len == 0)
+        {
+            return;
+        }
+        if (len > (uint32_t)BUFFER_SIZE)
+        {
+            fwrite(data, 1, len, s.fp);
+            return;
+        }
+        memcpy(s.buf + s.used, data, len);
+        s.used += len;
+    }
+
+    static void write_out(state &s)
+    {
+        if (s.used > 0)
+        {
+            fwrite(s.buf, 1, s.used, s.fp);
+            s.used = 0;
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,127 @@
+#ifndef COROUTINE_H
+#define COROUTINE_H
+
+// C++20协程支持：需要用 -std=c++20 编译，否则整个文件为空，服务器只能使用状态机模式
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+#define HAVE_COROUTINE 1
+
+#include <coroutine>
+#include <cstdlib>
+#include <stdint.h>
+#include <sys/epoll.h>
+
+extern void modfd(int epollfd, int fd, int ev, uint64_t data);
+
+// 协程帧的内存池：按64字节划分大小等级，每个等级一个空闲链表，
+// 连接数稳定后协程帧的分配和释放不再访问堆。协程只在主线程（reactor）中创建和销毁，
+// 这里仍使用thread_local，以免以后在多个线程中运行协程时互相干扰
+class frame_pool
+{
+public:
+    static const size_t ALIGN = 64;
+    static const size_t CLASSES = 32; // 最大可缓存的帧大小为 ALIGN * CLASSES = 2KB
+
+    static void *alloc(size_t size)
+    {
+        size_t cls = (size + ALIGN - 1) / ALIGN;
+        if (cls >= CLASSES)
+        {
+            return malloc(size);
+        }
+        free_block *&head = heads()[cls];
+        if (head)
+        {
+            free_block *block = head;
+            head = block->next;
+            return block;
+        }
+        return malloc(cls * ALIGN);
+    }
+
+    static void release(void *ptr, size_t size)
+    {
+        size_t cls = (size + ALIGN - 1) / ALIGN;
+        if (cls >= CLASSES)
+        {
+            free(ptr);
+            return;
+        }
+        free_block *block = (free_block *)ptr;
+        block->next = heads()[cls];
+        heads()[cls] = block;
+    }
+
+private:
+    struct free_block
+    {
+        free_block *next;
+    };
+
+    static free_block **heads()
+    {
+        static thread_local free_block *lists[CLASSES] = {};
+        return lists;
+    }
+};
+
+// 一个连接的协程：创建后立即运行到第一个co_await，结束时自动销毁，调用者不持有它
+struct co_task
+{
+    struct promise_type
+    {
+        co_task get_return_object() { return co_task(); }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { abort(); }
+
+        static void *operator new(size_t size) { return frame_pool::alloc(size); }
+        static void operator delete(void *ptr, size_t size) { frame_pool::release(ptr, size); }
+    };
+};
+
+// 记录挂起在某个fd上的协程，reactor在该fd有事件时调用resume()
+struct io_waiter
+{
+    std::coroutine_handle<> handle;
+    unsigned int revents; // 唤醒时的epoll事件
+
+    io_waiter() : handle(nullptr), revents(0) {}
+
+    // 由reactor调用，没有协程在等待时返回false
+    bool resume(unsigned int events)
+    {
+        if (!handle)
+        {
+            return false;
+        }
+        std::coroutine_handle<> h = handle;
+        handle = nullptr;
+        revents = events;
+        h.resume();
+        return true;
+    }
+};
+
+// co_await wait_io(...) 把fd以EPOLLONESHOT的方式注册ev事件，然后挂起，
+// 直到reactor收到该fd的事件后恢复，返回值为实际发生的epoll事件
+struct wait_io
+{
+    int epollfd;
+    int fd;
+    int ev;
+    uint64_t data; // 连接句柄
+    io_waiter &waiter;
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h)
+    {
+        waiter.handle = h;
+        modfd(epollfd, fd, ev, data);
+    }
+    unsigned int await_resume() const noexcept { return waiter.revents; }
+};
+
+#endif
+
+#endif
@@ -0,0 +1,1295 @@
+#include "http2.h"
+#include "http_conn.h"
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+extern const char *doc_root;
+extern const char *error_400_form;
+extern const char *error_403_form;
+extern const char *error_404_form;
+extern const char *error_500_form;
+extern const char *error_502_form;
+extern const char *error_429_form;
+
+// 帧类型
+enum
+{
+    H2_DATA = 0,
+    H2_HEADERS,
+    H2_PRIORITY,
+    H2_RST_STREAM,
+    H2_SETTINGS,
+    H2_PUSH_PROMISE,
+    H2_PING,
+    H2_GOAWAY,
+    H2_WINDOW_UPDATE,
+    H2_CONTINUATION
+};
+
+// 帧标志
+const int H2_FLAG_END_STREAM = 0x1;
+const int H2_FLAG_ACK = 0x1;
+const int H2_FLAG_END_HEADERS = 0x4;
+const int H2_FLAG_PADDED = 0x8;
+const int H2_FLAG_PRIORITY = 0x20;
+
+// 错误码
+enum
+{
+    H2_NO_ERROR = 0,
+    H2_PROTOCOL_ERROR,
+    H2_INTERNAL_ERROR,
+    H2_FLOW_CONTROL_ERROR,
+    H2_SETTINGS_TIMEOUT,
+    H2_STREAM_CLOSED,
+    H2_FRAME_SIZE_ERROR,
+    H2_REFUSED_STREAM,
+    H2_CANCEL,
+    H2_COMPRESSION_ERROR,
+    H2_CONNECT_ERROR,
+    H2_ENHANCE_YOUR_CALM
+};
+
+const int64_t H2_MAX_WINDOW = 0x7fffffff;
+const int64_t H2_DEFAULT_WINDOW = 65535;
+
+// RFC 7541 附录A 静态表，下标从1开始
+static const std::string_view static_table[62][2] = {
+    {"", ""},
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""}};
+const uint64_t STATIC_TABLE_LEN = 61;
+
+// RFC 7541 附录B 哈夫曼编码，第256项为EOS
+static const uint32_t huffman_codes[257] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+    0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+    0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+    0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+    0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+    0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+    0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+    0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+    0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+    0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+    0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+    0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+    0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+    0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+    0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+    0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+    0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+    0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+    0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+    0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+    0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+    0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+    0x3fffffff,
+};
+static const uint8_t huffman_lens[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+// 哈夫曼解码树，第一次使用时构造
+struct huffman_node
+{
+    short child[2];
+    short sym; // 叶子节点的符号，内部节点为-1
+};
+
+static const huffman_node *huffman_tree()
+{
+    static std::vector<huffman_node> tree;
+    static bool built = [] {
+        huffman_node root = {{-1, -1}, -1};
+        tree.push_back(root);
+        for (int sym = 0; sym < 257; ++sym)
+        {
+            int cur = 0;
+            for (int i = huffman_lens[sym] - 1; i >= 0; --i)
+            {
+                int bit = (huffman_codes[sym] >> i) & 1;
+                if (tree[cur].child[bit] < 0)
+                {
+                    huffman_node node = {{-1, -1}, -1};
+                    tree.push_back(node);
+                    tree[cur].child[bit] = tree.size() - 1;
+                }
+                cur = tree[cur].child[bit];
+            }
+            tree[cur].sym = sym;
+        }
+        return true;
+    }();
+    (void)built;
+    return tree.data();
+}
+
+static bool huffman_decode(const uint8_t *p, size_t len, std::string &out)
+{
+    const huffman_node *tree = huffman_tree();
+    out.clear();
+    int cur = 0;
+    int pad_bits = 0;     // 上一个符号之后读过的位数
+    bool pad_ones = true; // 这些位是否全为1
+    for (size_t i = 0; i < len; ++i)
+    {
+        for (int b = 7; b >= 0; --b)
+        {
+            int bit = (p[i] >> b) & 1;
+            cur = tree[cur].child[bit];
+            if (cur < 0)
+            {
+                return false;
+            }
+            ++pad_bits;
+            pad_ones = pad_ones && bit;
+            if (tree[cur].sym >= 0)
+            {
+                if (tree[cur].sym == 256)
+                {
+                    return false; // 字符串中出现EOS
+                }
+                out.push_back((char)tree[cur].sym);
+                cur = 0;
+                pad_bits = 0;
+                pad_ones = true;
+            }
+        }
+    }
+    // 末尾的填充必须是少于8位的EOS前缀（全1）
+    return pad_bits < 8 && pad_ones;
+}
+
+// N位前缀的整数
+static bool decode_int(const uint8_t *&p, const uint8_t *end, int prefix, uint64_t &value)
+{
+    if (p >= end)
+    {
+        return false;
+    }
+    uint64_t max = (1u << prefix) - 1;
+    value = *p++ & max;
+    if (value < max)
+    {
+        return true;
+    }
+    for (int shift = 0; p < end && shift <= 28; shift += 7)
+    {
+        uint8_t b = *p++;
+        value += (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool decode_string(const uint8_t *&p, const uint8_t *end, std::string &out)
+{
+    if (p >= end)
+    {
+        return false;
+    }
+    bool huffman = *p & 0x80;
+    uint64_t len;
+    if (!decode_int(p, end, 7, len) || len > (uint64_t)(end - p))
+    {
+        return false;
+    }
+    if (huffman)
+    {
+        if (!huffman_decode(p, len, out))
+        {
+            return false;
+        }
+    }
+    else
+    {
+        out.assign((const char *)p, len);
+    }
+    p += len;
+    return true;
+}
+
+static void encode_int(std::string &out, uint8_t first, int prefix, uint64_t value)
+{
+    uint64_t max = (1u << prefix) - 1;
+    if (value < max)
+    {
+        out.push_back((char)(first | value));
+        return;
+    }
+    out.push_back((char)(first | max));
+    value -= max;
+    while (value >= 128)
+    {
+        out.push_back((char)(0x80 | (value & 0x7f)));
+        value >>= 7;
+    }
+    out.push_back((char)value);
+}
+
+// 不加入动态表的字面值，名称取静态表的下标，值不做哈夫曼编码
+static void encode_literal(std::string &out, int name_index, std::string_view value)
+{
+    encode_int(out, 0x00, 4, name_index);
+    encode_int(out, 0x00, 7, value.size());
+    out.append(value.data(), value.size());
+}
+
+bool hpack_decoder::lookup(uint64_t index, std::string &name, std::string &value) const
+{
+    if (index == 0)
+    {
+        return false;
+    }
+    if (index <= STATIC_TABLE_LEN)
+    {
+        name.assign(static_table[index][0]);
+        value.assign(static_table[index][1]);
+        return true;
+    }
+    index -= STATIC_TABLE_LEN + 1;
+    if (index >= m_table.size())
+    {
+        return false;
+    }
+    name = m_table[index].first;
+    value = m_table[index].second;
+    return true;
+}
+
+void hpack_decoder::evict(size_t limit)
+{
+    while (m_size > limit && !m_table.empty())
+    {
+        m_size -= m_table.back().first.size() + m_table.back().second.size() + 32;
+        m_table.pop_back();
+    }
+}
+
+void hpack_decoder::add(const std::string &name, const std::string &value)
+{
+    size_t size = name.size() + value.size() + 32;
+    if (size > m_max_size)
+    {
+        // 比整个表还大的条目使表清空
+        evict(0);
+        return;
+    }
+    evict(m_max_size - size);
+    m_table.push_front(std::make_pair(name, value));
+    m_size += size;
+}
+
+bool hpack_decoder::decode(const uint8_t *p, size_t len, header_list &out)
+{
+    const uint8_t *end = p + len;
+    std::string name, value;
+    bool field_seen = false;
+    size_t list_size = 0;
+    while (p < end)
+    {
+        uint8_t b = *p;
+        uint64_t index;
+        if (b & 0x80)
+        {
+            // 索引的头部字段
+            if (!decode_int(p, end, 7, index) || !lookup(index, name, value))
+            {
+                return false;
+            }
+        }
+        else if ((b & 0xe0) == 0x20)
+        {
+            // 动态表大小更新，只能出现在头部块开头
+            if (field_seen || !decode_int(p, end, 5, index) || index > TABLE_SIZE)
+            {
+                return false;
+            }
+            m_max_size = index;
+            evict(m_max_size);
+            continue;
+        }
+        else
+        {
+            // 字面值：01 加入动态表，0000 不加入，0001 永不加入
+            bool incremental = (b & 0xc0) == 0x40;
+            if (!decode_int(p, end, incremental ? 6 : 4, index))
+            {
+                return false;
+            }
+            if (index == 0)
+            {
+                if (!decode_string(p, end, name))
+                {
+                    return false;
+                }
+            }
+            else if (!lookup(index, name, value))
+            {
+                return false;
+            }
+            if (!decode_string(p, end, value))
+            {
+                return false;
+            }
+            if (incremental)
+            {
+                add(name, value);
+            }
+        }
+        field_seen = true;
+        // 超过上限时已解码的部分也作废：头部块不能只处理一半，否则动态表与对方不一致，只能作为连接错误
+        list_size += name.size() + value.size() + 32;
+        if (list_size > MAX_LIST_SIZE)
+        {
+            return false;
+        }
+        out.push_back(std::make_pair(name, value));
+    }
+    return true;
+}
+
+h2_stream::h2_stream(uint32_t stream_id, int64_t window)
+    : id(stream_id), send_window(window), end_stream(false), body(NULL), body_len(0), sent(0),
+      owned(NULL), gen(NULL), map(NULL), map_len(0)
+{
+}
+
+h2_stream::~h2_stream()
+{
+    delete gen;
+    if (owned)
+    {
+        buffer_pool::release(owned);
+    }
+    if (map)
+    {
+        munmap(map, map_len);
+    }
+}
+
+h2_session::h2_session(http_conn *conn)
+    : m_conn(conn), m_preface_received(false), m_last_stream(0), m_block_stream(0), m_block_end_stream(false),
+      m_send_window(H2_DEFAULT_WINDOW), m_peer_initial_window(H2_DEFAULT_WINDOW), m_peer_max_frame(16384),
+      m_goaway_sent(false), m_peer_goaway(false), m_iv_count(0)
+{
+}
+
+h2_session::~h2_session()
+{
+    for (std::map<uint32_t, h2_stream *>::iterator it = m_streams.begin(); it != m_streams.end(); ++it)
+    {
+        delete it->second;
+    }
+    for (size_t i = 0; i < m_done.size(); ++i)
+    {
+        delete m_done[i];
+    }
+}
+
+void h2_session::queue_frame(int type, int flags, uint32_t sid, const void *payload, size_t len)
+{
+    uint8_t hdr[9] = {(uint8_t)(len >> 16), (uint8_t)(len >> 8), (uint8_t)len, (uint8_t)type, (uint8_t)flags,
+                      (uint8_t)(sid >> 24), (uint8_t)(sid >> 16), (uint8_t)(sid >> 8), (uint8_t)sid};
+    m_ctrl.append((const char *)hdr, 9);
+    m_ctrl.append((const char *)payload, len);
+}
+
+void h2_session::queue_window_update(uint32_t sid, uint32_t increment)
+{
+    uint8_t payload[4] = {(uint8_t)(increment >> 24), (uint8_t)(increment >> 16), (uint8_t)(increment >> 8), (uint8_t)increment};
+    queue_frame(H2_WINDOW_UPDATE, 0, sid, payload, 4);
+}
+
+void h2_session::start()
+{
+    // 服务端的连接前言：一个SETTINGS帧，SETTINGS_MAX_CONCURRENT_STREAMS和SETTINGS_MAX_HEADER_LIST_SIZE
+    const uint32_t list = hpack_decoder::MAX_LIST_SIZE;
+    uint8_t settings[12] = {0, 3, 0, 0, 0, MAX_STREAMS,
+                            0, 6, (uint8_t)(list >> 24), (uint8_t)(list >> 16), (uint8_t)(list >> 8), (uint8_t)list};
+    queue_frame(H2_SETTINGS, 0, 0, settings, sizeof(settings));
+}
+
+static int base64url_value(char c)
+{
+    if (c >= 'A' && c <= 'Z')
+        return c - 'A';
+    if (c >= 'a' && c <= 'z')
+        return c - 'a' + 26;
+    if (c >= '0' && c <= '9')
+        return c - '0' + 52;
+    if (c == '-' || c == '+')
+        return 62;
+    if (c == '_' || c == '/')
+        return 63;
+    return -1;
+}
+
+bool h2_session::start_upgrade(const http_request &req)
+{
+    // HTTP2-Settings是base64url编码的SETTINGS帧负载
+    std::string_view encoded = req.get(HDR_HTTP2_SETTINGS);
+    std::string settings;
+    uint32_t acc = 0;
+    int bits = 0;
+    for (size_t i = 0; i < encoded.size() && encoded[i] != '='; ++i)
+    {
+        int v = base64url_value(encoded[i]);
+        if (v < 0)
+        {
+            return false;
+        }
+        acc = (acc << 6) | v;
+        bits += 6;
+        if (bits >= 8)
+        {
+            bits -= 8;
+            settings.push_back((char)(acc >> bits));
+        }
+    }
+    if (!apply_settings((const uint8_t *)settings.data(), settings.size()))
+    {
+        return false;
+    }
+
+    static const char switching[] = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+    m_ctrl.append(switching, sizeof(switching) - 1);
+    start();
+
+    // 升级的请求成为流1，请求已完整接收
+    h2_stream *s = new h2_stream(1, m_peer_initial_window);
+    m_streams[1] = s;
+    m_last_stream = 1;
+    s->end_stream = true;
+    header_list fields;
+    fields.push_back(std::make_pair(std::string(":method"), std::string(req.method())));
+    fields.push_back(std::make_pair(std::string(":path"), std::string(req.url())));
+    for (int i = 0; i < req.header_count(); ++i)
+    {
+        HEADER_ID id = req.id(i);
+        if (id == HDR_CONNECTION || id == HDR_UPGRADE || id == HDR_HTTP2_SETTINGS || id == HDR_KEEP_ALIVE)
+        {
+            continue;
+        }
+        fields.push_back(std::make_pair(std::string(req.name(i)), std::string(req.value(i))));
+    }
+    if (!set_request(s, fields))
+    {
+        stream_error(1, H2_PROTOCOL_ERROR);
+        return true;
+    }
+    dispatch(s);
+    return true;
+}
+
+bool h2_session::connection_error(uint32_t code)
+{
+    uint8_t payload[8] = {(uint8_t)(m_last_stream >> 24), (uint8_t)(m_last_stream >> 16), (uint8_t)(m_last_stream >> 8), (uint8_t)m_last_stream,
+                          (uint8_t)(code >> 24), (uint8_t)(code >> 16), (uint8_t)(code >> 8), (uint8_t)code};
+    queue_frame(H2_GOAWAY, 0, 0, payload, sizeof(payload));
+    m_goaway_sent = true;
+    return false;
+}
+
+void h2_session::stream_error(uint32_t sid, uint32_t code)
+{
+    uint8_t payload[4] = {(uint8_t)(code >> 24), (uint8_t)(code >> 16), (uint8_t)(code >> 8), (uint8_t)code};
+    queue_frame(H2_RST_STREAM, 0, sid, payload, sizeof(payload));
+    std::map<uint32_t, h2_stream *>::iterator it = m_streams.find(sid);
+    if (it != m_streams.end())
+    {
+        retire(it->second);
+    }
+}
+
+bool h2_session::expect_preface()
+{
+    size_t n = m_in.size() < (size_t)H2_PREFACE_LEN ? m_in.size() : H2_PREFACE_LEN;
+    if (memcmp(m_in.data(), H2_PREFACE, n) != 0)
+    {
+        return connection_error(H2_PROTOCOL_ERROR);
+    }
+    if (n == (size_t)H2_PREFACE_LEN)
+    {
+        m_in.erase(0, H2_PREFACE_LEN);
+        m_preface_received = true;
+    }
+    return true;
+}
+
+bool h2_session::feed(const char *data, int len)
+{
+    if (m_goaway_sent)
+    {
+        return false;
+    }
+    m_in.append(data, len);
+    if (!m_preface_received && (!expect_preface() || !m_preface_received))
+    {
+        return !m_goaway_sent;
+    }
+    size_t pos = 0;
+    while (m_in.size() - pos >= 9)
+    {
+        const uint8_t *h = (const uint8_t *)m_in.data() + pos;
+        uint32_t flen = (h[0] << 16) | (h[1] << 8) | h[2];
+        if (flen > (uint32_t)MAX_FRAME_SIZE)
+        {
+            return connection_error(H2_FRAME_SIZE_ERROR);
+        }
+        if (m_in.size() - pos < 9 + flen)
+        {
+            break;
+        }
+        uint32_t sid = ((h[5] & 0x7f) << 24) | (h[6] << 16) | (h[7] << 8) | h[8];
+        if (!on_frame(h[3], h[4], sid, h + 9, flen))
+        {
+            return false;
+        }
+        pos += 9 + flen;
+        if (m_ctrl.size() > (size_t)MAX_CTRL_PENDING)
+        {
+            // 对方不停地发PING/SETTINGS等需要回复的帧却不读：丢掉积压的回复，只发GOAWAY
+            m_ctrl.clear();
+            return connection_error(H2_ENHANCE_YOUR_CALM);
+        }
+    }
+    m_in.erase(0, pos);
+    return true;
+}
+
+bool h2_session::apply_settings(const uint8_t *p, uint32_t len)
+{
+    if (len % 6 != 0)
+    {
+        return connection_error(H2_FRAME_SIZE_ERROR);
+    }
+    for (uint32_t i = 0; i < len; i += 6)
+    {
+        int id = (p[i] << 8) | p[i + 1];
+        uint32_t value = ((uint32_t)p[i + 2] << 24) | (p[i + 3] << 16) | (p[i + 4] << 8) | p[i + 5];
+        switch (id)
+        {
+        case 2: // SETTINGS_ENABLE_PUSH，服务端从不推送
+            if (value > 1)
+            {
+                return connection_error(H2_PROTOCOL_ERROR);
+            }
+            break;
+        case 4: // SETTINGS_INITIAL_WINDOW_SIZE，差值作用于所有已打开的流
+        {
+            if (value > H2_MAX_WINDOW)
+            {
+                return connection_error(H2_FLOW_CONTROL_ERROR);
+            }
+            int64_t delta = (int64_t)value - m_peer_initial_window;
+            m_peer_initial_window = value;
+            for (std::map<uint32_t, h2_stream *>::iterator it = m_streams.begin(); it != m_streams.end(); ++it)
+            {
+                it->second->send_window += delta;
+            }
+            break;
+        }
+        case 5: // SETTINGS_MAX_FRAME_SIZE
+            if (value < 16384 || value > 16777215)
+            {
+                return connection_error(H2_PROTOCOL_ERROR);
+            }
+            m_peer_max_frame = value;
+            break;
+        default: // 响应头不使用动态表，SETTINGS_HEADER_TABLE_SIZE无需处理；未知的设置忽略
+            break;
+        }
+    }
+    return true;
+}
+
+bool h2_session::on_frame(int type, int flags, uint32_t sid, const uint8_t *payload, uint32_t len)
+{
+    // 头部块必须由连续的CONTINUATION帧完成，中间不能插入其他帧
+    if (m_block_stream && (type != H2_CONTINUATION || sid != m_block_stream))
+    {
+        return connection_error(H2_PROTOCOL_ERROR);
+    }
+
+    switch (type)
+    {
+    case H2_DATA:
+    {
+        if (sid == 0)
+        {
+            return connection_error(H2_PROTOCOL_ERROR);
+        }
+        // 请求体不被使用，收到多少就立即归还多少窗口
+        if (len > 0)
+        {
+            queue_window_update(0, len);
+        }
+        std::map<uint32_t, h2_stream *>::iterator it = m_streams.find(sid);
+        if (it == m_streams.end() || it->second->end_stream)
+        {
+            if (sid > m_last_stream)
+            {
+                return connection_error(H2_PROTOCOL_ERROR);
+            }
+            stream_error(sid, H2_STREAM_CLOSED);
+            return true;
+        }
+        h2_stream *s = it->second;
+        if (flags & H2_FLAG_END_STREAM)
+        {
+            s->end_stream = true;
+            dispatch(s);
+        }
+        else if (len > 0)
+        {
+            queue_window_update(sid, len);
+        }
+        return true;
+    }
+    case H2_HEADERS:
+    {
+        if (sid == 0 || !(sid & 1))
+        {
+            return connection_error(H2_PROTOCOL_ERROR);
+        }
+        uint32_t skip = 0;
+        uint32_t pad = 0;
+        if (flags & H2_FLAG_PADDED)
+        {
+            if (len < 1)
+            {
+                return connection_error(H2_PROTOCOL_ERROR);
+            }
+            pad = payload[0];
+            skip = 1;
+        }
+        if (flags & H2_FLAG_PRIORITY)
+        {
+            skip += 5;
+        }
+        if (skip + pad > len)
+        {
+            return connection_error(H2_PROTOCOL_ERROR);
+        }
+        std::map<uint32_t, h2_stream *>::iterator it = m_streams.find(sid);
+        if (it == m_streams.end())
+        {
+            if (sid <= m_last_stream)
+            {
+                return connection_error(H2_STREAM_CLOSED);
+            }
+            m_last_stream = sid;
+        }
+        else if (it->second->end_stream)
+        {
+            return connection_error(H2_STREAM_CLOSED);
+        }
+        m_block.assign((const char *)payload + skip, len - skip - pad);
+        m_block_stream = sid;
+        m_block_end_stream = flags & H2_FLAG_END_STREAM;
+        if (flags & H2_FLAG_END_HEADERS)
+        {
+            return on_headers_block();
+        }
+        return true;
+    }
+    case H2_CONTINUATION:
+    {
+        if (!m_block_stream)
+        {
+            return connection_error(H2_PROTOCOL_ERROR);
+        }
+        if (m_block.size() + len > (size_t)MAX_HEADER_BLOCK)
+        {
+            return connection_error(H2_PROTOCOL_ERROR);
+        }
+        m_block.append((const char *)payload, len);
+        if (flags & H2_FLAG_END_HEADERS)
+        {
+            return on_headers_block();
+        }
+        return true;
+    }
+    case H2_PRIORITY:
+        if (sid == 0)
+        {
+            return connection_error(H2_PROTOCOL_ERROR);
+        }
+        if (len != 5)
+        {
+            stream_error(sid, H2_FRAME_SIZE_ERROR);
+        }
+        return true; // 不按优先级调度
+    case H2_RST_STREAM:
+    {
+        if (sid == 0 || sid > m_last_stream)
+        {
+            return connection_error(H2_PROTOCOL_ERROR);
+        }
+        if (len != 4)
+        {
+            return connection_error(H2_FRAME_SIZE_ERROR);
+        }
+        std::map<uint32_t, h2_stream *>::iterator it = m_streams.find(sid);
+        if (it != m_streams.end())
+        {
+            retire(it->second);
+        }
+        return true;
+    }
+    case H2_SETTINGS:
+        if (sid != 0)
+        {
+            return connection_error(H2_PROTOCOL_ERROR);
+        }
+        if (flags & H2_FLAG_ACK)
+        {
+            return len == 0 ? true : connection_error(H2_FRAME_SIZE_ERROR);
+        }
+        if (!apply_settings(payload, len))
+        {
+            return false;
+        }
+        queue_frame(H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+        return true;
+    case H2_PING:
+        if (sid != 0)
+        {
+            return connection_error(H2_PROTOCOL_ERROR);
+        }
+        if (len != 8)
+        {
+            return connection_error(H2_FRAME_SIZE_ERROR);
+        }
+        if (!(flags & H2_FLAG_ACK))
+        {
+            queue_frame(H2_PING, H2_FLAG_ACK, 0, payload, 8);
+        }
+        return true;
+    case H2_GOAWAY:
+        if (sid != 0)
+        {
+            return connection_error(H2_PROTOCOL_ERROR);
+        }
+        m_peer_goaway = true;
+        return true;
+    case H2_WINDOW_UPDATE:
+    {
+        if (len != 4)
+        {
+            return connection_error(H2_FRAME_SIZE_ERROR);
+        }
+        uint32_t increment = (((uint32_t)payload[0] & 0x7f) << 24) | (payload[1] << 16) | (payload[2] << 8) | payload[3];
+        if (sid == 0)
+        {
+            if (increment == 0 || m_send_window + increment > H2_MAX_WINDOW)
+            {
+                return connection_error(increment == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR);
+            }
+            m_send_window += increment;
+            return true;
+        }
+        std::map<uint32_t, h2_stream *>::iterator it = m_streams.find(sid);
+        if (it == m_streams.end())
+        {
+            return true; // 已经结束的流
+        }
+        if (increment == 0 || it->second->send_window + increment > H2_MAX_WINDOW)
+        {
+            stream_error(sid, increment == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR);
+            return true;
+        }
+        it->second->send_window += increment;
+        return true;
+    }
+    case H2_PUSH_PROMISE: // 客户端不能推送
+        return connection_error(H2_PROTOCOL_ERROR);
+    default: // 未知类型的帧忽略
+        return true;
+    }
+}
+
+bool h2_session::on_headers_block()
+{
+    uint32_t sid = m_block_stream;
+    m_block_stream = 0;
+    header_list fields;
+    // 无论是否接受这个流都要解码，保持动态表与对方一致
+    if (!m_decoder.decode((const uint8_t *)m_block.data(), m_block.size(), fields))
+    {
+        return connection_error(H2_COMPRESSION_ERROR);
+    }
+
+    std::map<uint32_t, h2_stream *>::iterator it = m_streams.find(sid);
+    if (it != m_streams.end())
+    {
+        // 请求体之后的trailer，只关心是否结束
+        if (!m_block_end_stream)
+        {
+            stream_error(sid, H2_PROTOCOL_ERROR);
+            return true;
+        }
+        it->second->end_stream = true;
+        dispatch(it->second);
+        return true;
+    }
+    if (m_peer_goaway || m_goaway_sent || (int)m_streams.size() >= MAX_STREAMS)
+    {
+        stream_error(sid, H2_REFUSED_STREAM);
+        return true;
+    }
+    h2_stream *s = new h2_stream(sid, m_peer_initial_window);
+    m_streams[sid] = s;
+    if (!set_request(s, fields))
+    {
+        stream_error(sid, H2_PROTOCOL_ERROR);
+        return true;
+    }
+    if (m_block_end_stream)
+    {
+        s->end_stream = true;
+        dispatch(s);
+    }
+    return true;
+}
+
+// 把解码出的字段整理成http_request：请求行来自伪头部，:authority作为Host
+bool h2_session::set_request(h2_stream *s, const header_list &fields)
+{
+    std::string_view method, path, authority;
+    size_t total = 0;
+    for (size_t i = 0; i < fields.size(); ++i)
+    {
+        const std::string &name = fields[i].first;
+        if (name == ":method")
+            method = fields[i].second;
+        else if (name == ":path")
+            path = fields[i].second;
+        else if (name == ":authority")
+            authority = fields[i].second;
+        total += name.size() + fields[i].second.size();
+    }
+    if (method.empty() || path.empty() || path[0] != '/' || total > 60000)
+    {
+        return false;
+    }
+
+    std::string &buf = s->hbuf;
+    buf.reserve(total + 16);
+    buf.append(method).append(path).append("HTTP/2.0");
+    std::vector<size_t> offsets;
+    for (size_t i = 0; i < fields.size(); ++i)
+    {
+        if (fields[i].first[0] == ':')
+        {
+            continue;
+        }
+        offsets.push_back(i);
+        offsets.push_back(buf.size());
+        buf.append(fields[i].first).append(fields[i].second);
+    }
+    size_t host_off = buf.size();
+    buf.append("host").append(authority);
+
+    // buf不再变化，可以记录指针了
+    http_request &req = s->req;
+    const char *base = buf.data();
+    req.reset(base);
+    req.set_request_line(base, method.size(), base + method.size(), path.size(), base + method.size() + path.size(), 8);
+    for (size_t k = 0; k < offsets.size(); k += 2)
+    {
+        const std::pair<std::string, std::string> &f = fields[offsets[k]];
+        const char *name = base + offsets[k + 1];
+        req.add_header(name, f.first.size(), name + f.first.size(), f.second.size());
+    }
+    if (!authority.empty() && !req.has(HDR_HOST))
+    {
+        req.add_header(base + host_off, 4, base + host_off + 4, authority.size());
+    }
+    return true;
+}
+
+// 按与HTTP/1.1相同的顺序查找：路由表、代理路由、预加载区、网站根目录
+void h2_session::dispatch(h2_stream *s)
+{
+    const http_request &req = s->req;
+    std::string_view method = req.method();
+    std::string_view url = req.url();
+    int method_bit = method == "GET" ? ROUTE_GET : method == "POST" ? ROUTE_POST : method == "PUT" ? ROUTE_PUT : 0;
+
+    // 同一个连接上的每个流都算一个请求，Unix域套接字上的本机连接不限流
+    if (!m_conn->is_local() && !rate_limiter::allow(m_conn->get_address().sin_addr.s_addr))
+    {
+        respond(s, 429, "text/html", error_429_form, strlen(error_429_form));
+        return;
+    }
+    if (http_conn::m_router && method_bit)
+    {
+        route_params params;
+        route_fn fn = http_conn::m_router->match(method_bit, url.substr(0, url.find('?')), params);
+        if (fn)
+        {
+            s->owned = buffer_pool::acquire(m_conn->get_node());
+            if (!s->owned)
+            {
+                respond(s, 500, "text/html", error_500_form, strlen(error_500_form));
+                return;
+            }
+            route_response resp(s->owned, http_conn::WRITE_BUFFER_SIZE);
+            fn(req, params, resp);
+            if (resp.overflow())
+            {
+                respond(s, 500, "text/html", error_500_form, strlen(error_500_form));
+                return;
+            }
+            s->gen = resp.take_generator();
+            respond(s, resp.status(), resp.content_type(), s->owned, s->gen ? 0 : resp.length());
+            return;
+        }
+    }
+    if (method_bit != ROUTE_GET)
+    {
+        respond(s, 405, "text/html", NULL, 0); // HTTP/2不接受请求体上传
+        return;
+    }
+    if (upstream_conn::match(url))
+    {
+        respond(s, 502, "text/html", error_502_form, strlen(error_502_form));
+        return;
+    }
+    if (http_conn::m_assets)
+    {
+        const asset_arena::asset *a = http_conn::m_assets->find(url.data(), url.size());
+        if (!a)
+        {
+            respond(s, 404, "text/html", error_404_form, strlen(error_404_form));
+            return;
+        }
+        respond(s, 200, "text/html", a->body, a->body_len);
+        return;
+    }
+
+    char path[http_conn::FILENAME_LEN];
+    if (snprintf(path, sizeof(path), "%s%.*s", doc_root, (int)url.size(), url.data()) >= (int)sizeof(path))
+    {
+        respond(s, 404, "text/html", error_404_form, strlen(error_404_form));
+        return;
+    }
+    struct stat st;
+    if (stat(path, &st) < 0)
+    {
+        respond(s, 404, "text/html", error_404_form, strlen(error_404_form));
+        return;
+    }
+    if (!(st.st_mode & S_IROTH))
+    {
+        respond(s, 403, "text/html", error_403_form, strlen(error_403_form));
+        return;
+    }
+    if (S_ISDIR(st.st_mode))
+    {
+        respond(s, 400, "text/html", error_400_form, strlen(error_400_form));
+        return;
+    }
+    if (st.st_size > 0)
+    {
+        int fd = open(path, O_RDONLY);
+        void *addr = fd < 0 ? MAP_FAILED : mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        if (addr == MAP_FAILED)
+        {
+            respond(s, 500, "text/html", error_500_form, strlen(error_500_form));
+            return;
+        }
+        s->map = addr;
+        s->map_len = st.st_size;
+    }
+    respond(s, 200, "text/html", (const char *)s->map, st.st_size);
+}
+
+void h2_session::respond(h2_stream *s, int status, const char *type, const char *body, size_t len)
+{
+    std::string block;
+    static const int status_codes[] = {200, 204, 206, 304, 400, 404, 500};
+    int index = 0;
+    for (int i = 0; i < 7; ++i)
+    {
+        if (status_codes[i] == status)
+        {
+            index = 8 + i; // 静态表中 :status 200 到 :status 500 依次为8到14
+        }
+    }
+    char num[24];
+    if (index)
+    {
+        encode_int(block, 0x80, 7, index);
+    }
+    else
+    {
+        snprintf(num, sizeof(num), "%d", status);
+        encode_literal(block, 8, num);
+    }
+    encode_literal(block, 31, type);
+    // 分块生成的响应体长度未知，不发送content-length，由最后一个DATA帧的END_STREAM结束
+    bool finished = len == 0 && !s->gen;
+    if (!s->gen)
+    {
+        snprintf(num, sizeof(num), "%zu", len);
+        encode_literal(block, 28, num);
+    }
+
+    queue_frame(H2_HEADERS, H2_FLAG_END_HEADERS | (finished ? H2_FLAG_END_STREAM : 0), s->id, block.data(), block.size());
+    s->body = body;
+    s->body_len = len;
+    s->sent = 0;
+    if (finished)
+    {
+        retire(s);
+        return;
+    }
+    m_active.push_back(s);
+}
+
+// 流结束：从表中移除，等当前批次发送完再释放
+void h2_session::retire(h2_stream *s)
+{
+    m_streams.erase(s->id);
+    for (size_t i = 0; i < m_active.size(); ++i)
+    {
+        if (m_active[i] == s)
+        {
+            m_active.erase(m_active.begin() + i);
+            break;
+        }
+    }
+    m_done.push_back(s);
+}
+
+// 组织下一批要发送的数据：先是所有控制帧，然后各个流轮流发送一个DATA帧
+void h2_session::build_batch()
+{
+    for (size_t i = 0; i < m_done.size(); ++i)
+    {
+        delete m_done[i];
+    }
+    m_done.clear();
+
+    m_ctrl_sending.swap(m_ctrl);
+    m_ctrl.clear();
+    if (!m_ctrl_sending.empty())
+    {
+        m_iv[m_iv_count].iov_base = (void *)m_ctrl_sending.data();
+        m_iv[m_iv_count].iov_len = m_ctrl_sending.size();
+        ++m_iv_count;
+    }
+
+    int frames = 0;
+    size_t rounds = m_active.size();
+    for (size_t k = 0; k < rounds && m_iv_count + 2 <= MAX_IOV && m_send_window > 0; ++k)
+    {
+        h2_stream *s = m_active.front();
+        m_active.pop_front();
+        if (s->gen && s->sent == s->body_len)
+        {
+            // 每个流在一批中只出现一次，上一块已经随之前的批次发完，owned可以重新填充
+            int got = s->gen->fill(s->owned, buffer_pool::CHUNK_SIZE);
+            if (got < 0 || got > buffer_pool::CHUNK_SIZE)
+            {
+                stream_error(s->id, H2_INTERNAL_ERROR);
+                continue;
+            }
+            if (got == 0)
+            {
+                delete s->gen; // 以一个空的DATA帧结束流
+                s->gen = NULL;
+            }
+            s->body = s->owned;
+            s->body_len = got;
+            s->sent = 0;
+        }
+        int64_t n = s->body_len - s->sent;
+        n = n < m_peer_max_frame ? n : m_peer_max_frame;
+        n = n < m_send_window ? n : m_send_window;
+        n = n < s->send_window ? n : s->send_window;
+        bool last = !s->gen && s->sent + n == s->body_len;
+        if (n <= 0 && !last)
+        {
+            m_active.push_back(s); // 等待该流的WINDOW_UPDATE
+            continue;
+        }
+        uint8_t *hdr = m_frame_hdr[frames++];
+        hdr[0] = n >> 16;
+        hdr[1] = n >> 8;
+        hdr[2] = n;
+        hdr[3] = H2_DATA;
+        hdr[4] = last ? H2_FLAG_END_STREAM : 0;
+        hdr[5] = s->id >> 24;
+        hdr[6] = s->id >> 16;
+        hdr[7] = s->id >> 8;
+        hdr[8] = s->id;
+        m_iv[m_iv_count].iov_base = hdr;
+        m_iv[m_iv_count].iov_len = 9;
+        m_iv[m_iv_count + 1].iov_base = (void *)(s->body + s->sent);
+        m_iv[m_iv_count + 1].iov_len = n;
+        m_iv_count += 2;
+        s->sent += n;
+        s->send_window -= n;
+        m_send_window -= n;
+        if (last)
+        {
+            m_streams.erase(s->id);
+            m_done.push_back(s);
+        }
+        else
+        {
+            m_active.push_back(s);
+        }
+    }
+}
+
+void h2_session::consume(size_t bytes)
+{
+    int done = 0;
+    while (done < m_iv_count && bytes >= m_iv[done].iov_len)
+    {
+        bytes -= m_iv[done].iov_len;
+        ++done;
+    }
+    for (int i = done; i < m_iv_count; ++i)
+    {
+        m_iv[i - done] = m_iv[i];
+    }
+    m_iv_count -= done;
+    if (m_iv_count > 0)
+    {
+        m_iv[0].iov_base = (char *)m_iv[0].iov_base + bytes;
+        m_iv[0].iov_len -= bytes;
+    }
+}
+
+int h2_session::flush()
+{
+    while (true)
+    {
+        if (m_iv_count == 0)
+        {
+            build_batch();
+            if (m_iv_count == 0 && !m_ctrl.empty())
+            {
+                build_batch(); // 生成器出错时在组批过程中排入的RST_STREAM
+            }
+            if (m_iv_count == 0)
+            {
+                return 0;
+            }
+        }
+        ssize_t n = m_conn->send_iov(m_iv, m_iv_count);
+        if (n < 0)
+        {
+            return errno == EAGAIN ? 1 : -1;
+        }
+        consume(n);
+    }
+}
+
+bool h2_session::finished() const
+{
+    return (m_goaway_sent || m_peer_goaway) && m_streams.empty() && m_ctrl.empty() && m_iv_count == 0;
+}
@@ -0,0 +1,138 @@
+#ifndef HTTP2_H
+#define HTTP2_H
+
+#include <stdint.h>
+#include <sys/uio.h>
+#include <deque>
+#include <map>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include "http_request.h"
+
+// HTTP/2明文（h2c）：客户端以连接前言开始（prior knowledge），或在HTTP/1.1请求中带 Upgrade: h2c 升级。
+// 同一个TCP连接上的多个请求以流的形式并发，响应的DATA帧在各个流之间轮转发送，遵守连接和流两级流量控制。
+// 请求按与HTTP/1.1相同的顺序查找（路由表、预加载区、网站根目录），响应体直接指向预加载区或mmap的文件。
+// 不接受请求体上传，代理路由回复502。
+
+class http_conn;
+class body_generator;
+
+const char H2_PREFACE[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+const int H2_PREFACE_LEN = 24;
+
+typedef std::vector<std::pair<std::string, std::string> > header_list;
+
+// HPACK解码器，动态表在连接的整个生命周期内保持
+class hpack_decoder
+{
+public:
+    static const uint32_t TABLE_SIZE = 4096; // 通过SETTINGS_HEADER_TABLE_SIZE告知对方的动态表上限（即默认值）
+    // 解码后头部列表的上限，按 名称长度 + 值长度 + 32 累计，通过SETTINGS_MAX_HEADER_LIST_SIZE告知对方。
+    // 引用动态表条目的字段只占1字节，不限制的话16KB的头部块可以展开成几十MB
+    static const uint32_t MAX_LIST_SIZE = 65536;
+
+    hpack_decoder() : m_size(0), m_max_size(TABLE_SIZE) {}
+
+    // 解码一个完整的头部块，失败或超过MAX_LIST_SIZE（COMPRESSION_ERROR）时返回false
+    bool decode(const uint8_t *p, size_t len, header_list &out);
+
+private:
+    bool lookup(uint64_t index, std::string &name, std::string &value) const;
+    void add(const std::string &name, const std::string &value);
+    void evict(size_t limit);
+
+    std::deque<std::pair<std::string, std::string> > m_table; // 头部是最新加入的条目
+    size_t m_size;     // 每个条目按 名称长度 + 值长度 + 32 计
+    size_t m_max_size;
+};
+
+struct h2_stream
+{
+    uint32_t id;
+    int64_t send_window;
+    bool end_stream;         // 请求（包括被丢弃的请求体）已经接收完
+    std::string hbuf;        // 请求行和头部字段，req指向这里
+    http_request req;
+    const char *body;        // 响应体，指向预加载区、mmap的文件、owned或静态字符串
+    size_t body_len;
+    size_t sent;
+    char *owned;             // 路由处理函数写入的响应体，从buffer_pool中取
+    body_generator *gen;     // 分块生成的响应体，owned用作生成缓冲区，生成完毕后置为NULL
+    void *map;               // mmap的文件
+    size_t map_len;
+
+    h2_stream(uint32_t stream_id, int64_t window);
+    ~h2_stream();
+};
+
+class h2_session
+{
+public:
+    static const int MAX_FRAME_SIZE = 16384;   // 接收的最大帧长度，即协议默认值
+    static const int MAX_STREAMS = 100;        // SETTINGS_MAX_CONCURRENT_STREAMS
+    static const int MAX_HEADER_BLOCK = 16384; // 头部块（HEADERS + CONTINUATION）的上限
+    static const int MAX_IOV = 32;             // 每批发送的iovec数量
+    static const int MAX_CTRL_PENDING = 65536; // 积压的待发送控制帧（PING/SETTINGS的ACK、RST_STREAM、HEADERS）的上限
+
+    h2_session(http_conn *conn);
+    ~h2_session();
+
+    // 收到连接前言（prior knowledge）
+    void start();
+    // Upgrade: h2c：回复101和服务端SETTINGS，升级的请求作为流1处理。HTTP2-Settings无效时返回false
+    bool start_upgrade(const http_request &req);
+    // 处理读到的数据，返回false表示出现连接错误（已排入GOAWAY），尽量发送后关闭连接
+    bool feed(const char *data, int len);
+    // 尽可能多地发送，返回-1表示出错，0表示全部发完，1表示需要等待EPOLLOUT
+    int flush();
+    // 任何一方发送了GOAWAY，且所有流都已结束、没有待发送的数据
+    bool finished() const;
+
+private:
+    bool expect_preface();
+    bool on_frame(int type, int flags, uint32_t sid, const uint8_t *payload, uint32_t len);
+    bool on_headers_block();
+    bool apply_settings(const uint8_t *payload, uint32_t len);
+    bool connection_error(uint32_t code);
+    void stream_error(uint32_t sid, uint32_t code);
+    void queue_frame(int type, int flags, uint32_t sid, const void *payload, size_t len);
+    void queue_window_update(uint32_t sid, uint32_t increment);
+
+    bool set_request(h2_stream *s, const header_list &fields);
+    void dispatch(h2_stream *s);
+    void respond(h2_stream *s, int status, const char *type, const char *body, size_t len);
+    void retire(h2_stream *s);
+
+    void build_batch();
+    void consume(size_t bytes);
+
+    http_conn *m_conn;
+    std::string m_in;             // 尚不足一帧的输入
+    bool m_preface_received;
+    hpack_decoder m_decoder;
+
+    std::map<uint32_t, h2_stream *> m_streams; // 尚未结束的流
+    std::deque<h2_stream *> m_active;          // 有响应体待发送的流，轮转发送
+    std::vector<h2_stream *> m_done;           // 已结束的流，当前批次发送完才能释放（iovec可能指向它们）
+    uint32_t m_last_stream;                    // 客户端打开过的最大流ID
+
+    std::string m_block;          // 正在接收的头部块
+    uint32_t m_block_stream;      // 头部块所属的流，0表示没有在接收头部块
+    bool m_block_end_stream;
+
+    int64_t m_send_window;        // 连接级发送窗口
+    int64_t m_peer_initial_window;
+    uint32_t m_peer_max_frame;
+    bool m_goaway_sent;
+    bool m_peer_goaway;
+
+    std::string m_ctrl;           // 待发送的控制帧和HEADERS帧
+    std::string m_ctrl_sending;   // 当前批次中的控制帧
+    struct iovec m_iv[MAX_IOV];
+    int m_iv_count;
+    uint8_t m_frame_hdr[MAX_IOV][9]; // 当前批次中DATA帧的帧头
+};
+
+#endif
@@ -6,16 +6,66 @@ const char *error_400_title = "Bad Request";
 const char *error_400_form = "Your request has bad syntax or is inherently impossible to satisfy.\n";
 const char *error_403_title = "Forbidden";
 const char *error_403_form = "You do not have permission to get file from this server.\n";
+const char *ok_201_title = "Created";
+const char *error_405_title = "Method Not Allowed";
 const char *error_404_title = "Not Found";
 const char *error_404_form = "The requested file was not found on this server.\n";
 const char *error_500_title = "Internal Error";
 const char *error_500_form = "There was an unusual problem serving the requested file.\n";
+const char *error_502_title = "Bad Gateway";
+const char *error_502_form = "The upstream server is unavailable or sent an invalid response.\n";
+const char *error_429_title = "Too Many Requests";
+const char *error_429_form = "Request rate limit exceeded, please retry later.\n";
+// 限流的应答是固定的，预先生成完整的报文：accept时直接发送，解析时指向它，不需要写缓冲区
+extern const char error_429_response[] = "HTTP/1.1 429 Too Many Requests\r\n"
+                                         "Content-Length: 49\r\n"
+                                         "Retry-After: 1\r\n"
+                                         "Connection: close\r\n\r\n"
+                                         "Request rate limit exceeded, please retry later.\n";
+extern const int error_429_response_len = sizeof(error_429_response) - 1;
 
 // 网站的根目录
 const char *doc_root = "/Desktop/web_server/resources";
 
 int http_conn::m_epollfd = -1;
 int http_conn::m_user_count = 0;
+uint32_t http_conn::m_generation = 0;
+const asset_arena *http_conn::m_assets = NULL;
+body_handler_factory http_conn::m_body_factory = NULL;
+const router *http_conn::m_router = NULL;
+bool http_conn::m_h2c = true;
+long long http_conn::m_low_bytes = 0;
+const char *file_upload_handler::upload_dir = NULL;
+#ifdef USE_TLS
+tls_context *http_conn::m_tls = NULL;
+#endif
+
+static const char *status_title(int status) // BODY_REQUEST、ROUTE_REQUEST响应的状态描述
+{
+    switch (status)
+    {
+    case 200:
+        return ok_200_title;
+    case 201:
+        return ok_201_title;
+    case 400:
+        return error_400_title;
+    case 403:
+        return error_403_title;
+    case 404:
+        return error_404_title;
+    case 405:
+        return error_405_title;
+    case 500:
+        return error_500_title;
+    case 429:
+        return error_429_title;
+    case 502:
+        return error_502_title;
+    default:
+        return status < 400 ? ok_200_title : error_400_title;
+    }
+}
 
 void setnonblocking(int fd) // 设置文件描述符非阻塞
 {
@@ -24,16 +74,18 @@ void setnonblocking(int fd) // 设置文件描述符非阻塞
     fcntl(fd, F_SETFL, new_flag);
 }
 
-void addfd(int epollfd, int fd, bool one_shot) // 向epoll中添加需要监听的文件描述符
+void addfd(int epollfd, int fd, bool one_shot, uint64_t data) // 向epoll中添加需要监听的文件描述符
 {
     epoll_event event;
-    event.data.fd = fd;
+    event.data.u64 = data; // 客户端连接是连接句柄，其他fd是fd本身
+
     // event.events = EPOLLIN | EPOLLRDHUP;
     event.events = EPOLLIN | EPOLLRDHUP; // 
 
     if (one_shot)
     {
-        event.events = EPOLLIN | EPOLLRDHUP;
+        // 同一时刻只允许一个线程处理该连接，处理完后由modfd重新注册
+        event.events |= EPOLLONESHOT;
     }
     epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event);
     setnonblocking(fd);
@@ -44,54 +96,304 @@ void removefd(int epollfd, int fd) // 从epoll中移除监听的文件描述符
     close(fd);
 }
 
-void modfd(int epollfd, int fd, int ev)
+void modfd(int epollfd, int fd, int ev, uint64_t data)
 { // 修改文件描述符，重置socket上的EPOLLONESHOT事件，确保下一次可读时，EPOLLIN事件能被触发
     epoll_event event;
-    event.data.fd = fd;
+    event.data.u64 = data;
     event.events = ev | EPOLLONESHOT | EPOLLRDHUP;
     epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &event);
 }
-void http_conn::init(int sockfd, const sockaddr_in &addr) // 初始化连接
+// 打点：触发USDT探针，被采样的请求同时记下时间
+#define TRACE_POINT(probe, stage)               \
+    do                                          \
+    {                                           \
+        TRACE_PROBE(probe, m_sockfd, m_handle); \
+        if (m_trace.handle)                     \
+        {                                       \
+            m_trace.mark(stage);                \
+        }                                       \
+    } while (0)
+
+void http_conn::init(int sockfd, const sockaddr_in &addr, int node, bool local) // 初始化连接
 {
     m_sockfd = sockfd;
+    // 每个连接一个新的代数，句柄中的代数为1 ~ 2^31-1，0表示无效，最高位留给UPSTREAM_TAG
+    uint64_t generation = __atomic_add_fetch(&m_generation, 1, __ATOMIC_RELAXED) % 0x7fffffff + 1;
+    __atomic_store_n(&m_handle, generation << 32 | (uint32_t)sockfd, __ATOMIC_RELEASE);
     m_address = addr;
+    m_local = local;
+    m_node = node;
     // 端口复用
     int reuse = 1;
     setsockopt(m_sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
 
+    m_h2 = NULL;
+    m_read_buf = NULL;
+    m_write_buf = NULL;
+    m_chunk_buf = NULL;
+    m_generator = NULL;
+    m_trace.handle = 0;
+    m_sampled = false;
+    m_accept_us = tracer::enabled() || access_log::enabled() ? trace_record::now_us() : 0;
+    TRACE_PROBE(accept, sockfd, m_handle);
+    if (traffic_capture::enabled())
+    {
+        traffic_capture::record(CAP_OPEN, m_handle >> 32, NULL, 0);
+    }
+#ifdef USE_TLS
+    // 会话创建失败时m_ssl为NULL，handshake()返回false，连接随即被关闭。
+    // Unix域套接字上的本机连接不加密，视为已经完成握手
+    bool tls = m_tls && !local;
+    m_ssl = tls ? m_tls->new_session(sockfd) : NULL;
+    m_tls_ready = !tls;
+    m_ktls_send = false;
+#endif
+    // TLS连接经SSL_write或kTLS加密，不能零拷贝
+    m_zerocopy = zerocopy::threshold() > 0 && !local && zerocopy::enable(sockfd);
+#ifdef USE_TLS
+    m_zerocopy = m_zerocopy && !tls;
+#endif
+    m_zc_sent = m_zc_done = 0;
+    m_bytes_sent = 0;
+
     // 添加到epoll对象中
-    addfd(m_epollfd, sockfd, true);
-    m_user_count++; // 总用户++
+    m_wait_events = EPOLLIN;
+    addfd(m_epollfd, sockfd, true, m_handle);
+    __atomic_add_fetch(&m_user_count, 1, __ATOMIC_RELAXED); // 总用户++，工作线程关闭连接时并发地减
 
     init();
 }
 
 void http_conn::init()
 {
+    // 流水线：上一个请求（没有请求体）之后读到的数据属于下一个请求，移到缓冲区开头留下。
+    // 访问日志中的URL指向读缓冲区，所以先结束上一个请求的记录再移动
+    int leftover = (m_read_buf && m_check_state != CHECK_STATE_CONTENT) ? m_read_index - m_checked_index : 0;
+    end_trace();
+    if (leftover > 0)
+    {
+        memmove(m_read_buf, m_read_buf + m_checked_index, leftover);
+    }
+    m_pipelined = leftover > 0;
+    zerocopy::account(m_bytes_sent);
+    m_status = 0;
+    m_bytes_sent = 0;
+    m_zc_body = false;
+    m_deferred = false;
     m_check_state = CHECK_STATE_REQUESTLINE;
     m_checked_index = 0;
     m_start_line = 0;
-    m_read_index = 0;
+    m_read_index = leftover;
     m_method = GET;
     m_url = 0;
     m_version = 0;
     m_content_length = 0;
-    m_host = 0;
+    m_body_handler = NULL;
+    m_body_fd = -1;
+    m_pipe[0] = m_pipe[1] = -1;
+    m_body_start = 0;
+    m_body_status = 200;
+    m_request.reset(m_read_buf);
 
     m_linger = false;
     m_write_index = 0;
-    bzero(m_read_buf, READ_BUFFER_SIZE);
-    bzero(m_write_buf, READ_BUFFER_SIZE);
-    bzero(m_real_file, FILENAME_LEN);
+    m_iv_count = 0;
+    m_bytes_to_send = 0;
+    m_asset = NULL;
+    m_proxy_route = NULL;
+    m_upstream = NULL;
+    m_first_byte = false;
+    delete m_generator; // 正常结束时已经为NULL
+    m_generator = NULL;
+#ifdef USE_TLS
+    m_stage_off = m_stage_len = 0;
+#endif
+    // 新连接或上一个请求已经处理完，连接空闲，缓冲区还给池，下次读到数据时再取。
+    // 缓冲区的内容不需要清零：解析只访问已读到的部分，写缓冲区由vsnprintf写入
+    release_buffers(m_pipelined);
+    if (m_pipelined)
+    {
+        start_trace();
+        TRACE_POINT(read, TS_READ);
+    }
+}
+
+void http_conn::end_trace(bool closed)
+{
+    if (!m_trace.handle)
+    {
+        return;
+    }
+    m_trace.mark(TS_DONE);
+    if (m_sampled)
+    {
+        tracer::submit(m_trace);
+    }
+    if (access_log::enabled() && !m_h2)
+    {
+        access_record rec;
+        memset(&rec, 0, sizeof(rec));
+        int first = m_trace.ts[TS_ACCEPT] ? TS_ACCEPT : TS_READ;
+        rec.time_us = access_log::wall_us() - (trace_record::now_us() - m_trace.ts[first]);
+        rec.status = m_status;
+        rec.bytes = m_bytes_sent;
+        if (!m_local)
+        {
+            rec.addr = m_address.sin_addr.s_addr;
+            rec.port = m_address.sin_port;
+        }
+        else
+        {
+            rec.flags |= ACCESS_UNIX;
+        }
+        rec.flags |= closed ? ACCESS_CLOSED : 0;
+        rec.method = m_method;
+        rec.conn = m_trace.handle >> 32;
+        // 相邻的两个已记录阶段之间为一段，记在开始阶段上，和tracer::dump的分段相同
+        int from = -1;
+        for (int i = 0; i < TS_COUNT; ++i)
+        {
+            if (m_trace.ts[i])
+            {
+                if (from >= 0)
+                {
+                    rec.stage_us[from] = m_trace.ts[i] - m_trace.ts[from];
+                }
+                from = i;
+            }
+        }
+        access_log::write(rec, m_url ? m_url : "", m_url ? strlen(m_url) : 0);
+    }
+    m_trace.handle = 0;
+}
+
+void http_conn::trace_enqueue()
+{
+    TRACE_POINT(enqueue, TS_ENQUEUE);
+}
+
+void http_conn::rearm(int ev)
+{
+    m_wait_events = ev;
+    modfd(m_epollfd, m_sockfd, ev, m_handle);
+}
+
+unsigned int http_conn::zerocopy_event(unsigned int events)
+{
+    bool copied = false;
+    m_zc_done += zerocopy::reap(m_sockfd, copied);
+    if (copied)
+    {
+        m_zerocopy = false; // 内核做了复制，零拷贝只会多出通知的开销
+    }
+    if (!(events & EPOLLERR))
+    {
+        return events;
+    }
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(m_sockfd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0)
+    {
+        return events;
+    }
+    events &= ~EPOLLERR;
+    if (events == 0)
+    {
+        rearm(m_wait_events);
+    }
+    return events;
+}
+
+bool http_conn::get_write_buf()
+{
+    if (!m_write_buf)
+    {
+        m_write_buf = buffer_pool::acquire(m_node);
+    }
+    return m_write_buf != NULL;
+}
+
+void http_conn::release_buffers(bool keep_read)
+{
+    if (m_read_buf && !keep_read)
+    {
+        buffer_pool::release(m_read_buf);
+        m_read_buf = NULL;
+        m_request.reset(NULL);
+    }
+    if (m_write_buf)
+    {
+        buffer_pool::release(m_write_buf);
+        m_write_buf = NULL;
+    }
+    if (m_chunk_buf)
+    {
+        buffer_pool::release(m_chunk_buf);
+        m_chunk_buf = NULL;
+    }
+}
+
+void http_conn::start_trace()
+{
+    if (!m_trace.handle && ((m_sampled = tracer::sample()) || access_log::enabled()))
+    {
+        // 新请求被采样或要写访问日志，时间戳从0开始记
+        memset(&m_trace, 0, sizeof(m_trace));
+        m_trace.handle = m_handle;
+        if (m_accept_us)
+        {
+            m_trace.ts[TS_ACCEPT] = m_accept_us;
+            m_trace.tid[TS_ACCEPT] = trace_record::current_tid();
+        }
+    }
+    m_accept_us = 0;
 }
 
 void http_conn::close_conn() // 关闭连接
 {
     if (m_sockfd != -1)
     {
-        removefd(m_epollfd, m_sockfd);
+        TRACE_PROBE(close, m_sockfd, m_handle);
+        if (traffic_capture::enabled())
+        {
+            traffic_capture::record(CAP_CLOSE, m_handle >> 32, NULL, 0);
+        }
+        end_trace(m_bytes_to_send > 0 || m_generator || m_upstream);
+        zerocopy::account(m_bytes_sent);
+        m_bytes_sent = 0;
+        // 先作废句柄：fd关闭后可能立刻被新连接复用，之前排队的任务和同一批中的事件都要被丢弃
+        __atomic_store_n(&m_handle, 0, __ATOMIC_RELEASE);
+        if (m_body_handler)
+        {
+            end_body(false); // 请求体还没收完连接就断了
+        }
+        if (m_upstream)
+        {
+            m_upstream->abort(); // 响应还没转发完客户端就断了
+            m_upstream = NULL;
+        }
+        delete m_h2;
+        m_h2 = NULL;
+        delete m_generator; // 分块响应还没发完连接就断了
+        m_generator = NULL;
+#ifdef USE_TLS
+        if (m_ssl)
+        {
+            if (m_tls_ready)
+            {
+                SSL_shutdown(m_ssl); // 尽力发送close_notify，不等待对方回应
+            }
+            SSL_free(m_ssl);
+            m_ssl = NULL;
+        }
+#endif
+        release_buffers();
+        // close之后reactor可能立刻在同一个fd上accept新连接并对本对象调用init()，
+        // 所以对象上的状态都要在close之前改完，close之后调用者不能再访问本对象
+        int sockfd = m_sockfd;
         m_sockfd = -1;
-        m_user_count--;
+        __atomic_sub_fetch(&m_user_count, 1, __ATOMIC_RELAXED);
+        removefd(m_epollfd, sockfd);
     }
 }
 
@@ -101,10 +403,27 @@ bool http_conn::read()
     {
         return false;
     }
+    if (m_check_state == CHECK_STATE_CONTENT && m_body_fd >= 0 && raw_recv())
+    {
+        // 请求体由工作线程用splice直接从socket搬到文件，这里不读
+        return true;
+    }
+    if (!m_read_buf)
+    {
+        // 空闲连接上有了新数据，从池中取读缓冲区
+        m_read_buf = buffer_pool::acquire(m_node);
+        if (!m_read_buf)
+        {
+            return false;
+        }
+        m_request.reset(m_read_buf);
+        start_trace();
+    }
+    TRACE_POINT(read, TS_READ);
     int bytes_read = 0; // 读取到的字节
-    while (1)
+    while (m_read_index < READ_BUFFER_SIZE) // 缓冲区满了就先交给工作线程处理，剩下的数据下次再读
     {
-        bytes_read = recv(m_sockfd, m_read_buf + m_read_index, READ_BUFFER_SIZE - m_read_index, 0);
+        bytes_read = recv_some(m_read_buf + m_read_index, READ_BUFFER_SIZE - m_read_index);
         if (bytes_read == -1)
         {
             if (errno == EAGAIN || errno == EWOULDBLOCK)
@@ -119,10 +438,12 @@ bool http_conn::read()
         {
             return false;
         }
+        if (traffic_capture::enabled())
+        {
+            traffic_capture::record(CAP_DATA, m_handle >> 32, m_read_buf + m_read_index, bytes_read);
+        }
         m_read_index += bytes_read;
-        printf("读取到的数据大小:%d\n", bytes_read);
     }
-    printf("读取到了数据：%s\n", m_read_buf);
     return true;
 }
 
@@ -132,15 +453,19 @@ http_conn::HTTP_CODE http_conn::process_read() // 主状态机：解析请求
     HTTP_CODE ret = NO_REQUEST;
 
     char *text = 0;
-    while ((m_check_state == CHECK_STATE_CONTENT) && (line_status == LINE_OK) || ((line_status = parse_line()) == LINE_OK))
+    if (m_check_state == CHECK_STATE_CONTENT)
     {
-        // 解析到了一行完整的数据，或者解析到了请求体，完成的数据
+        // 请求体不按行解析，读到多少就交给处理器多少
+        return read_body();
+    }
+    while ((line_status = parse_line()) == LINE_OK)
+    {
+        // 解析到了一行完整的数据
 
         // 获取一行的数据
         text = get_line();
 
         m_start_line = m_checked_index;
-        printf("got 1 http line: %s\n", text);
 
         switch (m_check_state)
         {
@@ -151,6 +476,10 @@ http_conn::HTTP_CODE http_conn::process_read() // 主状态机：解析请求
             {
                 return BAD_REQUEST;
             }
+            if (!m_local && !rate_limiter::allow(m_address.sin_addr.s_addr))
+            {
+                return TOO_MANY_REQUESTS; // 请求头和请求体不再读取，回复后关闭连接
+            }
             break;
         }
         case CHECK_STATE_HEADER:
@@ -162,18 +491,16 @@ http_conn::HTTP_CODE http_conn::process_read() // 主状态机：解析请求
             }
             else if (ret == GET_REQUEST)
             {
+                if (m_h2c && header_name_equal(m_request.get(HDR_UPGRADE), "h2c") && m_request.has(HDR_HTTP2_SETTINGS))
+                {
+                    return H2C_UPGRADE;
+                }
                 return do_request();
             }
-            break;
-        }
-        case CHECK_STATE_CONTENT:
-        {
-            ret = parse_content(text);
-            if (ret == GET_REQUEST)
+            else if (m_check_state == CHECK_STATE_CONTENT)
             {
-                return do_request();
+                return begin_body();
             }
-            line_status = LINE_OPEN;
             break;
         }
         default:
@@ -181,7 +508,6 @@ http_conn::HTTP_CODE http_conn::process_read() // 主状态机：解析请求
             return INTERNAL_ERROR;
         }
         }
-        return NO_REQUEST;
     }
 
     return NO_REQUEST;
@@ -189,6 +515,10 @@ http_conn::HTTP_CODE http_conn::process_read() // 主状态机：解析请求
 http_conn::HTTP_CODE http_conn::parse_request_line(char *text) // 解析HTTP请求行，获得请求方法，目标URL，HTTP版本
 {
     m_url = strpbrk(text, " \t");
+    if (!m_url)
+    {
+        return BAD_REQUEST;
+    }
 
     *m_url++ = '\0';
 
@@ -197,6 +527,14 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char *text) // 解析HTTP请
     {
         m_method = GET;
     }
+    else if (strcasecmp(method, "POST") == 0)
+    {
+        m_method = POST;
+    }
+    else if (strcasecmp(method, "PUT") == 0)
+    {
+        m_method = PUT;
+    }
     else
     {
         return BAD_REQUEST;
@@ -212,7 +550,7 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char *text) // 解析HTTP请
     {
         return BAD_REQUEST;
     }
-    if (strncasecmp(m_version, "http://", 7) == 0)
+    if (strncasecmp(m_url, "http://", 7) == 0)
     {
         m_url += 7;
         m_url = strchr(m_url, '/');
@@ -221,6 +559,7 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char *text) // 解析HTTP请
     {
         return BAD_REQUEST;
     }
+    m_request.set_request_line(method, strlen(method), m_url, strlen(m_url), m_version, strlen(m_version));
 
     m_check_state = CHECK_STATE_HEADER; // 主状态机检查状态变成请求头
 
@@ -233,7 +572,7 @@ http_conn::HTTP_CODE http_conn::parse_headers(char *text)
     {
         // 如果HTTP请求有消息体，则还需要读取m_content_length字节的消息体，
         // 状态机转移到CHECK_STATE_CONTENT状态
-        if (m_content_length != 0)
+        if (m_content_length > 0)
         {
             m_check_state = CHECK_STATE_CONTENT;
             return NO_REQUEST;
@@ -241,44 +580,195 @@ http_conn::HTTP_CODE http_conn::parse_headers(char *text)
         // 否则说明我们已经得到了一个完整的HTTP请求
         return GET_REQUEST;
     }
-    else if (strncasecmp(text, "Connection:", 11) == 0)
+
+    // 名称和值都直接记录在读缓冲区上，不拷贝
+    char *colon = strchr(text, ':');
+    if (!colon || colon == text)
+    {
+        return BAD_REQUEST;
+    }
+    int name_len = colon - text;
+    while (name_len > 0 && (text[name_len - 1] == ' ' || text[name_len - 1] == '\t'))
+    {
+        --name_len;
+    }
+    char *value = colon + 1;
+    value += strspn(value, " \t");
+    int value_len = strlen(value);
+    while (value_len > 0 && (value[value_len - 1] == ' ' || value[value_len - 1] == '\t'))
+    {
+        value[--value_len] = '\0';
+    }
+
+    switch (m_request.add_header(text, name_len, value, value_len))
     {
+    case HDR_CONNECTION:
         // 处理Connection 头部字段  Connection: keep-alive
-        text += 11;
-        text += strspn(text, " \t");
-        if (strcasecmp(text, "keep-alive") == 0)
+        if (strcasecmp(value, "keep-alive") == 0)
         {
             m_linger = true;
         }
+        break;
+    case HDR_CONTENT_LENGTH:
+        // 处理Content-Length头部字段
+        m_content_length = atoll(value);
+        if (m_content_length < 0)
+        {
+            return BAD_REQUEST;
+        }
+        break;
+    default:
+        break;
     }
-    else if (strncasecmp(text, "Content-Length:", 15) == 0)
+    return NO_REQUEST;
+}
+http_conn::HTTP_CODE http_conn::begin_body()
+{
+    // 请求头之前的内容（m_url等都指向这里）在请求结束前保持不变，请求体的每一块都从m_body_start开始存放
+    m_body_start = m_checked_index;
+    if (READ_BUFFER_SIZE - m_body_start < MIN_BODY_CHUNK)
     {
-        // 处理Content-Length头部字段
-        text += 15;
-        text += strspn(text, " \t");
-        m_content_length = atol(text);
+        m_linger = false;
+        return BAD_REQUEST;
     }
-    else if (strncasecmp(text, "Host:", 5) == 0)
+
+    if (m_method != GET)
     {
-        // 处理Host头部字段
-        text += 5;
-        text += strspn(text, " \t");
-        m_host = text;
+        m_body_handler = m_body_factory ? m_body_factory(m_request) : NULL;
+        int fd = -1;
+        if (!m_body_handler || !m_body_handler->begin(m_request, m_content_length, &fd))
+        {
+            // 拒绝请求体，连接上还有没读的数据，回复后关闭连接
+            m_body_status = m_body_handler ? 403 : 405;
+            delete m_body_handler;
+            m_body_handler = NULL;
+            m_linger = false;
+            return BODY_REQUEST;
+        }
+        m_body_fd = fd;
+        // TLS连接的socket上是密文，请求体只能读到读缓冲区后由feed_body写入文件
+        if (m_body_fd >= 0 && raw_recv() && pipe2(m_pipe, O_CLOEXEC) < 0)
+        {
+            end_body(false);
+            m_linger = false;
+            return BODY_REQUEST;
+        }
     }
-    else
+
+    // 客户端在等待确认后才发送请求体
+    if (header_name_equal(m_request.get(HDR_EXPECT), "100-continue"))
     {
-        printf("oop! unknow header %s\n", text);
+        static const char resp[] = "HTTP/1.1 100 Continue\r\n\r\n";
+        struct iovec iv = {(void *)resp, sizeof(resp) - 1};
+        send_iov(&iv, 1);
     }
-    return NO_REQUEST;
+    return read_body();
 }
-http_conn::HTTP_CODE http_conn::parse_content(char *text)
+
+bool http_conn::feed_body(const char *data, int len)
 {
-    if (m_read_index >= (m_content_length + m_checked_index))
+    if (!m_body_handler)
     {
-        text[m_content_length] = '\0';
-        return GET_REQUEST;
+        return true; // GET请求的请求体直接丢弃
+    }
+    if (m_body_fd < 0)
+    {
+        return m_body_handler->on_data(data, len);
+    }
+    // splice模式下和请求头一起读进来的那部分请求体
+    while (len > 0)
+    {
+        ssize_t n = ::write(m_body_fd, data, len);
+        if (n <= 0)
+        {
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+http_conn::HTTP_CODE http_conn::read_body()
+{
+    int avail = m_read_index - m_checked_index;
+    if (avail > 0)
+    {
+        int len = avail < m_content_length ? avail : (int)m_content_length;
+        if (!feed_body(m_read_buf + m_checked_index, len))
+        {
+            end_body(false);
+            m_linger = false;
+            return BODY_REQUEST;
+        }
+        m_content_length -= len;
+    }
+    // 这一块已经处理完，下一块覆盖它
+    m_read_index = m_checked_index = m_start_line = m_body_start;
+
+    // socket -> 管道 -> 文件，数据不经过用户态内存。socket暂时没有数据时返回，等下一次EPOLLIN
+    while (m_body_fd >= 0 && raw_recv() && m_content_length > 0)
+    {
+        size_t chunk = m_content_length < 65536 ? m_content_length : 65536;
+        ssize_t n = splice(m_sockfd, NULL, m_pipe[1], NULL, chunk, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n == 0)
+        {
+            end_body(false);
+            return CLOSED_CONNECTION;
+        }
+        if (n < 0)
+        {
+            if (errno == EAGAIN)
+            {
+                break;
+            }
+            end_body(false);
+            m_linger = false;
+            return BODY_REQUEST;
+        }
+        m_content_length -= n;
+        while (n > 0)
+        {
+            ssize_t m = splice(m_pipe[0], NULL, m_body_fd, NULL, n, SPLICE_F_MOVE);
+            if (m <= 0)
+            {
+                end_body(false);
+                m_linger = false;
+                return BODY_REQUEST;
+            }
+            n -= m;
+        }
+    }
+
+    if (m_content_length > 0)
+    {
+        return NO_REQUEST;
+    }
+    if (!m_body_handler)
+    {
+        return do_request();
+    }
+    end_body(true);
+    return BODY_REQUEST;
+}
+
+void http_conn::end_body(bool ok)
+{
+    if (m_body_handler)
+    {
+        m_body_status = m_body_handler->finish(ok);
+        delete m_body_handler;
+        m_body_handler = NULL;
+    }
+    m_body_fd = -1;
+    for (int i = 0; i < 2; ++i)
+    {
+        if (m_pipe[i] >= 0)
+        {
+            close(m_pipe[i]);
+            m_pipe[i] = -1;
+        }
     }
-    return NO_REQUEST;
 }
 
 http_conn::LINE_STATUS http_conn::parse_line()
@@ -312,9 +802,8 @@ http_conn::LINE_STATUS http_conn::parse_line()
             }
             return LINE_BAD;
         }
-        return LINE_OPEN;
     }
-    return LINE_OK;
+    return LINE_OPEN;
 }
 
 // 当得到一个完整、正确的HTTP请求时，我们就分析目标文件的属性，
@@ -322,6 +811,52 @@ http_conn::LINE_STATUS http_conn::parse_line()
 // 映射到内存地址m_file_address处，并告诉调用者获取文件成功
 http_conn::HTTP_CODE http_conn::do_request()
 {
+    TRACE_POINT(parse_done, TS_PARSED);
+    // 先查路由表，命中时处理函数把响应体直接写到写缓冲区中留出响应头空间之后的位置
+    if (m_router)
+    {
+        std::string_view path = m_request.url();
+        path = path.substr(0, path.find('?'));
+        route_params params;
+        route_fn fn = m_router->match(1 << m_method, path, params);
+        if (fn)
+        {
+            if (!get_write_buf())
+            {
+                return INTERNAL_ERROR;
+            }
+            route_response resp(m_write_buf + ROUTE_HEADER_SPACE, WRITE_BUFFER_SIZE - ROUTE_HEADER_SPACE);
+            fn(m_request, params, resp);
+            if (resp.overflow())
+            {
+                return INTERNAL_ERROR;
+            }
+            m_route_status = resp.status();
+            m_route_length = resp.length();
+            strcpy(m_route_type, resp.content_type());
+            m_generator = resp.take_generator();
+            return ROUTE_REQUEST;
+        }
+    }
+
+    // 代理路由：请求原样转发给上游，不再查找本地文件
+    m_proxy_route = upstream_conn::match(m_request.url());
+    if (m_proxy_route)
+    {
+        return PROXY_REQUEST;
+    }
+
+    // 预加载模式：资源目录不会变化，一次哈希探测即可确定结果
+    if (m_assets)
+    {
+        m_asset = m_assets->find(m_url, strlen(m_url));
+        if (m_asset && defer(m_asset->body_len))
+        {
+            return DEFERRED_REQUEST;
+        }
+        return m_asset ? ASSET_REQUEST : NO_RESOURCE;
+    }
+
     // "/home/nowcoder/webserver/resources"
     strcpy(m_real_file, doc_root);
     int len = strlen(doc_root);
@@ -343,6 +878,10 @@ http_conn::HTTP_CODE http_conn::do_request()
     {
         return BAD_REQUEST;
     }
+    if (defer(m_file_stat.st_size))
+    {
+        return DEFERRED_REQUEST; // 再次出队时重新stat，文件在这期间可能已经变化
+    }
 
     // 以只读方式打开文件
     int fd = open(m_real_file, O_RDONLY);
@@ -352,6 +891,18 @@ http_conn::HTTP_CODE http_conn::do_request()
     return FILE_REQUEST;
 }
 
+// 大文件请求在工作线程中的映射、在reactor中的发送都比廉价请求慢得多，解析完之后让出高优先级队列。
+// 路由处理函数和代理请求总是高优先级：前者在写缓冲区内生成响应，后者的转发由reactor驱动
+bool http_conn::defer(size_t body_len)
+{
+    if (m_low_bytes <= 0 || m_deferred || body_len < (size_t)m_low_bytes)
+    {
+        return false;
+    }
+    m_deferred = true;
+    return true;
+}
+
 void http_conn::unmap() // 对内存映射区执行munmap操作
 {
     if (m_file_address)
@@ -361,58 +912,109 @@ void http_conn::unmap() // 对内存映射区执行munmap操作
     }
 }
 
+void http_conn::consume_iv(int bytes)
+{
+    int done = 0;
+    while (done < m_iv_count && bytes >= (int)m_iv[done].iov_len)
+    {
+        bytes -= m_iv[done].iov_len;
+        ++done;
+    }
+    for (int i = done; i < m_iv_count; ++i)
+    {
+        m_iv[i - done] = m_iv[i];
+    }
+    m_iv_count -= done;
+    if (m_iv_count > 0)
+    {
+        m_iv[0].iov_base = (char *)m_iv[0].iov_base + bytes;
+        m_iv[0].iov_len -= bytes;
+    }
+}
+
 bool http_conn::write()
 {
     int temp = 0;
-    int bytes_have_send = 0;           // 已经发送的字节
-    int bytes_to_send = m_write_index; // 将要发送的字节 （m_write_index）写缓冲区中待发送的字节数
 
-    if (bytes_to_send == 0)
+    if (m_upstream)
     {
-        // 将要发送的字节数等于0，这一次响应结束
-        modfd(m_epollfd, m_sockfd, EPOLLIN);
-        init();
+        // 代理响应转发时客户端写缓冲满，现在可以继续了
+        m_upstream->on_client_writable();
+        return true;
+    }
+    if (m_h2)
+    {
+        return rearm_h2(m_h2->flush());
+    }
+
+    if (m_bytes_to_send == 0)
+    {
+        // 将要发送的字节数等于0，这一次响应结束。已经有流水线上的请求时（proxy_done）不注册事件，由reactor交给线程池
+        if (!m_pipelined)
+        {
+            rearm(EPOLLIN);
+            init();
+        }
         return true;
     }
 
     while (1)
     {
-        temp = writev(m_sockfd, m_iv, m_iv_count);
+        temp = send_iov(m_iv, m_iv_count);
         if (temp <= -1)
         {
             // 如果TCP写缓冲没有空间，则等待下一轮EPOLLOUT事件，虽然在此期间，
             // 服务器无法立即接收到同一客户的下一个请求，但可以保证连接的完整性。
             if (errno == EAGAIN)
             {
-                modfd(m_epollfd, m_sockfd, EPOLLOUT);
+                rearm(EPOLLOUT);
                 return true;
             }
             unmap();
             return false;
         }
-        bytes_to_send -= temp;
-        bytes_have_send += temp;
-        if (bytes_to_send <= bytes_have_send)
+        m_bytes_to_send -= temp;
+        if (m_bytes_to_send <= 0 && m_generator)
+        {
+            // 分块响应的上一块已经发完，在reactor中生成下一块接着发
+            m_iv_count = 0;
+            if (!next_chunk())
+            {
+                return false;
+            }
+            continue;
+        }
+        if (m_bytes_to_send <= 0)
         {
             // 发送HTTP响应成功，根据HTTP请求中的Connection字段决定是否立即关闭连接
             unmap();
             if (m_linger)
             {
                 init();
-                modfd(m_epollfd, m_sockfd, EPOLLIN);
+                if (!m_pipelined)
+                {
+                    rearm(EPOLLIN);
+                }
                 return true;
             }
             else
             {
-                modfd(m_epollfd, m_sockfd, EPOLLIN);
+                rearm(EPOLLIN);
                 return false;
             }
         }
+        // 只写出了一部分，跳过已发送的数据继续写
+        consume_iv(temp);
     }
 }
 
 bool http_conn::process_write(HTTP_CODE ret)
 {
+    // 预加载的资源和限流应答不需要写缓冲区，其余响应的响应头都写在写缓冲区中
+    if (ret != ASSET_REQUEST && ret != TOO_MANY_REQUESTS && !get_write_buf())
+    {
+        return false;
+    }
     switch (ret)
     {
     case INTERNAL_ERROR:
@@ -447,6 +1049,39 @@ bool http_conn::process_write(HTTP_CODE ret)
             return false;
         }
         break;
+    case BAD_GATEWAY:
+        add_status_line(502, error_502_title);
+        add_headers(strlen(error_502_form));
+        if (!add_content(error_502_form))
+        {
+            return false;
+        }
+        break;
+    case BODY_REQUEST:
+        add_status_line(m_body_status, status_title(m_body_status));
+        add_headers(0);
+        break;
+    case ROUTE_REQUEST:
+        // 响应头的长度有上限（Content-Type不超过MAX_CONTENT_TYPE），不会写到响应体的位置
+        add_status_line(m_route_status, status_title(m_route_status));
+        if (m_generator)
+        {
+            // 分块响应：响应头和第一块一起发出，之后每发完一块再生成下一块
+            add_chunked_headers(m_route_type);
+            m_iv[0].iov_base = m_write_buf;
+            m_iv[0].iov_len = m_write_index;
+            m_iv_count = 1;
+            m_bytes_to_send = m_write_index;
+            return next_chunk();
+        }
+        add_headers(m_route_length, m_route_type);
+        m_iv[0].iov_base = m_write_buf;
+        m_iv[0].iov_len = m_write_index;
+        m_iv[1].iov_base = m_write_buf + ROUTE_HEADER_SPACE;
+        m_iv[1].iov_len = m_route_length;
+        m_iv_count = 2;
+        m_bytes_to_send = m_write_index + m_route_length;
+        return true;
     case FILE_REQUEST:
         add_status_line(200, ok_200_title);
         add_headers(m_file_stat.st_size);
@@ -455,6 +1090,26 @@ bool http_conn::process_write(HTTP_CODE ret)
         m_iv[1].iov_base = m_file_address;
         m_iv[1].iov_len = m_file_stat.st_size;
         m_iv_count = 2;
+        m_bytes_to_send = m_write_index + m_file_stat.st_size;
+        return true;
+    case TOO_MANY_REQUESTS:
+        m_status = 429;
+        m_linger = false;
+        m_iv[0].iov_base = (void *)error_429_response;
+        m_iv[0].iov_len = error_429_response_len;
+        m_iv_count = 1;
+        m_bytes_to_send = error_429_response_len;
+        return true;
+    case ASSET_REQUEST:
+        // 响应头和内容都是预生成的，直接指向预加载区
+        m_iv[0].iov_base = (void *)m_asset->header[m_linger ? 1 : 0];
+        m_iv[0].iov_len = m_asset->header_len[m_linger ? 1 : 0];
+        m_iv[1].iov_base = (void *)m_asset->body;
+        m_iv[1].iov_len = m_asset->body_len;
+        m_iv_count = 2;
+        m_bytes_to_send = m_iv[0].iov_len + m_iv[1].iov_len;
+        m_status = 200;
+        m_zc_body = m_zerocopy && m_asset->body_len >= zerocopy::threshold();
         return true;
     default:
         return false;
@@ -463,28 +1118,534 @@ bool http_conn::process_write(HTTP_CODE ret)
     m_iv[0].iov_base = m_write_buf;
     m_iv[0].iov_len = m_write_index;
     m_iv_count = 1;
+    m_bytes_to_send = m_write_index;
     return true;
 }
 
-void http_conn::process() // 由于线程池中的工作线程调用，这是处理HTTP请求的入口函数
+bool http_conn::next_chunk()
 {
-    // 解析HTTP请求
-    HTTP_CODE read_ret = process_read();
+    static const char last_chunk[] = "0\r\n\r\n";
+    if (!m_chunk_buf && !(m_chunk_buf = buffer_pool::acquire(m_node)))
+    {
+        return false;
+    }
+    // 块数据写在长度行之后，末尾留出CRLF，长度行右对齐紧贴数据，整块是一段连续的内存
+    char *data = m_chunk_buf + CHUNK_PREFIX;
+    int capacity = buffer_pool::CHUNK_SIZE - CHUNK_PREFIX - 2;
+    int len = m_generator->fill(data, capacity);
+    if (len < 0 || len > capacity)
+    {
+        return false;
+    }
+    if (len == 0)
+    {
+        delete m_generator;
+        m_generator = NULL;
+        m_iv[m_iv_count].iov_base = (void *)last_chunk;
+        m_iv[m_iv_count].iov_len = sizeof(last_chunk) - 1;
+    }
+    else
+    {
+        char head[CHUNK_PREFIX + 1];
+        int head_len = snprintf(head, sizeof(head), "%x\r\n", len);
+        memcpy(data - head_len, head, head_len);
+        memcpy(data + len, "\r\n", 2);
+        m_iv[m_iv_count].iov_base = data - head_len;
+        m_iv[m_iv_count].iov_len = head_len + len + 2;
+    }
+    m_bytes_to_send += m_iv[m_iv_count].iov_len;
+    ++m_iv_count;
+    return true;
+}
+
+int http_conn::process() // 由于线程池中的工作线程调用，这是处理HTTP请求的入口函数
+{
+    TRACE_POINT(dequeue, TS_DEQUEUE);
+    m_pipelined = false;
+    if (m_h2)
+    {
+        process_h2();
+        return TASK_DONE;
+    }
+    if (h2_preface())
+    {
+        if (m_read_index < H2_PREFACE_LEN)
+        {
+            rearm(EPOLLIN); // 前言还没收全
+            return TASK_DONE;
+        }
+        m_h2 = new h2_session(this);
+        m_h2->start();
+        process_h2();
+        return TASK_DONE;
+    }
+
+    // 解析HTTP请求。从低优先级队列再次出队时请求已经解析完，直接处理（m_deferred为true，不会再次推迟）
+    HTTP_CODE read_ret;
+    if (m_deferred)
+    {
+        read_ret = do_request();
+        m_deferred = false;
+    }
+    else
+    {
+        read_ret = process_read();
+    }
+    while (read_ret == NO_REQUEST && tls_pending())
+    {
+        // 已解密的数据留在SSL内部，socket上不会再有EPOLLIN，由工作线程接着读
+        if (!read())
+        {
+            close_conn();
+            return TASK_DONE;
+        }
+        read_ret = process_read();
+    }
+    if (read_ret == DEFERRED_REQUEST)
+    {
+        return TASK_LOW; // 连接不重新注册事件，在队列中等待期间没有别的线程访问它
+    }
     if (read_ret == NO_REQUEST)
     {
-        modfd(m_epollfd, m_sockfd, EPOLLIN);
-        return;
+        rearm(EPOLLIN);
+        return TASK_DONE;
+    }
+    TRACE_POINT(do_request, TS_HANDLED);
+    if (read_ret == PROXY_REQUEST)
+    {
+        if (start_proxy())
+        {
+            return TASK_DONE; // 之后由reactor驱动，不能再访问本连接
+        }
+        read_ret = BAD_GATEWAY;
+    }
+    if (read_ret == H2C_UPGRADE)
+    {
+        m_h2 = new h2_session(this);
+        if (m_h2->start_upgrade(m_request))
+        {
+            // 升级请求之后读到的数据（客户端的连接前言）属于HTTP/2
+            m_read_index -= m_checked_index;
+            memmove(m_read_buf, m_read_buf + m_checked_index, m_read_index);
+            process_h2();
+            return TASK_DONE;
+        }
+        delete m_h2;
+        m_h2 = NULL;
+        read_ret = BAD_REQUEST;
     }
 
     // 生成响应
     bool write_ret = process_write(read_ret);
     if (!write_ret)
+    {
+        close_conn();
+        return TASK_DONE;
+    }
+    rearm(EPOLLOUT);
+    return TASK_DONE;
+}
+
+bool http_conn::handshaking() const
+{
+#ifdef USE_TLS
+    return m_tls && !m_tls_ready;
+#else
+    return false;
+#endif
+}
+
+bool http_conn::handshake()
+{
+#ifdef USE_TLS
+    int want = 0;
+    int r = m_ssl ? tls_handshake(m_ssl, &want) : -1;
+    if (r < 0)
+    {
+        return false;
+    }
+    if (r == 0)
+    {
+        rearm(want);
+        return true;
+    }
+    m_tls_ready = true;
+    m_ktls_send = tls_ktls_send(m_ssl);
+    rearm(EPOLLIN);
+#endif
+    return true;
+}
+
+bool http_conn::raw_recv() const
+{
+#ifdef USE_TLS
+    return !m_ssl;
+#else
+    return true;
+#endif
+}
+
+bool http_conn::tls_pending() const
+{
+#ifdef USE_TLS
+    return m_ssl && m_tls_ready && SSL_pending(m_ssl) > 0;
+#else
+    return false;
+#endif
+}
+
+ssize_t http_conn::recv_some(char *buf, int len)
+{
+#ifdef USE_TLS
+    if (m_ssl)
+    {
+        int n = SSL_read(m_ssl, buf, len);
+        if (n > 0)
+        {
+            return n;
+        }
+        switch (SSL_get_error(m_ssl, n))
+        {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
+            return -1;
+        case SSL_ERROR_ZERO_RETURN:
+            return 0; // 对方发送了close_notify
+        default:
+            ERR_clear_error();
+            errno = EIO;
+            return -1;
+        }
+    }
+#endif
+    return recv(m_sockfd, buf, len, 0);
+}
+
+ssize_t http_conn::send_iov(const struct iovec *iv, int count)
+{
+    ssize_t n = write_iov(iv, count);
+    if (n > 0)
+    {
+        m_bytes_sent += n;
+    }
+    if (n > 0 && !m_first_byte)
+    {
+        m_first_byte = true;
+        TRACE_POINT(first_byte, TS_FIRST_BYTE);
+    }
+    return n;
+}
+
+ssize_t http_conn::write_iov(const struct iovec *iv, int count)
+{
+#ifdef USE_TLS
+    if (m_ssl && !m_ktls_send)
+    {
+        // 逐块SSL_write。某一块被阻塞时返回已写出的字节数，调用者跳过它们后重试，
+        // 重试时从同一位置开始，满足SSL_write对重试参数的要求
+        ssize_t total = 0;
+        for (int i = 0; i < count; ++i)
+        {
+            if (iv[i].iov_len == 0)
+            {
+                continue;
+            }
+            int n = SSL_write(m_ssl, iv[i].iov_base, iv[i].iov_len);
+            if (n <= 0)
+            {
+                if (total > 0)
+                {
+                    return total;
+                }
+                int err = SSL_get_error(m_ssl, n);
+                errno = (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ) ? EAGAIN : EIO;
+                ERR_clear_error();
+                return -1;
+            }
+            total += n;
+            if (n < (int)iv[i].iov_len)
+            {
+                return total;
+            }
+        }
+        return total;
+    }
+#endif
+    if (m_zc_body)
+    {
+        ssize_t n = zerocopy::send(m_sockfd, iv, count);
+        if (n > 0)
+        {
+            ++m_zc_sent;
+        }
+        if (n >= 0 || errno != ENOBUFS)
+        {
+            return n;
+        }
+    }
+    return writev(m_sockfd, iv, count);
+}
+
+ssize_t http_conn::send_from_pipe(int pipefd, size_t len)
+{
+#ifdef USE_TLS
+    if (m_ssl && !m_ktls_send)
+    {
+        // 代理转发期间写缓冲区空闲，用来暂存从管道读出的数据；没发完的部分仍计在调用者的len中
+        if (m_stage_off == m_stage_len)
+        {
+            if (!get_write_buf())
+            {
+                errno = ENOMEM;
+                return -1;
+            }
+            ssize_t n = ::read(pipefd, m_write_buf, len < (size_t)WRITE_BUFFER_SIZE ? len : WRITE_BUFFER_SIZE);
+            if (n <= 0)
+            {
+                return n;
+            }
+            m_stage_off = 0;
+            m_stage_len = n;
+        }
+        struct iovec iv = {m_write_buf + m_stage_off, (size_t)(m_stage_len - m_stage_off)};
+        ssize_t n = send_iov(&iv, 1);
+        if (n > 0)
+        {
+            m_stage_off += n;
+        }
+        return n;
+    }
+#endif
+    ssize_t n = splice(pipefd, NULL, m_sockfd, NULL, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n > 0)
+    {
+        m_bytes_sent += n;
+    }
+    return n;
+}
+
+bool http_conn::h2_preface()
+{
+    if (!m_h2c || m_check_state != CHECK_STATE_REQUESTLINE || m_start_line != 0 || m_read_index == 0)
+    {
+        return false;
+    }
+    int n = m_read_index < H2_PREFACE_LEN ? m_read_index : H2_PREFACE_LEN;
+    return memcmp(m_read_buf, H2_PREFACE, n) == 0;
+}
+
+void http_conn::process_h2()
+{
+    bool ok = m_h2->feed(m_read_buf, m_read_index);
+    m_read_index = 0;
+    while (ok && tls_pending() && read())
+    {
+        ok = m_h2->feed(m_read_buf, m_read_index);
+        m_read_index = 0;
+    }
+    // 会话已经复制了不足一帧的输入，读缓冲区可以还给池
+    release_buffers();
+    int ret = m_h2->flush();
+    if (!ok)
+    {
+        // 连接错误，GOAWAY已尽量发出
+        close_conn();
+        return;
+    }
+    if (!rearm_h2(ret))
+    {
+        close_conn();
+    }
+}
+
+bool http_conn::rearm_h2(int flush_ret)
+{
+    if (flush_ret < 0 || (flush_ret == 0 && m_h2->finished()))
+    {
+        return false;
+    }
+    // 有数据没发完时同时等待可写和可读：对方的WINDOW_UPDATE可能正是继续发送的前提
+    rearm(flush_ret ? (EPOLLIN | EPOLLOUT) : EPOLLIN);
+    return true;
+}
+
+// 向上游发送HTTP/1.0请求：去掉逐跳头部和请求体相关的头部，追加X-Forwarded-For，要求上游保持连接
+bool http_conn::start_proxy()
+{
+    m_upstream = upstream_conn::acquire(m_proxy_route, this);
+    if (!m_upstream)
+    {
+        return false;
+    }
+    char *buf = m_upstream->request_buf();
+    const int size = upstream_conn::REQUEST_SIZE;
+    std::string_view method = m_request.method();
+    std::string_view url = m_request.url();
+    int len = snprintf(buf, size, "%.*s %.*s HTTP/1.0\r\n", (int)method.size(), method.data(), (int)url.size(), url.data());
+    for (int i = 0; i < m_request.header_count() && len < size; ++i)
+    {
+        switch (m_request.id(i))
+        {
+        case HDR_CONNECTION:
+        case HDR_KEEP_ALIVE:
+        case HDR_UPGRADE:
+        case HDR_HTTP2_SETTINGS:
+        case HDR_EXPECT:
+        case HDR_TRANSFER_ENCODING:
+        case HDR_CONTENT_LENGTH:
+        case HDR_X_FORWARDED_FOR:
+            continue;
+        default:
+            break;
+        }
+        std::string_view name = m_request.name(i);
+        std::string_view value = m_request.value(i);
+        len += snprintf(buf + len, size - len, "%.*s: %.*s\r\n", (int)name.size(), name.data(), (int)value.size(), value.data());
+    }
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &m_address.sin_addr, ip, sizeof(ip));
+    std::string_view forwarded = m_request.get(HDR_X_FORWARDED_FOR);
+    if (len < size)
+    {
+        len += snprintf(buf + len, size - len, "X-Forwarded-For: %.*s%s%s\r\n%sConnection: keep-alive\r\n\r\n",
+                        (int)forwarded.size(), forwarded.data(), forwarded.empty() ? "" : ", ", ip,
+                        m_method == GET ? "" : "Content-Length: 0\r\n");
+    }
+    if (len >= size)
+    {
+        m_upstream->abort();
+        m_upstream = NULL;
+        return false;
+    }
+    m_upstream->start(len, m_linger);
+    return true;
+}
+
+void http_conn::proxy_done(bool keep_alive)
+{
+    m_upstream = NULL;
+    if (keep_alive)
+    {
+        // 已经有流水线上的请求时等待EPOLLOUT：socket可写时立即触发，由reactor的write()把连接交给线程池
+        init();
+        rearm(m_pipelined ? EPOLLOUT : EPOLLIN);
+    }
+    else
+    {
+        close_conn();
+    }
+}
+
+void http_conn::proxy_failed()
+{
+    m_upstream = NULL;
+    if (process_write(BAD_GATEWAY))
+    {
+        rearm(EPOLLOUT);
+    }
+    else
     {
         close_conn();
     }
-    modfd(m_epollfd, m_sockfd, EPOLLOUT);
 }
 
+#ifdef HAVE_COROUTINE
+co_task http_conn::serve()
+{
+#ifdef USE_TLS
+    while (handshaking())
+    {
+        int want = 0;
+        int r = m_ssl ? tls_handshake(m_ssl, &want) : -1;
+        if (r < 0)
+        {
+            close_conn();
+            co_return;
+        }
+        if (r == 0)
+        {
+            unsigned int events = co_await wait_io{m_epollfd, m_sockfd, want, m_handle, m_waiter};
+            if (events & (EPOLLHUP | EPOLLERR))
+            {
+                close_conn();
+                co_return;
+            }
+            continue;
+        }
+        m_tls_ready = true;
+        m_ktls_send = tls_ktls_send(m_ssl);
+    }
+#endif
+    while (true)
+    {
+        // 等待请求数据到达，SSL中已有解密好的数据或读缓冲区中已有流水线上的请求时不用等
+        if (!tls_pending() && !m_pipelined)
+        {
+            unsigned int events = co_await wait_io{m_epollfd, m_sockfd, EPOLLIN, m_handle, m_waiter};
+            if (events & (EPOLLHUP | EPOLLERR))
+            {
+                break;
+            }
+        }
+        m_pipelined = false;
+        if (!read())
+        {
+            break;
+        }
+        HTTP_CODE read_ret = process_read();
+        if (read_ret == NO_REQUEST)
+        {
+            continue;
+        }
+        if (read_ret == PROXY_REQUEST)
+        {
+            read_ret = BAD_GATEWAY; // 协程模式不支持反向代理
+        }
+        if (!process_write(read_ret))
+        {
+            break;
+        }
+
+        // 发送响应，TCP写缓冲满时挂起等待EPOLLOUT，部分写入后调整iovec继续发送
+        bool ok = true;
+        while (m_bytes_to_send > 0)
+        {
+            int temp = send_iov(m_iv, m_iv_count);
+            if (temp < 0)
+            {
+                if (errno == EAGAIN)
+                {
+                    unsigned int events = co_await wait_io{m_epollfd, m_sockfd, EPOLLOUT, m_handle, m_waiter};
+                    if (events & (EPOLLHUP | EPOLLERR))
+                    {
+                        ok = false;
+                        break;
+                    }
+                    continue;
+                }
+                ok = false;
+                break;
+            }
+            m_bytes_to_send -= temp;
+            consume_iv(temp);
+            if (m_bytes_to_send <= 0 && m_generator && !next_chunk())
+            {
+                ok = false;
+                break;
+            }
+        }
+        unmap();
+        if (!ok || !m_linger)
+        {
+            break;
+        }
+        init();
+    }
+    close_conn();
+}
+#endif
+
 bool http_conn::add_response(const char *format, ...)
 {
     if (m_write_index >= WRITE_BUFFER_SIZE)
@@ -508,22 +1669,25 @@ bool http_conn::add_content(const char *content)
     return add_response("%s", content);
 }
 
-bool http_conn::add_content_type()
+bool http_conn::add_content_type(const char *type)
 {
-    return add_response("Content-Type:%s\r\n", "text/html");
+    return add_response("Content-Type:%s\r\n", type);
 }
 
 bool http_conn::add_status_line(int status, const char *title)
 {
+    m_status = status;
     return add_response("%s %d %s\r\n", "HTTP/1.1", status, title);
 }
 
-bool http_conn::add_headers(int content_length)
+bool http_conn::add_headers(int content_length, const char *type)
+{
+    return add_content_length(content_length) && add_content_type(type) && add_linger() && add_blank_line();
+}
+
+bool http_conn::add_chunked_headers(const char *type)
 {
-    add_content_length(content_length);
-    add_content_type();
-    add_linger();
-    add_blank_line();
+    return add_response("Transfer-Encoding: chunked\r\n") && add_content_type(type) && add_linger() && add_blank_line();
 }
 
 bool http_conn::add_content_length(int content_length)
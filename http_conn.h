@@ -17,6 +17,21 @@
 #include <sys/mman.h>
 #include <sys/uio.h>
 #include "locker.h"
+#include "coroutine.h"
+#include "asset_arena.h"
+#include "http_request.h"
+#include "body_handler.h"
+#include "router.h"
+#include "proxy.h"
+#include "tls.h"
+#include "http2.h"
+#include "buffer_pool.h"
+#include "trace.h"
+#include "rate_limit.h"
+#include "capture.h"
+#include "access_log.h"
+#include "zerocopy.h"
+#include "threadpool.h"
 #include <string.h>
 
 class http_conn
@@ -24,11 +39,23 @@ class http_conn
 public:
     static int m_epollfd;                      // 所有socket上的事件都被注册到同一个epoll对象上
     static int m_user_count;                   // 统计用户的数量
-    static const int READ_BUFFER_SIZE = 2048;  // 读缓冲区的大小
-    static const int WRITE_BUFFER_SIZE = 2048; // 写缓冲区的大小
+    static uint32_t m_generation;              // 连接代数计数器，每个新连接加1
+    static const asset_arena *m_assets;        // 预加载的静态资源，非NULL时do_request只查这里
+    static body_handler_factory m_body_factory; // 为POST/PUT请求创建请求体处理器，NULL表示不接受请求体
+    static const router *m_router;             // 动态请求的路由表，先于文件查找
+    static bool m_h2c;                         // 是否接受HTTP/2明文（连接前言或Upgrade: h2c）
+    static long long m_low_bytes;              // 响应体不小于该值的请求解析完后改排低优先级队列，0表示不分类
+#ifdef USE_TLS
+    static tls_context *m_tls;                 // 非NULL时所有连接都使用TLS
+#endif
+    static const int READ_BUFFER_SIZE = buffer_pool::CHUNK_SIZE;  // 读缓冲区的大小
+    static const int WRITE_BUFFER_SIZE = buffer_pool::CHUNK_SIZE; // 写缓冲区的大小
     static const int FILENAME_LEN = 200;
+    static const int MIN_BODY_CHUNK = 512;     // 请求头之后至少要留出这么多读缓冲区来接收请求体
+    static const int ROUTE_HEADER_SPACE = 256; // 写缓冲区开头留给动态响应响应头的空间，之后是处理函数写入的响应体
+    static const int CHUNK_PREFIX = 8;         // 分块缓冲区开头留给块长度行（十六进制长度和CRLF）的空间
 
-    // http请求方法，只支持GET
+    // http请求方法，支持GET、POST、PUT
     enum METHOD
     {
         GET = 0,
@@ -59,6 +86,12 @@ public:
     NO RESOURCE：表示服务器没有资源
     FORBIDDEN_REQUEST：表示客户对资源没有足够的访问权限
     FILE REQUEST：文件请求，获取文件成功
+    ASSET_REQUEST：请求的文件在预加载区中
+    BODY_REQUEST：请求体已经交给处理器，按m_body_status回复
+    ROUTE_REQUEST：请求由路由表中的处理函数处理，响应体已写入写缓冲区
+    PROXY_REQUEST：请求匹配代理路由，转发给上游
+    H2C_UPGRADE：请求要求升级到HTTP/2
+    BAD_GATEWAY：上游连接失败或响应无效
     INTERNAL ERROR：表示服务器内部错误
     CLOSED_CONNECTION：表示客户端已经关闭连接了*/
     enum HTTP_CODE
@@ -69,6 +102,14 @@ public:
         NO_RESOURCE,
         FORBIDDEN_REQUEST,
         FILE_REQUEST,
+        ASSET_REQUEST,
+        BODY_REQUEST,
+        ROUTE_REQUEST,
+        PROXY_REQUEST,
+        H2C_UPGRADE,
+        BAD_GATEWAY,
+        TOO_MANY_REQUESTS,
+        DEFERRED_REQUEST, // 代价高的请求，已经解析完，重新排进低优先级队列后再生成响应
         INTERNAL_ERROR,
         CLOSED_CONNECTION
     };
@@ -85,16 +126,56 @@ public:
     http_conn() {}
     ~http_conn() {}
 
-    void process();                                 // 处理客户端请求
-    void init(int sockfd, const sockaddr_in &addr); // 初始化新的连接
+    int process();                                  // 处理客户端请求，返回TASK_DONE或重新排队的任务类别
+    // 初始化新的连接，node为该连接所在的NUMA节点，local表示Unix域套接字上的本机连接（addr为回环地址）
+    void init(int sockfd, const sockaddr_in &addr, int node = -1, bool local = false);
     void close_conn();                              // 关闭连接
     bool read();                                    // 非阻塞的读
     bool write();                                   // 非阻塞的写
+    int get_node() const { return m_node; }         // 连接所在的NUMA节点，-1表示未知
+    const http_request &request() const { return m_request; } // 当前请求的请求行和头部字段
+    int get_sockfd() const { return m_sockfd; }
+    const sockaddr_in &get_address() const { return m_address; }
+    bool is_local() const { return m_local; }       // Unix域套接字上的本机连接：不限流、不走TLS和零拷贝
+    // 连接句柄 = 代数 << 32 | fd，注册到epoll的data.u64中并随任务一起排队。
+    // init时分配新的代数，close_conn时清零，所以句柄不匹配的事件或任务属于已经关闭（fd可能已被复用）的旧连接
+    uint64_t handle() const { return __atomic_load_n(&m_handle, __ATOMIC_ACQUIRE); }
+    bool valid(uint64_t h) const { return h != 0 && handle() == h; }
+    void trace_enqueue();                           // reactor把连接交给线程池之前调用，用于追踪
+    bool handshaking() const;                       // TLS握手尚未完成
+    bool handshake();                               // 在reactor中推进TLS握手，返回false表示失败
+    void rearm(int ev);                             // 重新注册EPOLLONESHOT事件并记下等待的事件
+    bool zerocopy_pending() const { return m_zc_sent != m_zc_done; } // 有MSG_ZEROCOPY发送还没收到完成通知
+    // 流水线：上一个响应发完时读缓冲区里已经有下一个请求的数据，连接没有重新注册事件，
+    // write()返回后由reactor直接把连接交给线程池
+    bool pipelined() const { return m_pipelined; }
+    // reactor处理zerocopy_pending的连接的事件之前调用：读出完成通知。有的内核对完成通知报告EPOLLERR，
+    // 不是真正的错误时返回去掉EPOLLERR的events，此时没有其他事件则按原来等待的事件重新注册并返回0。
+    // 真正的错误原样返回events
+    unsigned int zerocopy_event(unsigned int events);
+    // 向客户端发送数据，语义与writev/splice相同（-1且errno为EAGAIN表示需要等待EPOLLOUT），
+    // TLS连接在kTLS不可用时经SSL_write加密
+    ssize_t send_iov(const struct iovec *iv, int count);
+    ssize_t send_from_pipe(int pipefd, size_t len);
+    // 由upstream_conn在reactor中调用：代理的响应已经转发完（keep_alive为false时关闭连接），
+    // 或者在向客户端发送任何内容之前失败（回复502）
+    void proxy_done(bool keep_alive);
+    void proxy_failed();
+    void proxy_status(int status) { m_status = status; } // 上游响应的状态码，记入访问日志
+#ifdef HAVE_COROUTINE
+    // 协程模式：读、解析、写在同一个协程里顺序完成，等待socket就绪时挂起，
+    // 由主线程的reactor调用resume()恢复。协程模式下连接不经过线程池
+    co_task serve();
+    bool resume(unsigned int events) { return m_waiter.resume(events); }
+#endif
 
 private:
     int m_sockfd;                      // 该HTTP连接的socket;
-    sockaddr_in m_address;             // 通信的socket地址
-    char m_read_buf[READ_BUFFER_SIZE]; // 读缓冲区
+    uint64_t m_handle;                 // 连接句柄，连接关闭后为0
+    sockaddr_in m_address;             // 通信的socket地址，Unix域套接字上的连接为回环地址
+    bool m_local;                      // 是否是Unix域套接字上的本机连接
+    int m_node;                        // 接收该连接数据包的CPU所在的NUMA节点，连接对象和任务都在该节点上分配/处理
+    char *m_read_buf;                  // 读缓冲区，从buffer_pool中取，连接空闲时归还并置为NULL
     int m_read_index;                  // 标记读缓冲区中以及客户端读入最后一个字节的下一个位置
 
     int m_checked_index;            // 当前分析的字符在读缓冲区的位置
@@ -104,32 +185,90 @@ private:
     char *m_version;                // 协议版本 HTTP1.1
     METHOD m_method;                // 请求方法
     CHECK_STATE m_check_state;      // 主状态机当前所属的状态
-    char *m_host;                   // 主机名
-    int m_content_length;           //HTTP请求的消息总长度
+    http_request m_request;         // 请求行和所有头部字段在读缓冲区中的位置
+    long long m_content_length;     // HTTP请求的消息总长度，接收请求体时为剩余未接收的长度
     bool m_linger;                  // HTTp请求是否保持连接
 
     char *m_file_address;    // 客户请求的目标文件被mmap到内存中的起始位置
     struct stat m_file_stat; // 目标文件的状态。通过它我们可以判断文件是否存在、是否为目录、是否可读，并获取文件大小等信息
     struct iovec m_iv[2];    // 我们将采用writev来执行写操作，所以定义下面两个成员，其中m_iv_count表示被写内存块的数量。
     int m_iv_count;
-    char m_write_buf[WRITE_BUFFER_SIZE]; // 写缓冲区
+    int m_bytes_to_send;     // m_iv中剩余待发送的字节数
+    const asset_arena::asset *m_asset; // 预加载模式下命中的资源
+
+    body_handler *m_body_handler; // 当前请求体的处理器，GET请求携带的请求体直接丢弃，此时为NULL
+    int m_body_fd;                // 处理器要求直接写入的文件，-1表示回调模式
+    int m_pipe[2];                // splice用的管道，socket -> m_pipe -> m_body_fd
+    int m_body_start;             // 请求头结束的位置，请求体按块读到读缓冲区的这个位置之后
+    int m_body_status;            // BODY_REQUEST的响应状态码
+
+    int m_route_status;           // ROUTE_REQUEST的响应状态码
+    int m_route_length;           // 处理函数写入的响应体长度
+    char m_route_type[route_response::MAX_CONTENT_TYPE]; // 处理函数设置的Content-Type
+    body_generator *m_generator;  // 分块生成响应体的生成器，最后一块取出后置为NULL
+    char *m_chunk_buf;            // 生成器写入的缓冲区，从buffer_pool中取，请求结束时归还
+    const proxy_route *m_proxy_route; // PROXY_REQUEST匹配到的代理路由
+    upstream_conn *m_upstream;        // 正在转发本连接请求的上游连接，期间连接由reactor驱动
+    h2_session *m_h2;                 // 升级到HTTP/2后的会话，之后读到的数据都交给它
+    trace_record m_trace;             // 被采样（或开启访问日志时每个）请求的各阶段时间，handle为0表示当前请求不记录
+    bool m_sampled;                   // 当前请求被tracer采样，结束时提交给tracer
+    long long m_accept_us;            // 开启采样或访问日志时记录连接建立的时间，交给连接上的第一个请求
+    int m_status;                     // 当前响应的状态码，0表示还没有生成响应
+    long long m_bytes_sent;           // 当前响应已发给客户端的字节数
+    bool m_first_byte;                // 当前响应已经写出过数据
+    char *m_write_buf;                   // 写缓冲区，需要时从buffer_pool中取，请求结束时归还
     int m_write_index;                   // 写缓冲区中待发送的字节数
+#ifdef HAVE_COROUTINE
+    io_waiter m_waiter;                  // 挂起在该连接socket上的协程
+#endif
+#ifdef USE_TLS
+    SSL *m_ssl;                          // TLS会话，明文连接为NULL
+    bool m_tls_ready;                    // 握手已完成
+    bool m_ktls_send;                    // 发送方向由内核加密，可以直接writev/splice
+    int m_stage_off;                     // send_from_pipe在没有kTLS时借用写缓冲区暂存管道中的数据
+    int m_stage_len;
+#endif
+    int m_wait_events;                   // 最近一次注册的EPOLLIN/EPOLLOUT
+    bool m_zerocopy;                     // 连接上打开了SO_ZEROCOPY，内核报告复制后关闭
+    bool m_zc_body;                      // 当前响应的响应体在预加载区且不小于阈值，用MSG_ZEROCOPY发送
+    uint32_t m_zc_sent;                  // 已占用的完成序号数
+    uint32_t m_zc_done;                  // 已收到完成通知的序号数
+    bool m_deferred;                     // 请求已经解析完并排进了低优先级队列，再次出队时直接do_request
+    bool m_pipelined;                    // 读缓冲区中留有流水线上下一个请求的数据，等待交给线程池
 
 
     void init();                              // 初始化连接其余的数据
+    void end_trace(bool closed = false);      // 请求结束，提交采样记录并写访问日志，closed表示响应没有完成连接就关闭了
+    bool get_write_buf();                     // 确保持有写缓冲区，池中取不到时返回false
+    void release_buffers(bool keep_read = false); // 把读写缓冲区还给buffer_pool，keep_read时保留读缓冲区
+    void start_trace();                       // 新请求的数据到达，被采样或要写访问日志时开始记录
     bool process_write(HTTP_CODE ret);        // 填充HTTP应答
+    bool next_chunk();                        // 上一块已经发完，向生成器要下一块并追加到m_iv，生成器出错时返回false
     HTTP_CODE process_read();                 // 解析HTTP请求
     HTTP_CODE parse_request_line(char *text); // 解析请求首行
     HTTP_CODE parse_headers(char *text);      // 解析请求头
-    HTTP_CODE parse_content(char *text);      // 解析请求体
+    HTTP_CODE begin_body();                   // 请求头解析完毕，开始接收请求体
+    HTTP_CODE read_body();                    // 把已读到的请求体交给处理器，splice模式下从socket直接搬到文件
+    bool feed_body(const char *data, int len);
+    void end_body(bool ok);                   // 结束请求体，调用处理器的finish并释放
+    ssize_t recv_some(char *buf, int len);    // 从客户端读取，TLS连接经SSL_read解密
+    ssize_t write_iov(const struct iovec *iv, int count); // send_iov的实际发送，TLS连接在kTLS不可用时经SSL_write加密
+    bool raw_recv() const;                    // socket上收到的是明文，可以直接splice
+    bool tls_pending() const;                 // SSL中还有已解密但没读出的数据
+    bool start_proxy();                       // 把请求改写后交给上游连接
+    bool h2_preface();                        // 读缓冲区以HTTP/2连接前言（或其前缀）开头
+    void process_h2();                        // HTTP/2模式下处理读到的帧并发送响应
+    bool rearm_h2(int flush_ret);             // 按发送结果重新注册事件，返回false表示应关闭连接
 
     // 这一组函数被process_write调用以填充HTTP应答。
     void unmap();
+    void consume_iv(int bytes);           // writev写出bytes字节后调整m_iv
     bool add_response(const char *format, ...);
     bool add_content(const char *content);
-    bool add_content_type();
+    bool add_content_type(const char *type = "text/html");
     bool add_status_line(int status, const char *title);
-    bool add_headers(int content_length);
+    bool add_headers(int content_length, const char *type = "text/html");
+    bool add_chunked_headers(const char *type); // 分块响应的响应头，代替Content-Length
     bool add_content_length(int content_length);
     bool add_linger();
     bool add_blank_line();
@@ -139,6 +278,7 @@ private:
         return m_read_buf + m_start_line;
     }
     HTTP_CODE do_request();
+    bool defer(size_t body_len);              // 按响应体大小判断是否推迟到低优先级队列
 
     LINE_STATUS parse_line();
 };
@@ -0,0 +1,245 @@
+#ifndef HTTP_REQUEST_H
+#define HTTP_REQUEST_H
+
+#include <stdint.h>
+#include <strings.h>
+#include <string_view>
+
+// 解析后的HTTP请求：请求行和所有头部字段都以(偏移, 长度)的形式记录在读缓冲区上，
+// 不拷贝、不分配内存。常用头部在编译期生成的完美哈希表中识别，取值为一次数组访问。
+
+// 已知的头部字段，顺序与known_headers一致
+enum HEADER_ID
+{
+    HDR_UNKNOWN = -1,
+    HDR_CONNECTION = 0,
+    HDR_CONTENT_LENGTH,
+    HDR_HOST,
+    HDR_CONTENT_TYPE,
+    HDR_TRANSFER_ENCODING,
+    HDR_EXPECT,
+    HDR_UPGRADE,
+    HDR_HTTP2_SETTINGS,
+    HDR_KEEP_ALIVE,
+    HDR_RANGE,
+    HDR_IF_RANGE,
+    HDR_IF_MODIFIED_SINCE,
+    HDR_IF_NONE_MATCH,
+    HDR_ACCEPT,
+    HDR_ACCEPT_ENCODING,
+    HDR_ACCEPT_LANGUAGE,
+    HDR_USER_AGENT,
+    HDR_REFERER,
+    HDR_COOKIE,
+    HDR_AUTHORIZATION,
+    HDR_CACHE_CONTROL,
+    HDR_PRAGMA,
+    HDR_ORIGIN,
+    HDR_X_FORWARDED_FOR,
+    HDR_X_REAL_IP,
+    HDR_COUNT
+};
+
+constexpr std::string_view known_headers[HDR_COUNT] = {
+    "Connection", "Content-Length", "Host", "Content-Type", "Transfer-Encoding",
+    "Expect", "Upgrade", "HTTP2-Settings", "Keep-Alive", "Range",
+    "If-Range", "If-Modified-Since", "If-None-Match", "Accept", "Accept-Encoding",
+    "Accept-Language", "User-Agent", "Referer", "Cookie", "Authorization",
+    "Cache-Control", "Pragma", "Origin", "X-Forwarded-For", "X-Real-IP"};
+
+constexpr char header_lower(char c)
+{
+    return (c >= 'A' && c <= 'Z') ? (char)(c + ('a' - 'A')) : c;
+}
+
+// 不区分大小写的FNV-1a
+constexpr uint32_t header_hash(std::string_view name, uint32_t seed)
+{
+    uint32_t h = 2166136261u ^ seed;
+    for (size_t i = 0; i < name.size(); ++i)
+    {
+        h ^= (unsigned char)header_lower(name[i]);
+        h *= 16777619u;
+    }
+    return h ^ (h >> 16);
+}
+
+const int HEADER_TABLE_SIZE = 64; // 2的幂，取模即取低位
+
+// 编译期寻找一个种子，使所有已知头部落在互不相同的槽位上
+constexpr uint32_t find_header_seed()
+{
+    for (uint32_t seed = 1; seed < 100000; ++seed)
+    {
+        bool used[HEADER_TABLE_SIZE] = {};
+        bool ok = true;
+        for (int i = 0; i < HDR_COUNT && ok; ++i)
+        {
+            uint32_t slot = header_hash(known_headers[i], seed) & (HEADER_TABLE_SIZE - 1);
+            ok = !used[slot];
+            used[slot] = true;
+        }
+        if (ok)
+        {
+            return seed;
+        }
+    }
+    return 0;
+}
+
+constexpr uint32_t HEADER_SEED = find_header_seed();
+static_assert(HEADER_SEED != 0, "no perfect hash seed for known headers");
+
+struct header_table
+{
+    signed char slots[HEADER_TABLE_SIZE]; // 槽位 -> HEADER_ID，-1为空
+};
+
+constexpr header_table build_header_table()
+{
+    header_table table = {};
+    for (int i = 0; i < HEADER_TABLE_SIZE; ++i)
+    {
+        table.slots[i] = -1;
+    }
+    for (int i = 0; i < HDR_COUNT; ++i)
+    {
+        table.slots[header_hash(known_headers[i], HEADER_SEED) & (HEADER_TABLE_SIZE - 1)] = (signed char)i;
+    }
+    return table;
+}
+
+constexpr header_table HEADER_TABLE = build_header_table();
+
+inline bool header_name_equal(std::string_view a, std::string_view b)
+{
+    return a.size() == b.size() && strncasecmp(a.data(), b.data(), a.size()) == 0;
+}
+
+// 识别头部名称，一次哈希加一次比较
+inline HEADER_ID lookup_header(std::string_view name)
+{
+    int id = HEADER_TABLE.slots[header_hash(name, HEADER_SEED) & (HEADER_TABLE_SIZE - 1)];
+    if (id < 0 || !header_name_equal(known_headers[id], name))
+    {
+        return HDR_UNKNOWN;
+    }
+    return (HEADER_ID)id;
+}
+
+class http_request
+{
+public:
+    static const int MAX_HEADERS = 64; // 超过的头部字段被忽略
+
+    struct field
+    {
+        unsigned short name_off;
+        unsigned short name_len;
+        unsigned short value_off;
+        unsigned short value_len;
+        short id; // HEADER_ID
+    };
+
+    // 开始解析新的请求，buf为该连接的读缓冲区
+    void reset(const char *buf)
+    {
+        m_buf = buf;
+        m_count = 0;
+        m_method = m_url = m_version = span();
+        for (int i = 0; i < HDR_COUNT; ++i)
+        {
+            m_known[i] = -1;
+        }
+    }
+
+    void set_request_line(const char *method, int method_len, const char *url, int url_len,
+                          const char *version, int version_len)
+    {
+        m_method = make_span(method, method_len);
+        m_url = make_span(url, url_len);
+        m_version = make_span(version, version_len);
+    }
+
+    // 记录一个头部字段，name和value都指向读缓冲区内部，返回其HEADER_ID
+    HEADER_ID add_header(const char *name, int name_len, const char *value, int value_len)
+    {
+        HEADER_ID id = lookup_header(std::string_view(name, name_len));
+        if (m_count >= MAX_HEADERS)
+        {
+            return id;
+        }
+        field &f = m_fields[m_count];
+        f.name_off = name - m_buf;
+        f.name_len = name_len;
+        f.value_off = value - m_buf;
+        f.value_len = value_len;
+        f.id = id;
+        // 重复的已知头部以第一个为准
+        if (id != HDR_UNKNOWN && m_known[id] < 0)
+        {
+            m_known[id] = m_count;
+        }
+        ++m_count;
+        return id;
+    }
+
+    std::string_view method() const { return view(m_method); }
+    std::string_view url() const { return view(m_url); }
+    std::string_view version() const { return view(m_version); }
+
+    bool has(HEADER_ID id) const { return m_known[id] >= 0; }
+    // 已知头部的值，不存在时返回空
+    std::string_view get(HEADER_ID id) const
+    {
+        return m_known[id] < 0 ? std::string_view() : value(m_known[id]);
+    }
+    // 按名称查找任意头部（不区分大小写），已知头部走哈希表，其余线性查找
+    std::string_view find(std::string_view name) const
+    {
+        HEADER_ID id = lookup_header(name);
+        if (id != HDR_UNKNOWN)
+        {
+            return get(id);
+        }
+        for (int i = 0; i < m_count; ++i)
+        {
+            if (header_name_equal(this->name(i), name))
+            {
+                return value(i);
+            }
+        }
+        return std::string_view();
+    }
+
+    int header_count() const { return m_count; }
+    std::string_view name(int i) const { return std::string_view(m_buf + m_fields[i].name_off, m_fields[i].name_len); }
+    std::string_view value(int i) const { return std::string_view(m_buf + m_fields[i].value_off, m_fields[i].value_len); }
+    HEADER_ID id(int i) const { return (HEADER_ID)m_fields[i].id; }
+
+private:
+    struct span
+    {
+        unsigned short off;
+        unsigned short len;
+    };
+
+    span make_span(const char *p, int len) const
+    {
+        span s;
+        s.off = p - m_buf;
+        s.len = len;
+        return s;
+    }
+    std::string_view view(span s) const { return std::string_view(m_buf + s.off, s.len); }
+
+    const char *m_buf;
+    span m_method;
+    span m_url;
+    span m_version;
+    int m_count;
+    short m_known[HDR_COUNT]; // HEADER_ID -> m_fields下标，-1表示没有该头部
+    field m_fields[MAX_HEADERS];
+};
+
+#endif
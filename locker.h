@@ -4,6 +4,7 @@
 #include <pthread.h>
 #include <exception>
 #include <semaphore.h>
+#include <time.h>
 
 // 线程同步机制封装类
 
@@ -112,6 +113,29 @@ public:
         return sem_wait(&m_sem) == 0;
     }
 
+    // 最多等待ms毫秒，超时或出错返回false
+    bool timedwait(int ms)
+    {
+        struct timespec t;
+        clock_gettime(CLOCK_REALTIME, &t);
+        t.tv_sec += ms / 1000;
+        t.tv_nsec += (long)(ms % 1000) * 1000000;
+        if (t.tv_nsec >= 1000000000)
+        {
+            t.tv_sec += 1;
+            t.tv_nsec -= 1000000000;
+        }
+        return sem_timedwait(&m_sem, &t) == 0;
+    }
+
+    // 不阻塞地尝试获取，计数为0时只读一次，不做原子的修改，忙等时不反复争抢缓存行
+    bool trywait()
+    {
+        int value = 0;
+        sem_getvalue(&m_sem, &value);
+        return value > 0 && sem_trywait(&m_sem) == 0;
+    }
+
     // 增加信号量
     bool post()
     {
@@ -1,6 +1,7 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <cstddef>
 // #include<sys/socket.h>
 // #include<netinet/in.h>
 #include <arpa/inet.h>
@@ -8,17 +9,32 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <sys/epoll.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
 #include <signal.h>
+#include <getopt.h>
+#include <vector>
+#include <algorithm>
 #include "locker.h"
 #include "threadpool.h"
 #include "http_conn.h"
+#include "affinity.h"
+#include "asset_arena.h"
+#include "proxy.h"
+#include "worker_stats.h"
+#include "reactor.h"
 
 #define MAX_FD 65535        // 最大连接数
 #define MAX_EVENT_NUM 10000 // 监听的最大事件数量
 
-extern void addfd(int epollfd, int fd, bool one_shot); // 添加文件描述符到epoll中
+extern void addfd(int epollfd, int fd, bool one_shot, uint64_t data); // 添加文件描述符到epoll中
 extern void removefd(int epollfd, int fd);             // 从epoll中删除文件描述符
-extern void modfd(int epollfd, int fd, int ev);         // 修改文件描述符
+extern void setnonblocking(int fd);                    // 设置文件描述符非阻塞
+extern void modfd(int epollfd, int fd, int ev, uint64_t data); // 修改文件描述符
+extern const char *doc_root;                           // 网站的根目录
+extern const char error_429_response[];                // 预先生成的限流应答
+extern const int error_429_response_len;
 
 void addsig(int sig, void(handler)(int)) // 添加信号捕捉
 {
@@ -43,57 +59,772 @@ sigaction 函数在失败时会返回 -1 并设置 errno。你的函数应该检
         perror("sigaction");
         exit(EXIT_FAILURE);*/
 
-int main(int argc, char *argv[])
+static volatile sig_atomic_t dump_stats = 0; // 主循环中检查，为1时打印统计信息
+static volatile sig_atomic_t dump_trace = 0; // 主循环中检查，为1时导出采样追踪
+static volatile sig_atomic_t stop_master = 0; // prefork主进程收到SIGTERM/SIGINT
+static threadpool<http_conn> *stats_pool = NULL; // 供/stats路由读取
+static int worker_index = -1;                    // prefork子进程的编号，单进程模式为-1
+
+// 内置的动态路由，在工作线程中执行
+static void health_route(const http_request &req, const route_params &params, route_response &resp)
 {
-    if (argc <= 1)
-    {
-        printf("按照此格式：%s port_number\n", basename(argv[0]));
-        exit(-1);
-    }
+    resp.append("{\"status\":\"ok\"}");
+}
 
-    // get port
-    int port = atoi(argv[1]);
+static void stats_route(const http_request &req, const route_params &params, route_response &resp)
+{
+    threadpool_stats stats;
+    stats_pool->get_stats(stats);
+    resp.appendf("{\"worker\":%d,\"users\":%d,\"threads\":%d,\"busy\":%d,\"queue\":%d,\"avg_wait_us\":%lld,"
+                 "\"high_wait_us\":%lld,\"low_wait_us\":%lld,\"low_queue\":%d,"
+                 "\"buffers_in_use\":%d,\"buffers_allocated\":%d,\"rate_limited\":%lld}",
+                 worker_index, http_conn::m_user_count, stats.live_threads, stats.busy_threads, stats.queue_size, stats.avg_wait_us,
+                 stats.class_wait_us[TASK_HIGH], stats.class_wait_us[TASK_LOW], stats.class_queue[TASK_LOW],
+                 buffer_pool::in_use(), buffer_pool::allocated(), rate_limiter::rejected());
+}
 
-    // 对SIGPIE信号进行处理
-    addsig(SIGPIPE, SIG_IGN);
+// /stream?bytes=N：分块生成N字节的文本（默认1MB，最多8MB），用来检验分块响应的首字节时间和内存占用。
+// 生成器在reactor中运行，不设上限的话任何客户端都可以让reactor无休止地生成输出
+static const long long MAX_STREAM_BYTES = 8LL << 20;
 
-    // 创建和初始化线程池
-    threadpool<http_conn> *pool = NULL;
-    try
+class pattern_generator : public body_generator
+{
+public:
+    static const int LINE_LEN = 16; // 15位行号加换行
+
+    explicit pattern_generator(long long total) : m_left(total), m_line(0), m_offset(0) {}
+
+    int fill(char *buf, int capacity)
     {
-        pool = new threadpool<http_conn>;
+        int len = 0;
+        while (m_left > 0 && len < capacity)
+        {
+            // 一行可能跨越两块，m_offset记录这一行已经输出的部分
+            char line[LINE_LEN + 1];
+            snprintf(line, sizeof(line), "%015lld\n", m_line);
+            int n = LINE_LEN - m_offset;
+            n = n < capacity - len ? n : capacity - len;
+            n = n < m_left ? n : (int)m_left;
+            memcpy(buf + len, line + m_offset, n);
+            len += n;
+            m_left -= n;
+            m_offset += n;
+            if (m_offset == LINE_LEN)
+            {
+                m_offset = 0;
+                ++m_line;
+            }
+        }
+        return len;
     }
-    catch (...)
+
+private:
+    long long m_left;
+    long long m_line;
+    int m_offset;
+};
+
+static void stream_route(const http_request &req, const route_params &params, route_response &resp)
+{
+    long long total = 1 << 20;
+    std::string_view url = req.url();
+    size_t pos = url.find("bytes=");
+    if (pos != std::string_view::npos)
     {
-        exit(-1);
+        total = atoll(std::string(url.substr(pos + 6)).c_str());
     }
+    total = total < 0 ? 0 : total > MAX_STREAM_BYTES ? MAX_STREAM_BYTES : total;
+    resp.set_content_type("text/plain");
+    resp.stream(new pattern_generator(total));
+}
 
-    http_conn *user = new http_conn[MAX_FD]; // 创建数组保存所有客户端的信息
+static constexpr route builtin_route_list[] = {
+    {ROUTE_GET, "/health", health_route},
+    {ROUTE_GET, "/stats", stats_route},
+    {ROUTE_GET, "/stream", stream_route},
+};
+static constexpr static_routes<3> builtin_routes(builtin_route_list);
+static_assert(builtin_routes.seed() != 0, "no perfect hash seed for builtin routes");
 
-    int listenfd = socket(AF_INET, SOCK_STREAM, 0); // 用于监听的套接字
+// 在Unix域套接字上监听，path以@开头时使用抽象命名空间（不在文件系统中创建文件），失败返回-1
+static int open_unix_listener(const char *path)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    size_t len = strlen(path);
+    if (len == 0 || len >= sizeof(address.sun_path))
+    {
+        return -1;
+    }
+    memcpy(address.sun_path, path, len);
+    if (path[0] == '@')
+    {
+        address.sun_path[0] = '\0'; // 抽象命名空间的名字以\0开头，长度由addrlen决定
+    }
+    else
+    {
+        unlink(path); // 上次运行留下的socket文件
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    socklen_t addrlen = offsetof(struct sockaddr_un, sun_path) + len;
+    if (bind(fd, (struct sockaddr *)&address, addrlen) < 0 || listen(fd, 5) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
 
+// 在所有地址的port端口上监听TCP，reuseport时打开SO_REUSEPORT以便多个socket组成一组，失败返回-1
+static int open_tcp_listener(int port, bool reuseport)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
     int reuse = 1;
-    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)); // 端口复用
-
-    // 绑定
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)); // 端口复用
+    if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
     struct sockaddr_in address;
     address.sin_family = AF_INET;
     address.sin_addr.s_addr = INADDR_ANY;
     address.sin_port = htons(port);
-    int ret = bind(listenfd, (struct sockaddr *)&address, sizeof(address));
-    if (ret < 0)
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(fd, 5) < 0)
     {
-        perror("bind error\n");
+        close(fd);
         return -1;
     }
+    return fd;
+}
+
+void stats_handler(int sig)
+{
+    dump_stats = 1;
+}
+
+void trace_handler(int sig)
+{
+    dump_trace = 1;
+}
+
+void stop_handler(int sig)
+{
+    stop_master = 1;
+}
+
+// fork出第index个子进程，子进程中返回0
+static pid_t spawn_worker(worker_slot *slots, int index)
+{
+    worker_stats::reset(slots[index]);
+    fflush(stdout); // 否则缓冲区中还没输出的内容会在子进程中再输出一次
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        // 主进程退出时子进程随之退出；子进程不处理主进程的停止信号
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGINT, SIG_DFL);
+        return 0;
+    }
+    if (pid > 0)
+    {
+        worker_stats::started(slots[index], pid);
+    }
+    return pid;
+}
 
-    // 监听
-    ret = listen(listenfd, 5);
-    if (ret < 0)
+// 为当前没有子进程的槽位fork子进程。在子进程中返回槽位编号；在主进程中返回-1，failed表示仍有槽位没能fork出来
+static int spawn_missing(worker_slot *slots, int workers, bool &failed)
+{
+    failed = false;
+    for (int i = 0; i < workers; ++i)
     {
-        perror("listen error\n");
+        if (__atomic_load_n(&slots[i].pid, __ATOMIC_ACQUIRE))
+        {
+            continue;
+        }
+        pid_t pid = spawn_worker(slots, i);
+        if (pid == 0)
+        {
+            return i;
+        }
+        if (pid < 0)
+        {
+            perror("fork");
+            failed = true;
+        }
+    }
+    return -1;
+}
+
+// fork失败（比如暂时的EAGAIN）后重试的间隔，逐次加倍直到上限，成功后清零
+static const int FORK_RETRY_MIN_MS = 100;
+static const int FORK_RETRY_MAX_MS = 10000;
+
+// prefork主进程：监听socket已经建好，fork出workers个子进程，各自运行reactor和线程池，
+// 子进程退出（崩溃）时重建，fork失败的槽位按退避间隔重试，一个子进程出问题不会影响其他子进程上的连接。
+// 只在子进程中返回，返回值为子进程的编号；主进程收到SIGTERM/SIGINT时结束所有子进程后退出
+static int run_master(int workers, worker_slot *slots, const std::vector<const char *> &unix_paths)
+{
+    addsig(SIGTERM, stop_handler);
+    addsig(SIGINT, stop_handler);
+    bool failed;
+    int index = spawn_missing(slots, workers, failed);
+    if (index >= 0)
+    {
+        return index;
+    }
+    int retry_ms = failed ? FORK_RETRY_MIN_MS : 0;
+    printf("master %d: %d workers started\n", getpid(), workers);
+    while (!stop_master)
+    {
+        if (dump_stats)
+        {
+            dump_stats = 0;
+            worker_stats::print(slots, workers);
+        }
+        if (dump_trace)
+        {
+            // 各子进程导出到自己的文件
+            dump_trace = 0;
+            for (int i = 0; i < workers; ++i)
+            {
+                if (slots[i].pid)
+                {
+                    kill(slots[i].pid, SIGUSR2);
+                }
+            }
+        }
+        int status;
+        pid_t pid;
+        if (retry_ms > 0)
+        {
+            // 有槽位没能fork出来：等一段时间后重试，期间退出的子进程照常回收
+            usleep(retry_ms * 1000);
+            index = spawn_missing(slots, workers, failed);
+            if (index >= 0)
+            {
+                return index;
+            }
+            retry_ms = !failed ? 0 : retry_ms * 2 < FORK_RETRY_MAX_MS ? retry_ms * 2 : FORK_RETRY_MAX_MS;
+            pid = waitpid(-1, &status, WNOHANG);
+        }
+        else
+        {
+            pid = waitpid(-1, &status, 0);
+        }
+        if (pid == 0)
+        {
+            continue;
+        }
+        if (pid < 0)
+        {
+            // addsig没有设置SA_RESTART，信号会打断waitpid
+            if (errno != EINTR && errno != ECHILD)
+            {
+                perror("waitpid");
+                break;
+            }
+            if (errno == ECHILD && retry_ms == 0)
+            {
+                pause(); // 没有子进程也不需要重试，等信号
+            }
+            continue;
+        }
+        index = -1;
+        for (int i = 0; i < workers; ++i)
+        {
+            if (slots[i].pid == pid)
+            {
+                index = i;
+            }
+        }
+        if (index < 0)
+        {
+            continue;
+        }
+        if (WIFSIGNALED(status))
+        {
+            printf("worker %d (pid %d) killed by signal %d\n", index, pid, WTERMSIG(status));
+        }
+        else
+        {
+            printf("worker %d (pid %d) exited with status %d\n", index, pid, WEXITSTATUS(status));
+        }
+        long long lived = worker_stats::now_ms() - slots[index].started_ms;
+        __atomic_store_n(&slots[index].pid, 0, __ATOMIC_RELEASE);
+        if (stop_master)
+        {
+            break;
+        }
+        // 启动后不到1秒就退出的（比如启动阶段就崩溃），推迟1秒再重建，避免不停地fork
+        if (lived < 1000)
+        {
+            sleep(1);
+        }
+        ++slots[index].restarts;
+        index = spawn_missing(slots, workers, failed);
+        if (index >= 0)
+        {
+            return index;
+        }
+        if (failed && retry_ms == 0)
+        {
+            retry_ms = FORK_RETRY_MIN_MS;
+        }
+    }
+
+    for (int i = 0; i < workers; ++i)
+    {
+        if (slots[i].pid)
+        {
+            kill(slots[i].pid, SIGTERM);
+        }
+    }
+    while (waitpid(-1, NULL, 0) > 0 || errno == EINTR)
+    {
+    }
+    for (size_t i = 0; i < unix_paths.size(); ++i)
+    {
+        if (unix_paths[i][0] != '@')
+        {
+            unlink(unix_paths[i]);
+        }
+    }
+    worker_stats::destroy(slots, workers);
+    printf("master %d: stopped\n", getpid());
+    exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+    // 可选参数：
+    //  -r cpu       主线程（reactor）绑定的CPU
+    //  -w cpulist   工作线程绑定的CPU列表，如 0-3,8-11；指定后连接按SO_INCOMING_CPU所在的NUMA节点分配和处理
+    //  -t num       线程池最少的线程数，默认8
+    //  -T num       线程池最多的线程数，排队延迟升高时扩容到该值，默认与-t相同（不伸缩）
+    //  -i ms        线程空闲多久后回收，默认60000
+    //  -S us        工作线程等待任务时最多忙等多少微秒再睡眠，默认20，0表示不忙等（负载低时线程自动直接睡眠）。工作线程与reactor绑在同一CPU上时不忙等
+    //  -c           协程模式：每个连接一个协程，在主线程中顺序完成读、解析、写（需要C++20编译）
+    //  -p           启动时把网站根目录（或编译时嵌入的资源包）整体加载到内存，之后不再访问文件系统
+    //  -H           预加载区使用大页
+    //  -M           预加载区mlock，避免被换出
+    //  -u dir       接受PUT/POST上传，请求体经splice直接保存为 dir + URL
+    //  -x spec      反向代理路由，格式为 /prefix=ip:port[,ip:port...]，可以指定多次
+    //  -C file -K file  TLS证书链和私钥（PEM），指定后只接受HTTPS（需要定义USE_TLS编译）
+    //  -s num       每num个请求采样一个，记录各阶段的时间，收到SIGUSR2时导出为Chrome trace JSON
+    //  -o file      采样追踪的导出文件，默认trace.json
+    //  -l ip_rate[:net_rate]  每个来源IP（以及每个/24网段）每秒最多的请求数，超出的回复429
+    //  -U path      同时在Unix域套接字上监听（@name为抽象命名空间），可以指定多次。本机的连接不限流、不走TLS
+    //  -W file      录制每个连接收到的请求数据和时间，用test_presure/replay.cpp回放（prefork时各子进程写 file.编号）
+    //  -Z bytes     不小于该大小的预加载资源（-p）用MSG_ZEROCOPY发送，完成通知由reactor处理。不能与-c同时使用
+    //  -q bytes[:n] 响应体不小于bytes的请求（大文件）解析完后改排低优先级队列，保留n个线程（默认1）只处理高优先级任务，
+    //               n需小于-t。SIGUSR1和/stats按类别报告排队延迟。不能与-c同时使用
+    //  -A file[:MB] 二进制访问日志，文件预分配MB兆字节（默认64），写满后轮转为 file.1，用tools/decode_access_log.cpp解码
+    //  -P num       prefork模式：主进程监听后fork出num个子进程，每个子进程有自己的reactor和线程池（-t/-T/-w对每个子进程生效），
+    //               子进程退出时由主进程重建。-r指定时第i个子进程的reactor绑定到cpu+i。
+    //               主进程收到SIGUSR1时汇总打印各子进程的计数器，SIGUSR2转发给子进程，各自导出到 trace_file.编号
+    //  -R           与-P一起使用：每个子进程一个SO_REUSEPORT监听socket，用挂在组上的BPF程序按处理SYN的CPU选择socket，
+    //               第i个子进程的reactor（没有-w时连同工作线程，此时-S的忙等不生效）绑定到cpu+i（cpu为-r的值，默认0），
+    //               RSS/RPS把连接的数据包交给哪个CPU，就由绑在那个CPU上的子进程处理。统计中的cpu-local为命中的连接数
+    int reactor_cpu = -1;
+    std::vector<int> worker_cpus;
+    int min_threads = 8;
+    int max_threads = 0;
+    int idle_timeout_ms = 60000;
+    int spin_us = 20;
+    int reserved_threads = 0;
+#ifdef HAVE_COROUTINE
+    bool use_coroutine = false;
+#endif
+    bool preload = false;
+    bool cpu_steering = false;
+    bool hugepage = false;
+    bool lock_assets = false;
+    const char *cert_file = NULL;
+    const char *key_file = NULL;
+    const char *trace_file = "trace.json";
+    std::vector<const char *> unix_paths;
+    int workers = 0;
+    const char *capture_file = NULL;
+    static char access_file[256] = "";
+    size_t access_size = 64 << 20;
+    int opt;
+    while ((opt = getopt(argc, argv, "r:w:t:T:i:S:cpHMu:x:C:K:s:o:l:U:P:RW:A:Z:q:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'u':
+            file_upload_handler::upload_dir = optarg;
+            http_conn::m_body_factory = file_upload_handler::create;
+            break;
+        case 'x':
+            if (!upstream_conn::add_route(optarg))
+            {
+                printf("无效的代理路由：%s\n", optarg);
+                exit(-1);
+            }
+            break;
+        case 'C':
+            cert_file = optarg;
+            break;
+        case 'K':
+            key_file = optarg;
+            break;
+        case 's':
+            tracer::configure(atoi(optarg));
+            break;
+        case 'o':
+            trace_file = optarg;
+            break;
+        case 'U':
+            unix_paths.push_back(optarg);
+            break;
+        case 'W':
+            capture_file = optarg;
+            break;
+        case 'Z':
+            if (atoi(optarg) <= 0)
+            {
+                printf("无效的零拷贝阈值：%s\n", optarg);
+                exit(-1);
+            }
+            zerocopy::configure(atoi(optarg));
+            break;
+        case 'q':
+        {
+            const char *colon = strchr(optarg, ':');
+            reserved_threads = colon ? atoi(colon + 1) : 1;
+            if (atoll(optarg) <= 0 || reserved_threads < 0)
+            {
+                printf("无效的优先级参数：%s\n", optarg);
+                exit(-1);
+            }
+            http_conn::m_low_bytes = atoll(optarg);
+            break;
+        }
+        case 'A':
+        {
+            const char *colon = strrchr(optarg, ':');
+            size_t len = colon ? colon - optarg : strlen(optarg);
+            if (len == 0 || len >= sizeof(access_file) - 16 || (colon && atoi(colon + 1) <= 0))
+            {
+                printf("无效的访问日志参数：%s\n", optarg);
+                exit(-1);
+            }
+            memcpy(access_file, optarg, len);
+            access_file[len] = '\0';
+            if (colon)
+            {
+                access_size = (size_t)atoi(colon + 1) << 20;
+            }
+            break;
+        }
+        case 'P':
+            workers = atoi(optarg);
+            if (workers <= 0)
+            {
+                printf("无效的进程数：%s\n", optarg);
+                exit(-1);
+            }
+            break;
+        case 'R':
+            cpu_steering = true;
+            break;
+        case 'l':
+        {
+            int ip_rate = atoi(optarg);
+            const char *colon = strchr(optarg, ':');
+            int net_rate = colon ? atoi(colon + 1) : 0;
+            if (ip_rate <= 0 && net_rate <= 0)
+            {
+                printf("无效的限流参数：%s\n", optarg);
+                exit(-1);
+            }
+            if (!rate_limiter::configure(ip_rate, net_rate))
+            {
+                exit(-1);
+            }
+            break;
+        }
+        case 'p':
+            preload = true;
+            break;
+        case 'H':
+            hugepage = true;
+            break;
+        case 'M':
+            lock_assets = true;
+            break;
+        case 'c':
+#ifdef HAVE_COROUTINE
+            use_coroutine = true;
+            http_conn::m_h2c = false; // 协程模式只支持HTTP/1.1
+#else
+            printf("协程模式需要使用C++20编译\n");
+            exit(-1);
+#endif
+            break;
+        case 't':
+            min_threads = atoi(optarg);
+            break;
+        case 'T':
+            max_threads = atoi(optarg);
+            break;
+        case 'i':
+            idle_timeout_ms = atoi(optarg);
+            break;
+        case 'S':
+            spin_us = atoi(optarg);
+            break;
+        case 'r':
+            reactor_cpu = atoi(optarg);
+            break;
+        case 'w':
+            if (!parse_cpu_list(optarg, worker_cpus))
+            {
+                printf("无效的CPU列表：%s\n", optarg);
+                exit(-1);
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    if (optind >= argc)
+    {
+        printf("按照此格式：%s [-r cpu] [-w cpulist] [-t min_threads] [-T max_threads] [-i idle_ms] [-S spin_us] [-c] [-p [-H] [-M]] [-u upload_dir] [-x /prefix=ip:port] [-C cert -K key] [-s sample_every [-o trace_file]] [-l ip_rate[:net_rate]] [-U unix_path] [-W capture_file] [-A access_log[:MB]] [-Z zerocopy_bytes] [-q low_bytes[:reserved]] [-P workers [-R]] port_number\n", basename(argv[0]));
+        exit(-1);
+    }
+
+#ifdef HAVE_COROUTINE
+    if (use_coroutine && zerocopy::threshold())
+    {
+        // 协程模式下EPOLLERR直接交给协程，没有处理完成通知的地方
+        printf("-Z不能与-c同时使用\n");
+        exit(-1);
+    }
+    if (use_coroutine && http_conn::m_low_bytes)
+    {
+        // 协程模式不经过线程池
+        printf("-q不能与-c同时使用\n");
+        exit(-1);
+    }
+#endif
+    if (reserved_threads >= min_threads)
+    {
+        printf("保留的线程数必须小于最少线程数（-t %d）\n", min_threads);
+        exit(-1);
+    }
+    if (cpu_steering && workers <= 0)
+    {
+        printf("-R需要与-P同时使用\n");
+        exit(-1);
+    }
+
+    // get port
+    int port = atoi(argv[optind]);
+
+    // 预加载静态资源
+    asset_arena *assets = NULL;
+    if (preload)
+    {
+        assets = new asset_arena;
+        const char *bundle = NULL;
+        size_t bundle_size = 0;
+        bool loaded = embedded_bundle(&bundle, &bundle_size) ? assets->load_bundle(bundle, bundle_size, hugepage, lock_assets)
+                                                             : assets->load_dir(doc_root, hugepage, lock_assets);
+        if (!loaded)
+        {
+            printf("preload assets failed\n");
+            exit(-1);
+        }
+        printf("preloaded %d assets\n", assets->size());
+        http_conn::m_assets = assets;
+    }
+
+    if (cert_file || key_file)
+    {
+#ifdef USE_TLS
+        if (!cert_file || !key_file)
+        {
+            printf("TLS需要同时指定证书和私钥\n");
+            exit(-1);
+        }
+        try
+        {
+            http_conn::m_tls = new tls_context(cert_file, key_file);
+        }
+        catch (...)
+        {
+            printf("load certificate failed\n");
+            exit(-1);
+        }
+#else
+        printf("TLS需要定义USE_TLS编译\n");
+        exit(-1);
+#endif
+    }
+
+    // 对SIGPIE信号进行处理
+    addsig(SIGPIPE, SIG_IGN);
+    // 收到SIGUSR1时打印线程池的统计信息
+    addsig(SIGUSR1, stats_handler);
+    // 收到SIGUSR2时导出采样追踪
+    addsig(SIGUSR2, trace_handler);
+
+    // 路由表在启动阶段建好，之后只读
+    router routes;
+    routes.add_static(builtin_routes);
+    http_conn::m_router = &routes;
+
+    // 保存所有客户端的信息，下标为fd。连接对象从按NUMA节点划分的对象池中分配，
+    // 绑核后对象（包括其读写缓冲区）位于接收该连接数据包的CPU所在节点的本地内存上
+    http_conn **users = new http_conn *[MAX_FD]();
+    node_pool<http_conn> conn_pool;
+    bool numa_steering = !worker_cpus.empty();
+    std::vector<int> cpu_nodes;
+    build_cpu_node_map(cpu_nodes);
+
+    // 用于监听的套接字。-R时按子进程编号的顺序建立一组SO_REUSEPORT socket，BPF程序返回的下标即子进程编号；
+    // 主进程一直持有整组socket，子进程重建时组内顺序不变
+    std::vector<int> steer_fds;
+    int steer_base = reactor_cpu >= 0 ? reactor_cpu : 0;
+    for (int i = 0; i < (cpu_steering ? workers : 1); ++i)
+    {
+        int fd = open_tcp_listener(port, cpu_steering);
+        if (fd < 0)
+        {
+            perror("bind error\n");
+            return -1;
+        }
+        if (cpu_steering)
+        {
+            // 数据包在第i个CPU上处理的连接，accept之后的处理也尽量留在这个CPU上
+            int cpu = steer_base + i;
+            setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu));
+        }
+        steer_fds.push_back(fd);
+    }
+    int listenfd = steer_fds[0];
+    if (cpu_steering)
+    {
+        if (!attach_cpu_steering(listenfd, steer_base, workers))
+        {
+            perror("attach reuseport cbpf");
+            return -1;
+        }
+        reactor_cpu = steer_base;
+    }
+
+    // Unix域套接字监听
+    std::vector<int> unix_fds;
+    for (size_t i = 0; i < unix_paths.size(); ++i)
+    {
+        int fd = open_unix_listener(unix_paths[i]);
+        if (fd < 0)
+        {
+            printf("listen on unix socket %s failed: %s\n", unix_paths[i], strerror(errno));
+            return -1;
+        }
+        unix_fds.push_back(fd);
+    }
+
+    // prefork：以下（线程池、epoll、reactor）在每个子进程中各有一份，线程不能跨越fork，所以在fork之后创建
+    worker_slot single_slot;
+    memset(&single_slot, 0, sizeof(single_slot));
+    worker_slot *slot = &single_slot; // 单进程模式下计数器写到这里，不需要判断
+    if (workers > 0)
+    {
+        worker_slot *slots = worker_stats::create(workers);
+        if (!slots)
+        {
+            perror("mmap worker stats");
+            return -1;
+        }
+        worker_index = run_master(workers, slots, unix_paths);
+        slot = &slots[worker_index];
+        if (reactor_cpu >= 0)
+        {
+            reactor_cpu += worker_index;
+        }
+        if (cpu_steering)
+        {
+            // 只保留自己的那个socket，其他子进程的socket由各自的子进程accept
+            listenfd = steer_fds[worker_index];
+            for (int i = 0; i < workers; ++i)
+            {
+                if (i != worker_index)
+                {
+                    close(steer_fds[i]);
+                }
+            }
+            if (worker_cpus.empty())
+            {
+                worker_cpus.push_back(reactor_cpu);
+            }
+        }
+        // 各子进程的采样追踪导出到不同的文件
+        static char worker_trace_file[256];
+        snprintf(worker_trace_file, sizeof(worker_trace_file), "%s.%d", trace_file, worker_index);
+        trace_file = worker_trace_file;
+        if (capture_file)
+        {
+            static char worker_capture_file[256];
+            snprintf(worker_capture_file, sizeof(worker_capture_file), "%s.%d", capture_file, worker_index);
+            capture_file = worker_capture_file;
+        }
+        if (access_file[0])
+        {
+            snprintf(access_file + strlen(access_file), 16, ".%d", worker_index);
+        }
+    }
+    if (capture_file && !traffic_capture::open(capture_file))
+    {
+        printf("open capture file %s failed: %s\n", capture_file, strerror(errno));
         return -1;
     }
+    if (access_file[0] && !access_log::open(access_file, access_size))
+    {
+        printf("open access log %s failed: %s\n", access_file, strerror(errno));
+        return -1;
+    }
+
+    if (reactor_cpu >= 0 && !bind_thread_cpu(pthread_self(), reactor_cpu))
+    {
+        printf("bind reactor to cpu %d failed.\n", reactor_cpu);
+    }
+    // 工作线程和reactor绑在同一个CPU上时，忙等只会和reactor抢这个CPU，推迟它处理下一批事件，此时关掉忙等
+    if (reactor_cpu >= 0 && spin_us > 0 &&
+        std::find(worker_cpus.begin(), worker_cpus.end(), reactor_cpu) != worker_cpus.end())
+    {
+        printf("worker threads share cpu %d with the reactor, spinning disabled.\n", reactor_cpu);
+        spin_us = 0;
+    }
+
+    // 创建和初始化线程池
+    threadpool<http_conn> *pool = NULL;
+    try
+    {
+        pool = new threadpool<http_conn>(min_threads, 10000, worker_cpus, max_threads, idle_timeout_ms, 1000, spin_us,
+                                           reserved_threads);
+    }
+    catch (...)
+    {
+        exit(-1);
+    }
+    stats_pool = pool;
 
     // 创建epoll对象，事件数组，添加
     epoll_event events[MAX_EVENT_NUM];
@@ -104,30 +835,119 @@ int main(int argc, char *argv[])
         return -1;
     }
 
-    // 将监听的文件描述符添加到epoll中
-    addfd(epollfd, listenfd, false);
+    // 将监听的文件描述符添加到epoll中。prefork时所有子进程的epoll都监听同一组socket，
+    // 用EPOLLEXCLUSIVE让一个新连接只唤醒一个子进程
+    std::vector<int> listen_fds(1, listenfd);
+    listen_fds.insert(listen_fds.end(), unix_fds.begin(), unix_fds.end());
+    for (size_t i = 0; i < listen_fds.size(); ++i)
+    {
+        if (workers > 0)
+        {
+            epoll_event event;
+            event.data.u64 = listen_fds[i];
+            event.events = EPOLLIN | EPOLLEXCLUSIVE;
+            epoll_ctl(epollfd, EPOLL_CTL_ADD, listen_fds[i], &event);
+            setnonblocking(listen_fds[i]);
+        }
+        else
+        {
+            addfd(epollfd, listen_fds[i], false, listen_fds[i]);
+        }
+    }
     http_conn::m_epollfd = epollfd;
+    long long stale_events = 0; // 句柄不匹配而被丢弃的事件数
+    // 一次epoll_wait中读完数据的连接，循环结束后一起交给线程池
+    conn_batch batch;
+    batch.reserve(MAX_EVENT_NUM);
 
+    // 录制时最多等1秒，空闲时把缓冲区里的记录写入文件
+    int wait_ms = traffic_capture::enabled() ? traffic_capture::FLUSH_US / 1000 : -1;
     while (1)
     {
-        int num = epoll_wait(epollfd, events, MAX_EVENT_NUM, -1);
+        int num = epoll_wait(epollfd, events, MAX_EVENT_NUM, wait_ms);
         if (num < 0 && errno != EINTR)
         {
             perror("epoll error\n");
             break;
         }
+        if (num == 0 && wait_ms > 0)
+        {
+            traffic_capture::flush();
+        }
+        if (dump_stats)
+        {
+            dump_stats = 0;
+            threadpool_stats stats;
+            pool->get_stats(stats);
+            printf("threadpool: live %d, busy %d, peak %d, queue %d, avg wait %lldus, grow %lld, shrink %lld, stale %lld\n",
+                   stats.live_threads, stats.busy_threads, stats.peak_threads, stats.queue_size,
+                   stats.avg_wait_us, stats.grow_count, stats.shrink_count, stats.stale_count);
+            printf("wait: spin %lld, yield %lld, park %lld, expected gap %lldus\n", stats.spin_wakeups,
+                   stats.yield_wakeups, stats.park_wakeups, stats.expected_gap_us);
+            printf("classes: high queue %d, tasks %lld, avg wait %lldus; low queue %d, tasks %lld, avg wait %lldus; reserved %d\n",
+                   stats.class_queue[TASK_HIGH], stats.class_tasks[TASK_HIGH], stats.class_wait_us[TASK_HIGH],
+                   stats.class_queue[TASK_LOW], stats.class_tasks[TASK_LOW], stats.class_wait_us[TASK_LOW],
+                   stats.reserved_threads);
+            printf("reactor: stale events %lld, rate limited %lld, cpu-local accepts %lld of %lld\n", stale_events,
+                   rate_limiter::rejected(), slot->local, slot->accepted);
+            printf("buffers: in use %d, allocated %d\n", buffer_pool::in_use(), buffer_pool::allocated());
+            zerocopy::print();
+            if (access_log::enabled())
+            {
+                printf("access log: rotations %lld, dropped %lld\n", access_log::rotations(), access_log::dropped());
+            }
+        }
+        if (dump_trace)
+        {
+            dump_trace = 0;
+            if (!tracer::dump(trace_file))
+            {
+                perror("trace dump");
+            }
+        }
         // 循环遍历
         for (int i = 0; i < num; i++)
         {
             int sockfd = events[i].data.fd;
-            if (sockfd == listenfd) // 有客户端链接
+            if (events[i].data.u64 & UPSTREAM_TAG) // 反向代理的上游连接
+            {
+                if (!upstream_conn::on_event(events[i].data.u64, events[i].events))
+                {
+                    ++stale_events;
+                }
+            }
+            else if (sockfd == listenfd || std::find(unix_fds.begin(), unix_fds.end(), sockfd) != unix_fds.end()) // 有客户端链接
             {
                 struct sockaddr_in client_address;
                 socklen_t client_addrlen = sizeof(client_address);
-                int connfd = accept(listenfd, (struct sockaddr *)&client_address, &client_addrlen);
+                int connfd = accept(sockfd, sockfd == listenfd ? (struct sockaddr *)&client_address : NULL,
+                                    sockfd == listenfd ? &client_addrlen : NULL);
                 if (connfd < 0)
                 {
-                    perror("accept error\n");
+                    if (errno != EAGAIN) // prefork时可能被别的子进程先accept了
+                    {
+                        perror("accept error\n");
+                    }
+                    continue;
+                }
+                bool local = sockfd != listenfd;
+                if (local)
+                {
+                    // Unix域套接字的对端是本机进程，地址记为回环地址（X-Forwarded-For中为127.0.0.1）
+                    memset(&client_address, 0, sizeof(client_address));
+                    client_address.sin_family = AF_INET;
+                    client_address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+                }
+                else if (!rate_limiter::admit(client_address.sin_addr.s_addr))
+                {
+                    // 超过限流的客户端不分配连接对象，明文连接直接回复预先生成的429
+#ifdef USE_TLS
+                    if (!http_conn::m_tls)
+#endif
+                    {
+                        send(connfd, error_429_response, error_429_response_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+                    }
+                    close(connfd);
                     continue;
                 }
                 if (http_conn::m_user_count >= MAX_FD)
@@ -136,38 +956,80 @@ int main(int argc, char *argv[])
                     close(connfd);
                     continue;
                 }
-                // 将新的客户数据初始化，放到数组中
-                user[connfd].init(connfd, client_address);
-            }
-            else if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
-            {
-                // 客户端断开连接或异常错误
-                user[sockfd].close_conn();
-            }
-            else if (events[i].events & EPOLLIN)
-            {
-                if (user[sockfd].read()) // 一次性读所有数据
+                int node = -1;
+                int cpu = (numa_steering || (reactor_cpu >= 0 && !local)) ? get_incoming_cpu(connfd) : -1;
+                if (numa_steering && cpu >= 0 && cpu < (int)cpu_nodes.size())
                 {
-                    pool->append(user + sockfd);
+                    node = cpu_nodes[cpu];
                 }
-                else
+                if (cpu >= 0 && cpu == reactor_cpu && !local)
                 {
-                    user[sockfd].close_conn();
+                    worker_stats::add(slot->local);
                 }
-            }
-            else if (events[i].events & EPOLLOUT)
-            {
-                if (!user[sockfd].write()) // 一次性写完所有数据
+                // 该fd上次使用的连接对象不在同一节点上，则换一个本地节点的对象
+                if (users[connfd] && users[connfd]->get_node() != node)
+                {
+                    conn_pool.release(users[connfd], users[connfd]->get_node());
+                    users[connfd] = NULL;
+                }
+                if (!users[connfd])
+                {
+                    users[connfd] = conn_pool.alloc(node);
+                    if (!users[connfd])
+                    {
+                        close(connfd);
+                        continue;
+                    }
+                }
+                // 将新的客户数据初始化，放到数组中
+                users[connfd]->init(connfd, client_address, node, local);
+                worker_stats::add(slot->accepted);
+#ifdef HAVE_COROUTINE
+                if (use_coroutine)
                 {
-                    user[sockfd].close_conn();
+                    users[connfd]->serve(); // 协程运行到第一次等待读事件时返回
                 }
+#endif
             }
+#ifdef HAVE_COROUTINE
+            else if (use_coroutine && users[sockfd] && users[sockfd]->valid(events[i].data.u64))
+            {
+                // 所有事件（包括断开和错误）都交给挂起的协程处理，由协程负责关闭连接
+                users[sockfd]->resume(events[i].events);
+            }
+#endif
+            else if (!dispatch_conn_event(users[sockfd], events[i], batch))
+            {
+                // 过期事件：同一批事件中前面的事件已经关闭了该连接，fd可能已经被新连接复用
+                ++stale_events;
+            }
+        }
+        if (!batch.empty())
+        {
+            worker_stats::add(slot->dispatched, submit_batch(pool, batch));
         }
+        worker_stats::set(slot->active, http_conn::m_user_count);
+        worker_stats::set(slot->stale, stale_events);
+        worker_stats::set(slot->rate_limited, rate_limiter::rejected());
     }
 
+    traffic_capture::flush();
     close(epollfd);
     close(listenfd);
-    delete[] user;
+    for (size_t i = 0; i < unix_fds.size(); ++i)
+    {
+        close(unix_fds[i]);
+        if (unix_paths[i][0] != '@' && worker_index < 0) // prefork时由主进程删除
+        {
+            unlink(unix_paths[i]);
+        }
+    }
+    delete[] users;
     delete pool;
+    access_log::close();
+    delete assets;
+#ifdef USE_TLS
+    delete http_conn::m_tls;
+#endif
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,573 @@
+#include "proxy.h"
+#include "http_conn.h"
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netinet/tcp.h>
+
+extern void setnonblocking(int fd);
+
+std::vector<proxy_route *> upstream_conn::m_routes;
+upstream_conn *upstream_conn::m_conns[upstream_conn::MAX_FD];
+uint32_t upstream_conn::m_generation = 0;
+
+bool upstream_conn::add_route(const char *spec)
+{
+    const char *eq = strchr(spec, '=');
+    if (!eq || spec[0] != '/' || eq == spec)
+    {
+        return false;
+    }
+    proxy_route *route = new proxy_route;
+    route->prefix.assign(spec, eq - spec);
+    route->next = 0;
+    const char *p = eq + 1;
+    while (*p)
+    {
+        const char *end = strchr(p, ',');
+        if (!end)
+        {
+            end = p + strlen(p);
+        }
+        char addr[64];
+        int len = end - p;
+        const char *colon = (const char *)memchr(p, ':', len);
+        if (!colon || len >= (int)sizeof(addr))
+        {
+            delete route;
+            return false;
+        }
+        memcpy(addr, p, colon - p);
+        addr[colon - p] = '\0';
+        upstream_server *server = new upstream_server;
+        memset(&server->addr, 0, sizeof(server->addr));
+        server->addr.sin_family = AF_INET;
+        server->addr.sin_port = htons(atoi(colon + 1));
+        if (inet_pton(AF_INET, addr, &server->addr.sin_addr) != 1)
+        {
+            delete server;
+            delete route;
+            return false;
+        }
+        route->servers.push_back(server);
+        p = *end ? end + 1 : end;
+    }
+    if (route->servers.empty())
+    {
+        delete route;
+        return false;
+    }
+    m_routes.push_back(route);
+    return true;
+}
+
+const proxy_route *upstream_conn::match(std::string_view url)
+{
+    // 前缀必须在路径段的边界上结束：/api 匹配 /api、/api/x、/api?x，不匹配 /apix
+    for (size_t i = 0; i < m_routes.size(); ++i)
+    {
+        const std::string &prefix = m_routes[i]->prefix;
+        if (url.size() < prefix.size() || url.compare(0, prefix.size(), prefix) != 0)
+        {
+            continue;
+        }
+        if (url.size() == prefix.size() || prefix.back() == '/' || url[prefix.size()] == '/' || url[prefix.size()] == '?')
+        {
+            return m_routes[i];
+        }
+    }
+    return NULL;
+}
+
+upstream_conn *upstream_conn::acquire(const proxy_route *route, http_conn *owner)
+{
+    proxy_route *r = const_cast<proxy_route *>(route);
+    upstream_server *server = r->servers[__sync_fetch_and_add(&r->next, 1) % r->servers.size()];
+
+    upstream_conn *conn = NULL;
+    server->lock.lock();
+    while (!server->idle.empty())
+    {
+        conn = server->idle.back();
+        server->idle.pop_back();
+        // 空闲期间上游可能已经关闭连接（读到0）或发来了不该有的数据，这样的连接不能复用
+        char c;
+        if (recv(conn->m_fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && errno == EAGAIN)
+        {
+            break;
+        }
+        conn->release(false);
+        conn = NULL;
+    }
+    server->lock.unlock();
+
+    if (conn)
+    {
+        conn->m_reused = true;
+        conn->m_state = SENDING;
+        conn->renew();
+    }
+    else
+    {
+        conn = new upstream_conn(server);
+        if (!conn->connect_upstream())
+        {
+            delete conn;
+            return NULL;
+        }
+    }
+    conn->m_owner = owner;
+    return conn;
+}
+
+upstream_conn::upstream_conn(upstream_server *server)
+    : m_server(server), m_owner(NULL), m_fd(-1), m_gen(0), m_registered(false), m_reused(false), m_state(CONNECTING)
+{
+    m_pipe[0] = m_pipe[1] = -1;
+}
+
+upstream_conn::~upstream_conn()
+{
+    if (m_fd >= 0)
+    {
+        if (m_registered)
+        {
+            epoll_ctl(http_conn::m_epollfd, EPOLL_CTL_DEL, m_fd, 0);
+        }
+        m_conns[m_fd] = NULL;
+        close(m_fd);
+    }
+    for (int i = 0; i < 2; ++i)
+    {
+        if (m_pipe[i] >= 0)
+        {
+            close(m_pipe[i]);
+        }
+    }
+}
+
+// 新建到上游的非阻塞连接，connect的结果在EPOLLOUT时检查
+bool upstream_conn::connect_upstream()
+{
+    if (m_fd >= 0)
+    {
+        if (m_registered)
+        {
+            epoll_ctl(http_conn::m_epollfd, EPOLL_CTL_DEL, m_fd, 0);
+        }
+        m_conns[m_fd] = NULL;
+        close(m_fd);
+    }
+    m_registered = false;
+    m_reused = false;
+    m_state = CONNECTING;
+    m_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (m_fd < 0 || m_fd >= MAX_FD)
+    {
+        if (m_fd >= 0)
+        {
+            close(m_fd);
+            m_fd = -1;
+        }
+        return false;
+    }
+    int nodelay = 1;
+    setsockopt(m_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    if (connect(m_fd, (struct sockaddr *)&m_server->addr, sizeof(m_server->addr)) < 0 && errno != EINPROGRESS)
+    {
+        perror("upstream connect");
+        return false;
+    }
+    if (m_pipe[0] < 0 && pipe2(m_pipe, O_CLOEXEC | O_NONBLOCK) < 0)
+    {
+        return false;
+    }
+    renew();
+    m_conns[m_fd] = this;
+    return true;
+}
+
+// 换一个新的代数：fd被关闭后可能立刻被新的上游连接复用，空闲连接也会被别的请求取走，
+// 同一批中之前那次使用的事件都要被丢弃
+void upstream_conn::renew()
+{
+    uint32_t generation = __atomic_add_fetch(&m_generation, 1, __ATOMIC_RELAXED) % 0x7fffffff + 1;
+    __atomic_store_n(&m_gen, generation, __ATOMIC_RELEASE);
+}
+
+uint64_t upstream_conn::tag() const
+{
+    return UPSTREAM_TAG | (uint64_t)__atomic_load_n(&m_gen, __ATOMIC_ACQUIRE) << 32 | (uint32_t)m_fd;
+}
+
+void upstream_conn::arm(int ev)
+{
+    epoll_event event;
+    event.data.u64 = tag();
+    event.events = ev | EPOLLONESHOT | EPOLLRDHUP;
+    int op = m_registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    // start()在工作线程中第一次注册，事件可能在epoll_ctl返回前就被reactor处理，
+    // 所以要先置位，否则reactor重新注册时会再次ADD（EEXIST）而丢掉事件
+    m_registered = true;
+    epoll_ctl(http_conn::m_epollfd, op, m_fd, &event);
+}
+
+void upstream_conn::start(int request_len, bool client_keep_alive)
+{
+    m_request_len = request_len;
+    m_request_sent = 0;
+    m_head_len = 0;
+    m_out_len = m_out_sent = 0;
+    m_pipe_bytes = 0;
+    m_client_keep = client_keep_alive;
+    // 之后由reactor驱动，这里只注册事件。客户端socket由reactor第一次处理上游事件时注册（wait_upstream），
+    // 在这里注册的话，客户端的断开事件可能在本函数返回前就释放了这个对象
+    arm(EPOLLOUT);
+}
+
+// 等待上游socket的同时保持客户端socket上的EPOLLRDHUP，客户端中途断开时由reactor关闭连接并放弃代理，
+// 不必等到上游回复。只在reactor中调用
+void upstream_conn::wait_upstream(int ev)
+{
+    m_owner->rearm(0);
+    arm(ev);
+}
+
+bool upstream_conn::on_event(uint64_t tag, unsigned int events)
+{
+    uint32_t fd = (uint32_t)tag;
+    upstream_conn *conn = fd < MAX_FD ? m_conns[fd] : NULL;
+    // 同一批事件中连接可能已经被客户端的断开事件关闭，fd可能已经被新的上游连接复用
+    if (!conn || !conn->m_owner || conn->tag() != tag)
+    {
+        return false;
+    }
+    conn->step(events);
+    return true;
+}
+
+void upstream_conn::step(unsigned int events)
+{
+    while (true)
+    {
+        switch (m_state)
+        {
+        case CONNECTING:
+        {
+            int err = 0;
+            socklen_t len = sizeof(err);
+            if (getsockopt(m_fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0)
+            {
+                fail();
+                return;
+            }
+            m_state = SENDING;
+            break;
+        }
+        case SENDING:
+        {
+            ssize_t n = send(m_fd, m_request + m_request_sent, m_request_len - m_request_sent, MSG_NOSIGNAL);
+            if (n < 0)
+            {
+                if (errno == EAGAIN)
+                {
+                    wait_upstream(EPOLLOUT);
+                    return;
+                }
+                fail();
+                return;
+            }
+            m_request_sent += n;
+            if (m_request_sent == m_request_len)
+            {
+                m_state = READING_HEAD;
+            }
+            break;
+        }
+        case READING_HEAD:
+        {
+            ssize_t n = recv(m_fd, m_head + m_head_len, HEAD_SIZE - m_head_len, 0);
+            if (n < 0)
+            {
+                if (errno == EAGAIN)
+                {
+                    wait_upstream(EPOLLIN);
+                    return;
+                }
+                fail();
+                return;
+            }
+            if (n == 0)
+            {
+                fail();
+                return;
+            }
+            m_head_len += n;
+            const char *end = (const char *)memmem(m_head, m_head_len, "\r\n\r\n", 4);
+            if (!end)
+            {
+                if (m_head_len == HEAD_SIZE)
+                {
+                    m_reused = false; // 响应头过大，重试也没有用
+                    fail();
+                    return;
+                }
+                break;
+            }
+            if (!parse_head(end + 4 - m_head))
+            {
+                m_reused = false;
+                fail();
+                return;
+            }
+            m_state = SENDING_HEAD;
+            pump();
+            return;
+        }
+        default:
+            pump();
+            return;
+        }
+    }
+}
+
+// 解析上游的响应头，改写成发给客户端的HTTP/1.1响应头：去掉逐跳头部，按客户端连接重新生成Connection
+bool upstream_conn::parse_head(int head_end)
+{
+    m_body_offset = head_end;
+    // 状态行：HTTP/1.x 200 OK
+    const char *line_end = (const char *)memmem(m_head, head_end, "\r\n", 2);
+    if (head_end < 12 || strncmp(m_head, "HTTP/1.", 7) != 0 || m_head[8] != ' ')
+    {
+        return false;
+    }
+    bool http11 = m_head[7] == '1';
+    int status = atoi(m_head + 9);
+    m_owner->proxy_status(status);
+    long long content_length = -1;
+    bool upstream_keep = http11;
+    bool chunked = false;
+
+    m_out_len = snprintf(m_out, sizeof(m_out), "HTTP/1.1%.*s\r\n", (int)(line_end - m_head - 8), m_head + 8);
+    const char *p = line_end + 2;
+    while (p < m_head + head_end - 2)
+    {
+        const char *eol = (const char *)memmem(p, m_head + head_end - p, "\r\n", 2);
+        const char *colon = (const char *)memchr(p, ':', eol - p);
+        if (!colon)
+        {
+            return false;
+        }
+        std::string_view name(p, colon - p);
+        const char *v = colon + 1;
+        while (v < eol && (*v == ' ' || *v == '\t'))
+        {
+            ++v;
+        }
+        std::string_view value(v, eol - v);
+        HEADER_ID id = lookup_header(name);
+        if (id == HDR_CONNECTION || id == HDR_KEEP_ALIVE)
+        {
+            if (id == HDR_CONNECTION)
+            {
+                upstream_keep = header_name_equal(value, "keep-alive") || (http11 && !header_name_equal(value, "close"));
+            }
+        }
+        else
+        {
+            if (id == HDR_CONTENT_LENGTH)
+            {
+                content_length = atoll(v);
+            }
+            else if (id == HDR_TRANSFER_ENCODING)
+            {
+                chunked = true;
+            }
+            int len = eol + 2 - p;
+            if (m_out_len + len > (int)sizeof(m_out) - 32)
+            {
+                return false;
+            }
+            memcpy(m_out + m_out_len, p, len);
+            m_out_len += len;
+        }
+        p = eol + 2;
+    }
+
+    long long leftover = m_head_len - m_body_offset;
+    if (status / 100 == 1 || status == 204 || status == 304)
+    {
+        content_length = 0;
+    }
+    m_close_delimited = content_length < 0 || chunked;
+    if (m_close_delimited)
+    {
+        // 不知道响应体多长，只能读到上游关闭为止，客户端连接也随之关闭
+        m_remaining = 0;
+        m_reusable = false;
+        m_client_keep = false;
+    }
+    else
+    {
+        if (leftover > content_length)
+        {
+            return false; // 上游多发了数据
+        }
+        m_remaining = content_length - leftover;
+        m_reusable = upstream_keep;
+    }
+    m_out_len += snprintf(m_out + m_out_len, sizeof(m_out) - m_out_len, "Connection: %s\r\n\r\n",
+                          m_client_keep ? "keep-alive" : "close");
+    return true;
+}
+
+void upstream_conn::on_client_writable()
+{
+    pump();
+}
+
+// 把响应推给客户端：先是响应头和随之读到的响应体，然后 上游 -> 管道 -> 客户端 splice，
+// 任何一端暂时不可用时注册对应的事件后返回
+void upstream_conn::pump()
+{
+    while (true)
+    {
+        if (m_state == SENDING_HEAD)
+        {
+            struct iovec iv[2];
+            int count = 0;
+            if (m_out_sent < m_out_len)
+            {
+                iv[count].iov_base = m_out + m_out_sent;
+                iv[count].iov_len = m_out_len - m_out_sent;
+                ++count;
+            }
+            int body_sent = m_out_sent > m_out_len ? m_out_sent - m_out_len : 0;
+            if (m_body_offset + body_sent < m_head_len)
+            {
+                iv[count].iov_base = m_head + m_body_offset + body_sent;
+                iv[count].iov_len = m_head_len - m_body_offset - body_sent;
+                ++count;
+            }
+            if (count == 0)
+            {
+                m_state = BODY;
+                continue;
+            }
+            ssize_t n = m_owner->send_iov(iv, count);
+            if (n < 0)
+            {
+                if (errno == EAGAIN)
+                {
+                    m_owner->rearm(EPOLLOUT);
+                    return;
+                }
+                finish(false);
+                return;
+            }
+            m_out_sent += n;
+            continue;
+        }
+
+        if (m_pipe_bytes > 0)
+        {
+            ssize_t n = m_owner->send_from_pipe(m_pipe[0], m_pipe_bytes);
+            if (n < 0)
+            {
+                if (errno == EAGAIN)
+                {
+                    m_owner->rearm(EPOLLOUT);
+                    return;
+                }
+                finish(false);
+                return;
+            }
+            m_pipe_bytes -= n;
+            continue;
+        }
+        if (!m_close_delimited && m_remaining == 0)
+        {
+            finish(true);
+            return;
+        }
+        size_t chunk = 65536;
+        if (!m_close_delimited && m_remaining < (long long)chunk)
+        {
+            chunk = m_remaining;
+        }
+        ssize_t n = splice(m_fd, NULL, m_pipe[1], NULL, chunk, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0)
+        {
+            if (errno == EAGAIN)
+            {
+                wait_upstream(EPOLLIN);
+                return;
+            }
+            finish(false);
+            return;
+        }
+        if (n == 0)
+        {
+            // 上游关闭：以关闭结束的响应正常结束，否则响应被截断
+            finish(m_close_delimited);
+            return;
+        }
+        m_pipe_bytes += n;
+        if (!m_close_delimited)
+        {
+            m_remaining -= n;
+        }
+    }
+}
+
+// 还没有向客户端发送任何内容时失败：复用的连接可能在空闲期间被上游关闭，换新连接重试一次，否则回复502
+void upstream_conn::fail()
+{
+    if (m_reused && m_head_len == 0)
+    {
+        if (connect_upstream())
+        {
+            m_request_sent = 0;
+            wait_upstream(EPOLLOUT);
+            return;
+        }
+    }
+    http_conn *owner = m_owner;
+    m_owner = NULL;
+    release(false);
+    owner->proxy_failed();
+}
+
+void upstream_conn::finish(bool ok)
+{
+    http_conn *owner = m_owner;
+    bool keep = ok && m_client_keep;
+    m_owner = NULL;
+    release(ok && m_reusable && m_pipe_bytes == 0);
+    owner->proxy_done(keep);
+}
+
+void upstream_conn::abort()
+{
+    m_owner = NULL;
+    release(false);
+}
+
+// 放回空闲池或关闭。放回时不注册任何事件，空闲期间上游关闭连接在下次取用时检查
+void upstream_conn::release(bool reuse)
+{
+    if (reuse)
+    {
+        m_server->lock.lock();
+        if ((int)m_server->idle.size() < MAX_IDLE)
+        {
+            m_server->idle.push_back(this);
+            m_server->lock.unlock();
+            return;
+        }
+        m_server->lock.unlock();
+    }
+    delete this;
+}
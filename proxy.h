@@ -0,0 +1,115 @@
+#ifndef PROXY_H
+#define PROXY_H
+
+#include <netinet/in.h>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "locker.h"
+
+// 反向代理：URL前缀匹配的请求被转发到配置的上游地址。
+// 上游连接是非阻塞socket，和客户端连接注册在同一个epoll上，事件由主线程（reactor）驱动；
+// 每个上游地址维护一个keep-alive空闲连接池，响应体经 上游socket -> pipe -> 客户端socket 的splice转发。
+// 向上游发送HTTP/1.0请求并带上Connection: keep-alive，这样上游不会使用chunked编码，
+// 响应要么有Content-Length（连接可复用），要么以关闭连接结束。
+
+class http_conn;
+class upstream_conn;
+
+// 上游连接的epoll_event.data.u64带有该标记，其余部分与客户端连接句柄相同：代数<<32 | fd（客户端连接的代数不会用到这一位）
+const uint64_t UPSTREAM_TAG = 1ULL << 63;
+
+struct upstream_server
+{
+    sockaddr_in addr;
+    locker lock;                        // 保护idle
+    std::vector<upstream_conn *> idle;  // 空闲的keep-alive连接
+};
+
+struct proxy_route
+{
+    std::string prefix;
+    std::vector<upstream_server *> servers; // 多个上游时轮询
+    unsigned int next;
+};
+
+class upstream_conn
+{
+public:
+    static const int REQUEST_SIZE = 4096; // 转发给上游的请求头的最大长度
+    static const int HEAD_SIZE = 4096;    // 上游响应头的最大长度
+    static const int MAX_IDLE = 32;       // 每个上游最多保留的空闲连接数
+    static const int MAX_FD = 65536;
+
+    // 添加一条代理路由，格式为 /prefix=ip:port[,ip:port...]，只能在启动阶段调用
+    static bool add_route(const char *spec);
+    // 按URL前缀查找代理路由，没有时返回NULL
+    static const proxy_route *match(std::string_view url);
+    // 为owner取一个上游连接：优先复用空闲连接，否则新建。在工作线程中调用
+    static upstream_conn *acquire(const proxy_route *route, http_conn *owner);
+    // reactor收到带UPSTREAM_TAG的事件时调用，过期事件（代数不符）返回false
+    static bool on_event(uint64_t tag, unsigned int events);
+
+    char *request_buf() { return m_request; }
+    // 请求已写入request_buf，开始代理。调用后该对象只由reactor访问，调用者不能再使用它
+    void start(int request_len, bool client_keep_alive);
+    // 客户端socket可写（之前因客户端写缓冲满而等待EPOLLOUT）
+    void on_client_writable();
+    // 客户端连接关闭，放弃本次代理，上游连接不再复用
+    void abort();
+
+private:
+    enum STATE
+    {
+        CONNECTING = 0, // 等待非阻塞connect完成
+        SENDING,        // 发送请求
+        READING_HEAD,   // 读取响应头
+        SENDING_HEAD,   // 把改写后的响应头和已读到的部分响应体发给客户端
+        BODY            // splice转发响应体
+    };
+
+    upstream_conn(upstream_server *server);
+    ~upstream_conn();
+
+    bool connect_upstream();
+    void renew();
+    uint64_t tag() const;
+    void arm(int ev);
+    void wait_upstream(int ev);
+    void step(unsigned int events);
+    void pump();
+    bool parse_head(int head_end);
+    void fail();
+    void finish(bool ok);
+    void release(bool reuse);
+
+    static std::vector<proxy_route *> m_routes;
+    static upstream_conn *m_conns[MAX_FD]; // fd -> 上游连接
+    static uint32_t m_generation;          // 代数计数器，每次取用或重连加1
+
+    upstream_server *m_server;
+    http_conn *m_owner;      // 正在为哪个客户端连接服务，空闲时为NULL
+    int m_fd;
+    uint32_t m_gen;          // 本次使用的代数，写在事件标记中，用来丢弃上一次使用留下的过期事件
+    int m_pipe[2];
+    bool m_registered;       // 是否已加入epoll
+    bool m_reused;           // 本次使用的是复用的连接，失败时可以换新连接重试一次
+    STATE m_state;
+    int m_request_len;
+    int m_request_sent;
+    char m_request[REQUEST_SIZE];
+    char m_head[HEAD_SIZE];  // 上游响应头，以及随响应头一起读到的部分响应体
+    int m_head_len;
+    int m_body_offset;       // m_head中响应体开始的位置
+    char m_out[HEAD_SIZE + 128]; // 改写后发给客户端的响应头
+    int m_out_len;
+    int m_out_sent;
+    long long m_remaining;   // 还要从上游读取的响应体长度
+    bool m_close_delimited;  // 响应体没有长度，以上游关闭连接结束
+    bool m_reusable;         // 响应结束后上游连接可以复用
+    bool m_client_keep;      // 响应结束后客户端连接保持
+    int m_pipe_bytes;        // 管道中尚未发给客户端的字节数
+};
+
+#endif
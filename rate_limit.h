@@ -0,0 +1,196 @@
+#ifndef RATE_LIMIT_H
+#define RATE_LIMIT_H
+
+#include <stdint.h>
+#include <cstdlib>
+#include <time.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+
+// 按来源IP和所在/24网段限流的令牌桶（-l ip_rate[:net_rate]，单位为请求/秒，桶容量为1秒的量）。
+// 所有桶放在一张固定大小的开放寻址表中，键和桶各是一个64位字，用CAS更新，reactor和工作线程都不加锁。
+// 表项不删除：长时间没有访问的表项（此时桶一定是满的）在探测时被新的键直接占用，这就是老化。
+// 探测范围内没有可用的表项时放行，表满不会误伤正常客户端。
+// 表放在共享匿名映射中，prefork模式（-P）下fork出的子进程共用同一组桶，限额对所有子进程合计。
+// accept时只检查不消耗（超限的客户端直接回429并关闭，不占用连接对象），解析出请求行时每个请求消耗一个令牌。
+class rate_limiter
+{
+public:
+    static const int TABLE_BITS = 16;  // 65536个表项，每项16字节
+    static const int PROBES = 8;       // 线性探测的最大长度（不跨越两个缓存行以上）
+    static const uint32_t AGE_MS = 60000; // 超过该时间没有访问的表项可以被回收
+
+    // 只能在启动阶段调用，rate为0表示不限制该级别
+    static bool configure(int ip_rate, int net_rate)
+    {
+        state &s = get();
+        s.ip_rate = ip_rate;
+        s.net_rate = net_rate;
+        void *p = mmap(NULL, (1 << TABLE_BITS) * sizeof(slot), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        s.table = p == MAP_FAILED ? NULL : (slot *)p; // 匿名映射的内容为0，即所有表项都是空的
+        return s.table != NULL;
+    }
+
+    static bool enabled() { return get().table != NULL; }
+
+    // accept时调用：该IP或网段的桶已经空了则返回false，不消耗令牌
+    static bool admit(in_addr_t addr)
+    {
+        state &s = get();
+        if (!s.table)
+        {
+            return true;
+        }
+        uint32_t now = now_ms();
+        if (take(s, host_key(addr), s.ip_rate, now, false) && take(s, net_key(addr), s.net_rate, now, false))
+        {
+            return true;
+        }
+        __atomic_fetch_add(&s.rejected, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    // 每个请求调用一次：IP和网段各消耗一个令牌，任一个不足则返回false
+    static bool allow(in_addr_t addr)
+    {
+        state &s = get();
+        if (!s.table)
+        {
+            return true;
+        }
+        uint32_t now = now_ms();
+        if (take(s, host_key(addr), s.ip_rate, now, true) && take(s, net_key(addr), s.net_rate, now, true))
+        {
+            return true;
+        }
+        __atomic_fetch_add(&s.rejected, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    static long long rejected() { return __atomic_load_n(&get().rejected, __ATOMIC_RELAXED); }
+
+private:
+    // bucket的高32位是上次更新的时间（毫秒，允许回绕），低32位是剩余的千分之一令牌数
+    struct alignas(16) slot
+    {
+        uint64_t key;    // 0表示空
+        uint64_t bucket;
+    };
+
+    struct state
+    {
+        slot *table;
+        int ip_rate;
+        int net_rate;
+        long long rejected;
+    };
+
+    static state &get()
+    {
+        static state s = {NULL, 0, 0, 0};
+        return s;
+    }
+
+    static uint64_t host_key(in_addr_t addr) { return 1ULL << 32 | ntohl(addr); }
+    static uint64_t net_key(in_addr_t addr) { return 2ULL << 32 | (ntohl(addr) & 0xffffff00); }
+
+    static uint32_t now_ms()
+    {
+        struct timespec t;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &t);
+        return (uint32_t)(t.tv_sec * 1000 + t.tv_nsec / 1000000);
+    }
+
+    static uint64_t pack(uint32_t ms, uint32_t milli_tokens) { return (uint64_t)ms << 32 | milli_tokens; }
+
+    // 找到key的桶，按经过的时间补充令牌，consume时再取走一个
+    static bool take(state &s, uint64_t key, int rate, uint32_t now, bool consume)
+    {
+        if (rate <= 0)
+        {
+            return true;
+        }
+        const uint32_t cap = (uint32_t)rate * 1000;
+        slot *sl = find(s, key, now, cap);
+        if (!sl)
+        {
+            return true;
+        }
+        uint64_t old = __atomic_load_n(&sl->bucket, __ATOMIC_RELAXED);
+        while (true)
+        {
+            uint32_t elapsed = now - (uint32_t)(old >> 32);
+            uint64_t tokens = (uint32_t)old;
+            // 时钟回绕之外，别的线程可能用稍新的now更新过，此时elapsed是个很大的数，当作0
+            if (elapsed < 0x80000000u)
+            {
+                tokens += (uint64_t)elapsed * rate; // 每毫秒补充rate个千分之一令牌
+            }
+            if (tokens > cap)
+            {
+                tokens = cap;
+            }
+            if (tokens < 1000)
+            {
+                return false;
+            }
+            if (!consume)
+            {
+                return true;
+            }
+            uint64_t next = pack(elapsed < 0x80000000u ? now : (uint32_t)(old >> 32), tokens - 1000);
+            if (__atomic_compare_exchange_n(&sl->bucket, &old, next, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                return true;
+            }
+        }
+    }
+
+    // 查找key的表项，没有时占用一个空的或已老化的表项并把桶装满
+    static slot *find(state &s, uint64_t key, uint32_t now, uint32_t cap)
+    {
+        const uint32_t mask = (1 << TABLE_BITS) - 1;
+        uint32_t start = (uint32_t)((key * 0x9e3779b97f4a7c15ULL) >> (64 - TABLE_BITS));
+        slot *victim = NULL;
+        uint64_t victim_key = 0;
+        for (int i = 0; i < PROBES; ++i)
+        {
+            slot *sl = &s.table[(start + i) & mask];
+            uint64_t k = __atomic_load_n(&sl->key, __ATOMIC_ACQUIRE);
+            if (k == key)
+            {
+                return sl;
+            }
+            if (!victim)
+            {
+                if (k == 0)
+                {
+                    victim = sl;
+                    victim_key = 0;
+                }
+                else if (now - (uint32_t)(__atomic_load_n(&sl->bucket, __ATOMIC_RELAXED) >> 32) > AGE_MS)
+                {
+                    victim = sl;
+                    victim_key = k;
+                }
+            }
+            if (k == 0)
+            {
+                break; // 从没有被占用过的表项之后不会再有这个key
+            }
+        }
+        if (!victim)
+        {
+            return NULL;
+        }
+        // 并发占用同一表项时只有一个成功。键发布后、桶装满前，别的线程读到的是老化表项的桶（补充后是满的）或空表项的0
+        if (!__atomic_compare_exchange_n(&victim->key, &victim_key, key, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            return victim_key == key ? victim : NULL;
+        }
+        __atomic_store_n(&victim->bucket, pack(now, cap), __ATOMIC_RELEASE);
+        return victim;
+    }
+};
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <sys/epoll.h>
+#include <vector>
+#include "http_conn.h"
+#include "threadpool.h"
+
+// reactor对客户端连接上事件的处理。main.cpp的事件循环和test_presure/conn_harness.cpp调用同一份代码，
+// 测试台测到的就是服务器实际运行的分发逻辑
+
+typedef std::vector<threadpool<http_conn>::batch_item> conn_batch;
+
+// 处理fd上当前的连接对象conn（可以为NULL）的一个事件。句柄不匹配的过期事件（同一批中前面的事件已经关闭了该连接，
+// fd可能已经被新连接复用）不处理，返回false由调用者计数。读到数据的连接追加到batch，由submit_batch成批交给线程池
+inline bool dispatch_conn_event(http_conn *conn, const epoll_event &event, conn_batch &batch)
+{
+    if (!conn || !conn->valid(event.data.u64))
+    {
+        return false;
+    }
+    unsigned int events = event.events;
+    if (conn->zerocopy_pending() && (events = conn->zerocopy_event(events)) == 0)
+    {
+        // 只是MSG_ZEROCOPY的完成通知，已经重新注册；还有其他事件时由下面的分支处理
+    }
+    else if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+    {
+        // 客户端断开连接或异常错误
+        conn->close_conn();
+    }
+    else if (conn->handshaking())
+    {
+        // TLS握手在主线程中非阻塞地推进，不占用工作线程
+        if (!conn->handshake())
+        {
+            conn->close_conn();
+        }
+    }
+    else if (events & EPOLLIN)
+    {
+        if (conn->read()) // 一次性读所有数据
+        {
+            conn->trace_enqueue();
+            threadpool<http_conn>::batch_item item = {conn, event.data.u64, conn->get_node()};
+            batch.push_back(item);
+        }
+        else
+        {
+            conn->close_conn();
+        }
+    }
+    else if (events & EPOLLOUT)
+    {
+        if (!conn->write()) // 一次性写完所有数据
+        {
+            conn->close_conn();
+        }
+        else if (conn->pipelined())
+        {
+            // 响应发完，读缓冲区里已经有下一个请求，socket上不会再有它的EPOLLIN
+            conn->trace_enqueue();
+            threadpool<http_conn>::batch_item item = {conn, event.data.u64, conn->get_node()};
+            batch.push_back(item);
+        }
+    }
+    return true;
+}
+
+// 把本批读到数据的连接交给线程池并清空batch，返回入队的数量
+inline int submit_batch(threadpool<http_conn> *pool, conn_batch &batch)
+{
+    if (batch.empty())
+    {
+        return 0;
+    }
+    int accepted = pool->append_batch(batch.data(), batch.size());
+    for (size_t k = accepted; k < batch.size(); ++k)
+    {
+        // 请求队列已满，EPOLLONESHOT不会再触发，只能关闭连接。
+        // 这些连接的任务没有入队，本批中也不会再有它们的事件，直接关闭是安全的
+        batch[k].request->close_conn();
+    }
+    batch.clear();
+    return accepted;
+}
+
+#endif
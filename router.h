@@ -0,0 +1,452 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include <cstdio>
+#include <cstring>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "http_request.h"
+
+// 动态请求的路由表：把URL映射到进程内的C++处理函数，不访问文件系统。
+// 支持三种路由：
+//   精确路由   /health
+//   前缀路由   /api/*          （*匹配剩余的整个路径）
+//   参数路由   /users/:id/posts/:pid
+// 编译期已知的路由用static_routes在编译期生成精确路由的完美哈希表；
+// 其余路由在启动时注册进按路径段组织的字典树。注册只能在启动阶段进行，之后路由表只读，工作线程无锁查询。
+
+// 路由的请求方法掩码，第i位对应http_conn::METHOD中值为i的方法
+enum ROUTE_METHOD
+{
+    ROUTE_GET = 1 << 0,
+    ROUTE_POST = 1 << 1,
+    ROUTE_PUT = 1 << 3,
+    ROUTE_ANY = 0xff
+};
+
+// 参数路由匹配到的参数，值指向请求的读缓冲区
+struct route_params
+{
+    static const int MAX_PARAMS = 8;
+    int count;
+    std::string_view names[MAX_PARAMS];
+    std::string_view values[MAX_PARAMS];
+
+    route_params() : count(0) {}
+
+    std::string_view get(std::string_view name) const
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            if (names[i] == name)
+            {
+                return values[i];
+            }
+        }
+        return std::string_view();
+    }
+};
+
+// 分块生成的响应体：长度事先未知或者太大、放不进写缓冲区的动态响应。
+// 连接每发完一块就拉取下一块，始终只占用一个缓冲区，第一块生成后立即开始发送。
+// HTTP/1.1按Transfer-Encoding: chunked编码，HTTP/2每块作为DATA帧发送。
+// 第一块在工作线程中生成，之后的在reactor中生成（socket可写时），fill不能阻塞。
+class body_generator
+{
+public:
+    virtual ~body_generator() {}
+    // 向buf写入至多capacity字节的响应体，返回写入的字节数，0表示响应体结束，-1表示出错（中止连接或流）
+    virtual int fill(char *buf, int capacity) = 0;
+};
+
+// 处理函数的输出，响应体直接写入连接的写缓冲区，或者交给body_generator分块生成
+class route_response
+{
+public:
+    static const int MAX_CONTENT_TYPE = 64;
+
+    route_response(char *buf, int capacity)
+        : m_buf(buf), m_capacity(capacity), m_length(0), m_status(200), m_overflow(false), m_generator(NULL)
+    {
+        strcpy(m_content_type, "application/json");
+    }
+    ~route_response() { delete m_generator; }
+
+    void set_status(int status) { m_status = status; }
+    void set_content_type(const char *type)
+    {
+        snprintf(m_content_type, sizeof(m_content_type), "%s", type);
+    }
+
+    bool append(const char *data, int len)
+    {
+        if (m_overflow || len > m_capacity - m_length)
+        {
+            m_overflow = true;
+            return false;
+        }
+        memcpy(m_buf + m_length, data, len);
+        m_length += len;
+        return true;
+    }
+    bool append(std::string_view text) { return append(text.data(), (int)text.size()); }
+
+    bool appendf(const char *format, ...)
+    {
+        if (m_overflow)
+        {
+            return false;
+        }
+        va_list arg_list;
+        va_start(arg_list, format);
+        int len = vsnprintf(m_buf + m_length, m_capacity - m_length, format, arg_list);
+        va_end(arg_list);
+        if (len < 0 || len >= m_capacity - m_length)
+        {
+            m_overflow = true;
+            return false;
+        }
+        m_length += len;
+        return true;
+    }
+
+    // 响应体改由gen生成（new出来的对象，之后由连接负责delete），已经append的内容被忽略
+    void stream(body_generator *gen)
+    {
+        delete m_generator;
+        m_generator = gen;
+    }
+
+    int status() const { return m_status; }
+    const char *content_type() const { return m_content_type; }
+    const char *body() const { return m_buf; }
+    int length() const { return m_length; }
+    bool overflow() const { return m_overflow; } // 响应体超出写缓冲区，回复500
+    // 取走生成器，之后由调用者delete；没有调用stream时返回NULL
+    body_generator *take_generator()
+    {
+        body_generator *gen = m_generator;
+        m_generator = NULL;
+        return gen;
+    }
+
+private:
+    char *m_buf;
+    int m_capacity;
+    int m_length;
+    int m_status;
+    bool m_overflow;
+    body_generator *m_generator;
+    char m_content_type[MAX_CONTENT_TYPE];
+};
+
+typedef void (*route_fn)(const http_request &req, const route_params &params, route_response &resp);
+
+struct route
+{
+    int methods = 0;          // ROUTE_METHOD的组合
+    std::string_view pattern;
+    route_fn fn = nullptr;
+};
+
+constexpr bool route_is_exact(std::string_view pattern)
+{
+    for (size_t i = 0; i < pattern.size(); ++i)
+    {
+        if (pattern[i] == ':' || pattern[i] == '*')
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+constexpr uint32_t route_hash(std::string_view path, uint32_t seed)
+{
+    uint32_t h = 2166136261u ^ seed;
+    for (size_t i = 0; i < path.size(); ++i)
+    {
+        h ^= (unsigned char)path[i];
+        h *= 16777619u;
+    }
+    return h ^ (h >> 15);
+}
+
+// 精确路由完美哈希表的非模板视图，供router在运行时查询
+struct exact_route_index
+{
+    const route *routes;
+    const short *slots; // 槽位 -> routes下标，-1为空
+    uint32_t mask;
+    uint32_t seed;
+};
+
+// 编译期路由表：constexpr构造时为其中的精确路由寻找完美哈希种子，
+// 同一路径注册多个方法时只有第一条进入哈希表，其余仍走字典树
+template <size_t N>
+class static_routes
+{
+public:
+    static constexpr uint32_t slot_count()
+    {
+        uint32_t n = 4;
+        while (n < 2 * N)
+        {
+            n <<= 1;
+        }
+        return n;
+    }
+
+    constexpr static_routes(const route (&routes)[N]) : m_routes(), m_slots(), m_seed(0)
+    {
+        for (size_t i = 0; i < N; ++i)
+        {
+            m_routes[i] = routes[i];
+        }
+        for (uint32_t seed = 1; seed < 100000 && m_seed == 0; ++seed)
+        {
+            for (uint32_t i = 0; i < slot_count(); ++i)
+            {
+                m_slots[i] = -1;
+            }
+            bool ok = true;
+            for (size_t i = 0; i < N && ok; ++i)
+            {
+                if (!route_is_exact(m_routes[i].pattern) || duplicate(i))
+                {
+                    continue;
+                }
+                uint32_t slot = route_hash(m_routes[i].pattern, seed) & (slot_count() - 1);
+                ok = m_slots[slot] < 0;
+                m_slots[slot] = (short)i;
+            }
+            if (ok)
+            {
+                m_seed = seed;
+            }
+        }
+    }
+
+    constexpr uint32_t seed() const { return m_seed; }
+    size_t size() const { return N; }
+    const route &at(size_t i) const { return m_routes[i]; }
+    bool hashed(size_t i) const { return route_is_exact(m_routes[i].pattern) && !duplicate(i); }
+
+    exact_route_index index() const
+    {
+        exact_route_index idx = {m_routes, m_slots, slot_count() - 1, m_seed};
+        return idx;
+    }
+
+private:
+    constexpr bool duplicate(size_t i) const
+    {
+        for (size_t j = 0; j < i; ++j)
+        {
+            if (m_routes[j].pattern == m_routes[i].pattern)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    route m_routes[N];
+    short m_slots[slot_count()];
+    uint32_t m_seed;
+};
+
+class router
+{
+public:
+    router() : m_nodes(1) {}
+
+    // 注册编译期路由表，table必须具有静态存储期
+    template <size_t N>
+    void add_static(const static_routes<N> &table)
+    {
+        m_exact.push_back(table.index());
+        for (size_t i = 0; i < table.size(); ++i)
+        {
+            if (!table.hashed(i))
+            {
+                add(table.at(i).methods, table.at(i).pattern, table.at(i).fn);
+            }
+        }
+    }
+
+    // 在运行时注册一条路由，pattern格式错误时返回false
+    bool add(int methods, std::string_view pattern, route_fn fn)
+    {
+        if (pattern.empty() || pattern[0] != '/' || !fn)
+        {
+            return false;
+        }
+        int cur = 0;
+        entry e;
+        e.methods = methods;
+        e.fn = fn;
+        size_t pos = 1;
+        while (pos <= pattern.size())
+        {
+            size_t end = pattern.find('/', pos);
+            if (end == std::string_view::npos)
+            {
+                end = pattern.size();
+            }
+            std::string_view seg = pattern.substr(pos, end - pos);
+            if (seg == "*")
+            {
+                if (end != pattern.size())
+                {
+                    return false; // *只能出现在最后
+                }
+                m_nodes[cur].wildcard.push_back(e);
+                return true;
+            }
+            if (!seg.empty() && seg[0] == ':')
+            {
+                if ((int)e.param_names.size() >= route_params::MAX_PARAMS)
+                {
+                    return false;
+                }
+                e.param_names.push_back(std::string(seg.substr(1)));
+                if (m_nodes[cur].param_child < 0)
+                {
+                    m_nodes[cur].param_child = new_node();
+                }
+                cur = m_nodes[cur].param_child;
+            }
+            else
+            {
+                int next = -1;
+                for (size_t i = 0; i < m_nodes[cur].children.size(); ++i)
+                {
+                    if (m_nodes[cur].children[i].first == seg)
+                    {
+                        next = m_nodes[cur].children[i].second;
+                        break;
+                    }
+                }
+                if (next < 0)
+                {
+                    next = new_node();
+                    m_nodes[cur].children.push_back(std::make_pair(std::string(seg), next));
+                }
+                cur = next;
+            }
+            pos = end + 1;
+        }
+        m_nodes[cur].handlers.push_back(e);
+        return true;
+    }
+
+    // 查找处理函数，path不含查询串，method为 1 << http_conn::METHOD。没有匹配的路由时返回NULL
+    route_fn match(int method, std::string_view path, route_params &params) const
+    {
+        params.count = 0;
+        for (size_t i = 0; i < m_exact.size(); ++i)
+        {
+            const exact_route_index &idx = m_exact[i];
+            int slot = idx.slots[route_hash(path, idx.seed) & idx.mask];
+            if (slot >= 0 && idx.routes[slot].pattern == path && (idx.routes[slot].methods & method))
+            {
+                return idx.routes[slot].fn;
+            }
+        }
+        if (path.empty() || path[0] != '/')
+        {
+            return NULL;
+        }
+        std::string_view values[route_params::MAX_PARAMS];
+        const entry *e = walk(0, path.substr(1), method, values, 0);
+        if (!e)
+        {
+            return NULL;
+        }
+        params.count = e->param_names.size();
+        for (int i = 0; i < params.count; ++i)
+        {
+            params.names[i] = e->param_names[i];
+            params.values[i] = values[i];
+        }
+        return e->fn;
+    }
+
+private:
+    struct entry
+    {
+        int methods;
+        route_fn fn;
+        std::vector<std::string> param_names;
+    };
+
+    struct node
+    {
+        std::vector<std::pair<std::string, int> > children; // 固定路径段 -> 子节点
+        int param_child;                                    // :name 子节点
+        std::vector<entry> handlers;                        // 路径在此结束的路由
+        std::vector<entry> wildcard;                        // 以 /* 结尾的前缀路由
+        node() : param_child(-1) {}
+    };
+
+    int new_node()
+    {
+        m_nodes.push_back(node());
+        return m_nodes.size() - 1;
+    }
+
+    static const entry *find_method(const std::vector<entry> &entries, int method)
+    {
+        for (size_t i = 0; i < entries.size(); ++i)
+        {
+            if (entries[i].methods & method)
+            {
+                return &entries[i];
+            }
+        }
+        return NULL;
+    }
+
+    // 固定路径段优先于参数，参数优先于前缀通配，匹配失败时回溯
+    const entry *walk(int cur, std::string_view rest, int method, std::string_view *values, int depth) const
+    {
+        const node &n = m_nodes[cur];
+        size_t end = rest.find('/');
+        std::string_view seg = rest.substr(0, end);
+        bool last = (end == std::string_view::npos);
+        std::string_view next_rest = last ? std::string_view() : rest.substr(end + 1);
+
+        for (size_t i = 0; i < n.children.size(); ++i)
+        {
+            if (n.children[i].first == seg)
+            {
+                const entry *e = last ? find_method(m_nodes[n.children[i].second].handlers, method)
+                                      : walk(n.children[i].second, next_rest, method, values, depth);
+                if (e)
+                {
+                    return e;
+                }
+            }
+        }
+        if (n.param_child >= 0 && !seg.empty() && depth < route_params::MAX_PARAMS)
+        {
+            values[depth] = seg;
+            const entry *e = last ? find_method(m_nodes[n.param_child].handlers, method)
+                                  : walk(n.param_child, next_rest, method, values, depth + 1);
+            if (e)
+            {
+                return e;
+            }
+        }
+        return find_method(n.wildcard, method);
+    }
+
+    std::vector<node> m_nodes; // m_nodes[0]为根
+    std::vector<exact_route_index> m_exact;
+};
+
+#endif
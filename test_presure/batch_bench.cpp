@@ -0,0 +1,160 @@
+// 比较逐个append和append_batch把一次epoll_wait的就绪事件交给线程池的吞吐量（事件/秒）。
+// 不经过网络：生产者模拟reactor，每轮提交batch个任务，任务只做少量计算，测的是入队、唤醒和出队的开销。
+//   g++ -O2 -std=c++17 -I. test_presure/batch_bench.cpp -lpthread -o batch_bench
+//   ./batch_bench [-t threads] [-S spin_us] [-w work] [-d seconds] [-b 1,16,128,512]
+// -w 每个任务的计算量（空循环次数），-S 同服务器的-S。每个batch分别测两种提交方式。
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+#include <vector>
+#include "threadpool.h"
+
+static int work = 100;
+
+struct job
+{
+    static long long done;
+
+    bool valid(uint64_t handle) const { return true; }
+
+    int process()
+    {
+        for (volatile int i = 0; i < work; ++i)
+        {
+        }
+        __atomic_add_fetch(&done, 1, __ATOMIC_RELAXED);
+        return TASK_DONE;
+    }
+};
+long long job::done = 0;
+
+static long long now_ns()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+// 按batch个一轮提交，直到经过seconds秒，返回每秒完成的任务数。
+// 未完成的任务超过max_pending时等待，模拟reactor在事件处理完之前不会再得到同一连接的事件
+static double run(threadpool<job> &pool, std::vector<job> &jobs, int batch, bool bulk, int seconds, int max_pending)
+{
+    std::vector<threadpool<job>::batch_item> items(batch);
+    for (int i = 0; i < batch; ++i)
+    {
+        items[i].request = &jobs[i];
+        items[i].handle = 1;
+        items[i].node = -1;
+    }
+    long long submitted = 0;
+    long long base = __atomic_load_n(&job::done, __ATOMIC_RELAXED);
+    long long start = now_ns();
+    long long deadline = start + seconds * 1000000000LL;
+    while (now_ns() < deadline)
+    {
+        while (submitted - (__atomic_load_n(&job::done, __ATOMIC_RELAXED) - base) > max_pending)
+        {
+            sched_yield();
+        }
+        if (bulk)
+        {
+            submitted += pool.append_batch(items.data(), batch);
+        }
+        else
+        {
+            for (int i = 0; i < batch; ++i)
+            {
+                submitted += pool.append(items[i].request, items[i].handle, items[i].node);
+            }
+        }
+    }
+    while (__atomic_load_n(&job::done, __ATOMIC_RELAXED) - base < submitted)
+    {
+        sched_yield();
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+    return submitted / elapsed;
+}
+
+int main(int argc, char *argv[])
+{
+    int threads = 8;
+    int spin_us = 0;
+    int seconds = 2;
+    std::vector<int> batches;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:S:w:d:b:")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'S':
+            spin_us = atoi(optarg);
+            break;
+        case 'w':
+            work = atoi(optarg);
+            break;
+        case 'd':
+            seconds = atoi(optarg);
+            break;
+        case 'b':
+            for (char *p = optarg; *p;)
+            {
+                batches.push_back(strtol(p, &p, 10));
+                if (*p == ',')
+                {
+                    ++p;
+                }
+                else if (*p)
+                {
+                    printf("无效的batch列表：%s\n", optarg);
+                    return -1;
+                }
+            }
+            break;
+        default:
+            break;
+        }
+    }
+    if (batches.empty())
+    {
+        int defaults[] = {1, 16, 128, 512};
+        batches.assign(defaults, defaults + 4);
+    }
+    if (threads <= 0 || seconds <= 0)
+    {
+        printf("按照此格式：%s [-t threads] [-S spin_us] [-w work] [-d seconds] [-b batch,...]\n", argv[0]);
+        return -1;
+    }
+
+    const int max_request = 10000;
+    threadpool<job> pool(threads, max_request, std::vector<int>(), threads, 0, 1000, spin_us);
+    int max_batch = 0;
+    for (size_t i = 0; i < batches.size(); ++i)
+    {
+        max_batch = batches[i] > max_batch ? batches[i] : max_batch;
+    }
+    std::vector<job> jobs(max_batch);
+
+    printf("%8s %16s %16s %8s\n", "batch", "append/s", "append_batch/s", "speedup");
+    for (size_t i = 0; i < batches.size(); ++i)
+    {
+        int b = batches[i];
+        if (b <= 0 || b > max_request)
+        {
+            continue;
+        }
+        double single = run(pool, jobs, b, false, seconds, max_request / 2);
+        double bulk = run(pool, jobs, b, true, seconds, max_request / 2);
+        printf("%8d %16.0f %16.0f %7.2fx\n", b, single, bulk, bulk / single);
+    }
+    threadpool_stats stats;
+    pool.get_stats(stats);
+    printf("wakeups: spin %lld, yield %lld, park %lld\n", stats.spin_wakeups, stats.yield_wakeups, stats.park_wakeups);
+    return 0;
+}
@@ -0,0 +1,745 @@
+// 进程内的http_conn测试台：reactor + threadpool 与 socketpair 的另一端上按脚本运行的客户端在同一进程中，
+// 不需要监听端口和外部客户端，可以注入故障并对延迟做断言：
+//   g++ -O2 -std=c++17 -I. test_presure/conn_harness.cpp http_conn.cpp asset_arena.cpp proxy.cpp http2.cpp -lpthread -ldl -o conn_harness
+//   ./conn_harness [-s basic,short_read,partial_write,slow_drain,pipeline] [-L ms] [-v]
+// 故障注入：本文件定义的recv/writev覆盖libc中的同名函数（http_conn只通过它们读写明文连接），
+// 只对服务器一端的fd生效：
+//   短读   每次recv最多读若干字节，客户端同时把请求拆成小段、间隔发送，请求跨多次EPOLLIN到达
+//   短写   每次writev最多写若干字节，并且每N次直接返回EAGAIN，走部分写入后重新注册EPOLLOUT的路径
+//   慢读   服务器端发送缓冲区调小，客户端小块、间隔地读，同时另一个连接上的请求不应被拖慢
+// 每个场景检查响应的状态码和内容，以及每个请求的往返时间不超过 -L 毫秒（默认200），全部通过时退出码为0。
+// pipeline场景在一次写入中发送一组请求，检查流水线上的请求依次得到响应。
+// 服务器的日志输出到/dev/null，-v 时保留在标准输出上，测试结果写到标准错误。
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "http_conn.h"
+#include "threadpool.h"
+#include "reactor.h"
+
+extern const char *doc_root;
+
+static const int MAX_FD = 1024;
+static const int MAX_EVENT_NUM = 1024;
+static const int BIG_SIZE = 1 << 20;
+static const char HEALTH_BODY[] = "{\"status\":\"ok\"}";
+
+// ---------------- 故障注入 ----------------
+
+struct faults
+{
+    int read_cap;     // 每次recv最多读的字节数，0表示不限
+    int write_cap;    // 每次writev最多写的字节数，0表示不限
+    int eagain_every; // 每N次writev有一次不写直接返回EAGAIN，0表示不注入
+};
+
+// 场景开始前（reactor线程启动前）设置，运行期间只读
+static faults g_faults;
+static bool g_server_fd[MAX_FD]; // 服务器一端的fd
+
+// 计数器，场景开始前清零
+static long long g_reads;
+static long long g_writes;
+static long long g_short_writes;
+static long long g_eagains;
+static long long g_stale; // reactor丢弃的过期事件，只在reactor线程中修改
+
+static bool faulty(int fd)
+{
+    return fd >= 0 && fd < MAX_FD && g_server_fd[fd];
+}
+
+extern "C" ssize_t recv(int fd, void *buf, size_t len, int flags)
+{
+    static ssize_t (*real)(int, void *, size_t, int) = (ssize_t(*)(int, void *, size_t, int))dlsym(RTLD_NEXT, "recv");
+    if (faulty(fd))
+    {
+        __atomic_add_fetch(&g_reads, 1, __ATOMIC_RELAXED);
+        if (g_faults.read_cap > 0 && len > (size_t)g_faults.read_cap)
+        {
+            len = g_faults.read_cap;
+        }
+    }
+    return real(fd, buf, len, flags);
+}
+
+extern "C" ssize_t writev(int fd, const struct iovec *iov, int count)
+{
+    static ssize_t (*real)(int, const struct iovec *, int) = (ssize_t(*)(int, const struct iovec *, int))dlsym(RTLD_NEXT, "writev");
+    if (!faulty(fd))
+    {
+        return real(fd, iov, count);
+    }
+    long long n = __atomic_add_fetch(&g_writes, 1, __ATOMIC_RELAXED);
+    if (g_faults.eagain_every > 0 && n % g_faults.eagain_every == 0)
+    {
+        __atomic_add_fetch(&g_eagains, 1, __ATOMIC_RELAXED);
+        errno = EAGAIN;
+        return -1;
+    }
+    if (g_faults.write_cap <= 0)
+    {
+        return real(fd, iov, count);
+    }
+    // 截断iovec，只交给内核write_cap个字节
+    std::vector<struct iovec> cut;
+    size_t left = g_faults.write_cap;
+    for (int i = 0; i < count && left > 0; ++i)
+    {
+        struct iovec v = iov[i];
+        if (v.iov_len > left)
+        {
+            v.iov_len = left;
+        }
+        left -= v.iov_len;
+        cut.push_back(v);
+    }
+    ssize_t ret = real(fd, cut.data(), cut.size());
+    if (ret > 0 && left == 0)
+    {
+        __atomic_add_fetch(&g_short_writes, 1, __ATOMIC_RELAXED);
+    }
+    return ret;
+}
+
+// ---------------- 进程内的服务器 ----------------
+
+static http_conn *users;
+static threadpool<http_conn> *pool;
+static int epollfd;
+static int stopfd; // reactor的停止信号
+static pthread_t reactor_thread;
+
+static void health_route(const http_request &req, const route_params &params, route_response &resp)
+{
+    resp.append(HEALTH_BODY);
+}
+
+// 对连接上事件的处理与main.cpp的reactor是同一份代码（reactor.h），这里只是没有监听socket
+static void *reactor(void *arg)
+{
+    epoll_event events[MAX_EVENT_NUM];
+    conn_batch batch;
+    while (true)
+    {
+        int num = epoll_wait(epollfd, events, MAX_EVENT_NUM, -1);
+        if (num < 0 && errno != EINTR)
+        {
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < num; i++)
+        {
+            int sockfd = events[i].data.fd;
+            if (sockfd == stopfd)
+            {
+                return NULL;
+            }
+            if (!dispatch_conn_event(&users[sockfd], events[i], batch))
+            {
+                ++g_stale;
+            }
+        }
+        submit_batch(pool, batch);
+    }
+    return NULL;
+}
+
+// 建立一个连接，服务器一端交给http_conn，返回客户端一端（阻塞模式），只能在reactor停止时调用
+static int open_conn(int server_sndbuf)
+{
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0 || sv[0] >= MAX_FD)
+    {
+        return -1;
+    }
+    if (server_sndbuf > 0)
+    {
+        setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &server_sndbuf, sizeof(server_sndbuf));
+    }
+    // 与main.cpp中Unix域套接字上的连接一样，是地址为回环地址的本机连接
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    g_server_fd[sv[0]] = true;
+    users[sv[0]].init(sv[0], addr, -1, true);
+    struct timeval tv = {5, 0}; // 服务器没有响应时客户端不会永远阻塞
+    setsockopt(sv[1], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    return sv[1];
+}
+
+static void start_reactor()
+{
+    __atomic_store_n(&g_reads, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&g_writes, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&g_short_writes, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&g_eagains, 0, __ATOMIC_RELAXED);
+    g_stale = 0;
+    pthread_create(&reactor_thread, NULL, reactor, NULL);
+}
+
+// 客户端都已关闭连接，等服务器关闭所有连接后停止reactor
+static bool stop_reactor()
+{
+    bool drained = false;
+    for (int i = 0; i < 2000 && !drained; ++i)
+    {
+        drained = __atomic_load_n(&http_conn::m_user_count, __ATOMIC_RELAXED) == 0;
+        if (!drained)
+        {
+            usleep(1000);
+        }
+    }
+    uint64_t one = 1;
+    ::write(stopfd, &one, sizeof(one));
+    pthread_join(reactor_thread, NULL);
+    uint64_t value;
+    ::read(stopfd, &value, sizeof(value));
+    memset(g_server_fd, 0, sizeof(g_server_fd));
+    memset(&g_faults, 0, sizeof(g_faults));
+    return drained;
+}
+
+// ---------------- 脚本客户端 ----------------
+
+static std::string small_body;
+
+static long long now_us()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000LL + t.tv_nsec / 1000;
+}
+
+static unsigned char big_byte(size_t i)
+{
+    return (unsigned char)(i * 131 + i / 4096);
+}
+
+struct step
+{
+    const char *path;
+    int frag;       // 请求按frag字节一段发送，0表示一次发完
+    int frag_gap_us;
+    int drain;      // 每次最多读drain字节，0表示尽量多读
+    int drain_gap_us;
+};
+
+struct client
+{
+    int fd;
+    std::vector<step> steps;
+    bool pipelined;                 // 所有请求在一次写入中发出，之后依次读响应
+    std::vector<long long> latency; // 每个请求的往返时间（微秒）
+    std::string error;              // 第一个错误，空表示全部正确
+    std::string pending;            // 读到的、属于下一个响应的数据
+    pthread_t thread;
+};
+
+static std::string make_request(const char *path)
+{
+    return std::string("GET ") + path + " HTTP/1.1\r\nHost: harness\r\nConnection: keep-alive\r\n\r\n";
+}
+
+static bool send_all(int fd, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = ::write(fd, data, len);
+        if (n <= 0)
+        {
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool send_request(client &c, const std::string &req, const step &s)
+{
+    if (s.frag <= 0)
+    {
+        return send_all(c.fd, req.data(), req.size());
+    }
+    for (size_t off = 0; off < req.size(); off += s.frag)
+    {
+        if (off > 0)
+        {
+            usleep(s.frag_gap_us);
+        }
+        if (!send_all(c.fd, req.data() + off, std::min((size_t)s.frag, req.size() - off)))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// 读一个完整的响应并检查状态码和响应体，出错时返回false并填写c.error
+static bool read_response(client &c, const step &s)
+{
+    std::string data;
+    data.swap(c.pending);
+    size_t head_end;
+    char buf[65536];
+    int cap = s.drain > 0 && s.drain < (int)sizeof(buf) ? s.drain : sizeof(buf);
+    size_t body_len = 0;
+    size_t checked = 0; // 已经检查过的响应体字节数
+    bool have_head = false;
+    const char *expect = NULL;
+    bool big = strcmp(s.path, "/big.bin") == 0;
+    if (strcmp(s.path, "/health") == 0)
+    {
+        expect = HEALTH_BODY;
+    }
+    else if (strcmp(s.path, "/small.html") == 0)
+    {
+        expect = small_body.c_str();
+    }
+    while (true)
+    {
+        if (!have_head && (head_end = data.find("\r\n\r\n")) != std::string::npos)
+        {
+            have_head = true;
+            head_end += 4;
+            if (data.compare(0, 12, "HTTP/1.1 200") != 0)
+            {
+                c.error = std::string(s.path) + ": " + data.substr(0, data.find("\r\n"));
+                return false;
+            }
+            size_t pos = data.find("Content-Length:");
+            if (pos == std::string::npos || pos > head_end)
+            {
+                c.error = std::string(s.path) + ": no Content-Length";
+                return false;
+            }
+            body_len = strtoul(data.c_str() + pos + 15, NULL, 10);
+            size_t want = big ? BIG_SIZE : strlen(expect);
+            if (body_len != want)
+            {
+                c.error = std::string(s.path) + ": Content-Length " + std::to_string(body_len);
+                return false;
+            }
+        }
+        if (have_head)
+        {
+            // 大文件边收边检查，只在内存中保留未检查的部分
+            size_t avail = std::min(data.size() - head_end, body_len - checked);
+            for (size_t i = 0; i < avail; ++i)
+            {
+                unsigned char want = big ? big_byte(checked + i) : (unsigned char)expect[checked + i];
+                if ((unsigned char)data[head_end + i] != want)
+                {
+                    c.error = std::string(s.path) + ": body differs at byte " + std::to_string(checked + i);
+                    return false;
+                }
+            }
+            checked += avail;
+            if (checked == body_len)
+            {
+                c.pending = data.substr(head_end + avail);
+                return true;
+            }
+            data.erase(head_end, avail);
+        }
+        if (s.drain_gap_us > 0)
+        {
+            usleep(s.drain_gap_us);
+        }
+        ssize_t n = ::read(c.fd, buf, cap);
+        if (n <= 0)
+        {
+            c.error = std::string(s.path) + (n == 0 ? ": connection closed" : ": timed out");
+            return false;
+        }
+        data.append(buf, n);
+    }
+}
+
+static void *run_client(void *arg)
+{
+    client &c = *(client *)arg;
+    if (c.pipelined)
+    {
+        std::string all;
+        for (size_t i = 0; i < c.steps.size(); ++i)
+        {
+            all += make_request(c.steps[i].path);
+        }
+        long long start = now_us();
+        if (!send_all(c.fd, all.data(), all.size()))
+        {
+            c.error = "send failed";
+            return NULL;
+        }
+        for (size_t i = 0; i < c.steps.size(); ++i)
+        {
+            if (!read_response(c, c.steps[i]))
+            {
+                return NULL;
+            }
+            c.latency.push_back(now_us() - start);
+        }
+        return NULL;
+    }
+    for (size_t i = 0; i < c.steps.size(); ++i)
+    {
+        long long start = now_us();
+        if (!send_request(c, make_request(c.steps[i].path), c.steps[i]))
+        {
+            c.error = "send failed";
+            return NULL;
+        }
+        if (!read_response(c, c.steps[i]))
+        {
+            return NULL;
+        }
+        c.latency.push_back(now_us() - start);
+    }
+    return NULL;
+}
+
+// ---------------- 场景 ----------------
+
+static FILE *out;
+static long long limit_us = 200000;
+
+struct result
+{
+    bool ok;
+    int requests;
+    long long p50, p99, max; // 微秒
+};
+
+static void fail(result &r, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    fprintf(out, "    FAIL: ");
+    vfprintf(out, fmt, ap);
+    fprintf(out, "\n");
+    va_end(ap);
+    r.ok = false;
+}
+
+// 运行一组客户端，汇总延迟并检查每个请求的结果，slack_us为每个请求额外允许的时间（比如注入的发送间隔）
+static result run_clients(std::vector<client> &clients, long long slack_us)
+{
+    start_reactor();
+    for (size_t i = 0; i < clients.size(); ++i)
+    {
+        pthread_create(&clients[i].thread, NULL, run_client, &clients[i]);
+    }
+    result r = {true, 0, 0, 0, 0};
+    std::vector<long long> all;
+    for (size_t i = 0; i < clients.size(); ++i)
+    {
+        pthread_join(clients[i].thread, NULL);
+        close(clients[i].fd);
+        if (!clients[i].error.empty())
+        {
+            fail(r, "client %zu: %s", i, clients[i].error.c_str());
+        }
+        all.insert(all.end(), clients[i].latency.begin(), clients[i].latency.end());
+    }
+    if (!stop_reactor())
+    {
+        fail(r, "%d connections still open on the server", http_conn::m_user_count);
+    }
+    std::sort(all.begin(), all.end());
+    r.requests = all.size();
+    if (!all.empty())
+    {
+        r.p50 = all[all.size() / 2];
+        r.p99 = all[all.size() * 99 / 100];
+        r.max = all.back();
+    }
+    if (r.max > limit_us + slack_us)
+    {
+        fail(r, "max latency %lldus exceeds %lldus", r.max, limit_us + slack_us);
+    }
+    return r;
+}
+
+static void report(const char *name, const result &r)
+{
+    fprintf(out, "%-14s %s  requests %d, p50 %lldus, p99 %lldus, max %lldus, server recv %lld, writev %lld (short %lld, eagain %lld), stale %lld\n",
+            name, r.ok ? "PASS" : "FAIL", r.requests, r.p50, r.p99, r.max, g_reads, g_writes, g_short_writes, g_eagains, g_stale);
+}
+
+static client make_client(int server_sndbuf = 0)
+{
+    client c;
+    c.fd = open_conn(server_sndbuf);
+    c.pipelined = false;
+    return c;
+}
+
+// 8个keep-alive连接，各交替请求50次动态路由和小文件
+static bool basic()
+{
+    std::vector<client> clients;
+    for (int i = 0; i < 8; ++i)
+    {
+        clients.push_back(make_client());
+        for (int j = 0; j < 50; ++j)
+        {
+            step s = {j % 2 ? "/small.html" : "/health", 0, 0, 0, 0};
+            clients.back().steps.push_back(s);
+        }
+    }
+    result r = run_clients(clients, 0);
+    report("basic", r);
+    return r.ok;
+}
+
+// 每次recv只读1字节，请求按7字节一段、间隔200us发送：请求跨多次EPOLLIN到达，每次都要重新注册EPOLLIN
+static bool short_read()
+{
+    g_faults.read_cap = 1;
+    std::vector<client> clients;
+    size_t request_bytes = 0;
+    int frag = 7, gap = 200;
+    for (int i = 0; i < 4; ++i)
+    {
+        clients.push_back(make_client());
+        for (int j = 0; j < 10; ++j)
+        {
+            step s = {j % 2 ? "/small.html" : "/health", frag, gap, 0, 0};
+            clients.back().steps.push_back(s);
+            request_bytes += make_request(s.path).size();
+        }
+    }
+    long long slack = (long long)(make_request("/small.html").size() / frag + 1) * gap * 4; // usleep会超时，留出余量
+    result r = run_clients(clients, slack);
+    // 每个字节至少一次recv，外加每次读到EAGAIN为止的那一次
+    if (g_reads < (long long)request_bytes)
+    {
+        fail(r, "server recv calls %lld < request bytes %zu, read cap not applied", g_reads, request_bytes);
+    }
+    report("short_read", r);
+    return r.ok;
+}
+
+// 每次writev最多写4096字节，每3次有一次EAGAIN：1MB的文件响应经过数百次部分写入和重新注册EPOLLOUT后仍然完整
+static bool partial_write()
+{
+    const int cap = 4096;
+    g_faults.write_cap = cap;
+    g_faults.eagain_every = 3;
+    std::vector<client> clients;
+    int responses = 0;
+    for (int i = 0; i < 2; ++i)
+    {
+        clients.push_back(make_client());
+        for (int j = 0; j < 3; ++j)
+        {
+            step s = {j == 1 ? "/health" : "/big.bin", 0, 0, 0, 0};
+            clients.back().steps.push_back(s);
+            responses += s.path[1] == 'b';
+        }
+    }
+    result r = run_clients(clients, 0);
+    long long min_writes = (long long)responses * (BIG_SIZE / cap);
+    if (g_short_writes < min_writes || g_eagains == 0)
+    {
+        fail(r, "expected at least %lld short writes and some EAGAINs, got %lld and %lld", min_writes,
+             g_short_writes, g_eagains);
+    }
+    report("partial_write", r);
+    return r.ok;
+}
+
+// 一个客户端以每2ms读16KB的速度接收1MB的文件（服务器端发送缓冲区16KB），
+// 同时另一个连接上的请求不受影响：reactor只在socket可写时发送，不会阻塞在慢的连接上
+static bool slow_drain()
+{
+    std::vector<client> clients;
+    clients.push_back(make_client(16384));
+    step big = {"/big.bin", 0, 0, 16384, 2000};
+    clients.back().steps.push_back(big);
+    clients.push_back(make_client());
+    for (int j = 0; j < 100; ++j)
+    {
+        step s = {"/health", 0, 0, 0, 0};
+        clients.back().steps.push_back(s);
+    }
+    // 慢的下载本身要1MB/16KB*2ms = 128ms以上，只对另一个连接的请求做延迟断言
+    long long slow_min = (long long)BIG_SIZE / big.drain * big.drain_gap_us;
+    result r = run_clients(clients, slow_min * 4);
+    long long fast_max = clients[1].latency.empty() ? 0 : *std::max_element(clients[1].latency.begin(), clients[1].latency.end());
+    long long slow = clients[0].latency.empty() ? 0 : clients[0].latency[0];
+    if (r.ok && slow < slow_min)
+    {
+        fail(r, "slow download took %lldus, drain throttling not effective (expected >= %lldus)", slow, slow_min);
+    }
+    if (fast_max > limit_us)
+    {
+        fail(r, "requests on the fast connection took up to %lldus while the slow one was draining", fast_max);
+    }
+    report("slow_drain", r);
+    fprintf(out, "    slow download %lldus, fast connection max %lldus\n", slow, fast_max);
+    return r.ok;
+}
+
+// 每个连接把一组请求在一次写入中发出，应当依次得到对应的响应：前一个响应发完时读缓冲区里剩下的请求
+// 直接交给线程池，不等待EPOLLIN。其中一个连接上夹着1MB的文件，响应要经过多次EPOLLOUT
+static bool pipeline()
+{
+    std::vector<client> clients;
+    for (int i = 0; i < 4; ++i)
+    {
+        clients.push_back(make_client());
+        clients.back().pipelined = true;
+        for (int j = 0; j < 10; ++j)
+        {
+            step s = {i == 0 && j == 5 ? "/big.bin" : j % 2 ? "/small.html" : "/health", 0, 0, 0, 0};
+            clients.back().steps.push_back(s);
+        }
+    }
+    result r = run_clients(clients, 0);
+    report("pipeline", r);
+    return r.ok;
+}
+
+struct scenario
+{
+    const char *name;
+    bool (*run)();
+    bool by_default;
+};
+
+static const scenario scenarios[] = {
+    {"basic", basic, true},
+    {"short_read", short_read, true},
+    {"partial_write", partial_write, true},
+    {"slow_drain", slow_drain, true},
+    {"pipeline", pipeline, true},
+};
+
+// 在临时目录中生成网站根目录：小文件和1MB的大文件
+static std::string make_doc_root()
+{
+    char dir[] = "/tmp/conn_harness.XXXXXX";
+    if (!mkdtemp(dir))
+    {
+        return "";
+    }
+    small_body = "<html><body>";
+    for (int i = 0; i < 20; ++i)
+    {
+        small_body += "<p>harness</p>";
+    }
+    small_body += "</body></html>\n";
+    std::string path = std::string(dir) + "/small.html";
+    FILE *f = fopen(path.c_str(), "wb");
+    fwrite(small_body.data(), 1, small_body.size(), f);
+    fclose(f);
+    path = std::string(dir) + "/big.bin";
+    f = fopen(path.c_str(), "wb");
+    for (int i = 0; i < BIG_SIZE; ++i)
+    {
+        fputc(big_byte(i), f);
+    }
+    fclose(f);
+    return dir;
+}
+
+static void remove_doc_root(const std::string &dir)
+{
+    unlink((dir + "/small.html").c_str());
+    unlink((dir + "/big.bin").c_str());
+    rmdir(dir.c_str());
+}
+
+int main(int argc, char *argv[])
+{
+    const char *selected = NULL;
+    bool verbose = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:L:v")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            selected = optarg;
+            break;
+        case 'L':
+            limit_us = atoll(optarg) * 1000;
+            break;
+        case 'v':
+            verbose = true;
+            break;
+        default:
+            printf("按照此格式：%s [-s scenario[,scenario...]] [-L latency_ms] [-v]\n", argv[0]);
+            return -1;
+        }
+    }
+
+    // 测试结果写到标准错误，服务器的日志不影响
+    out = stderr;
+    if (!verbose && !freopen("/dev/null", "w", stdout))
+    {
+        return -1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    std::string root = make_doc_root();
+    if (root.empty())
+    {
+        perror("mkdtemp");
+        return -1;
+    }
+    doc_root = root.c_str();
+    router routes;
+    routes.add(ROUTE_GET, "/health", health_route);
+    http_conn::m_router = &routes;
+
+    users = new http_conn[MAX_FD];
+    epollfd = epoll_create(5);
+    stopfd = eventfd(0, 0);
+    epoll_event event;
+    event.data.u64 = stopfd;
+    event.events = EPOLLIN;
+    epoll_ctl(epollfd, EPOLL_CTL_ADD, stopfd, &event);
+    http_conn::m_epollfd = epollfd;
+    pool = new threadpool<http_conn>(4, 10000);
+
+    int failed = 0, run = 0;
+    for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); ++i)
+    {
+        const scenario &s = scenarios[i];
+        bool wanted = selected ? strstr((std::string(",") + selected + ",").c_str(), (std::string(",") + s.name + ",").c_str()) != NULL
+                               : s.by_default;
+        if (!wanted)
+        {
+            continue;
+        }
+        ++run;
+        if (!s.run())
+        {
+            ++failed;
+        }
+    }
+    fprintf(out, "%d of %d scenarios passed\n", run - failed, run);
+
+    delete pool;
+    remove_doc_root(root);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,575 @@
+// 回放服务器用 -W 录制的流量（格式见capture.h）：按录制时的时间间隔重建每个连接，发送相同的字节，
+// 统计每个HTTP/1.1请求从发出到收到完整响应的延迟。不同连接之间是开环的，按时间表发出，互不等待；
+// 同一连接上服务器不支持流水线，前一个请求的响应到达之前，该连接后面的记录顺延到响应到达时再发。
+// 同一份录制每次回放的请求序列和时间表都相同，可以用来对比性能改动前后的延迟分布。
+//   g++ -O2 -std=c++17 -I. test_presure/replay.cpp -o replay
+//   ./replay -t 127.0.0.1:9006 [-x speed] capture.bin
+//   ./replay -u /tmp/web.sock capture.bin
+// -x 2 表示2倍速，-x 0 表示不等待，所有记录尽快发出（每个连接内部仍按原来的顺序）。
+// 录制的是TLS解密后的明文，回放到明文端口。HTTP/2连接（连接前言或h2c升级）照常回放，但不统计延迟。
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstddef>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "capture.h"
+
+static const long long STALL_US = 10000000; // 这么久没有任何进展就放弃等待剩下的响应
+static const size_t MAX_HEAD = 65536;
+
+struct event
+{
+    long long at_us; // 距录制开始的时间
+    uint32_t conn;
+    int type;
+    const char *data;
+    uint32_t len;
+};
+
+static long long now_us()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000LL + t.tv_nsec / 1000;
+}
+
+// 在头部中查找字段（不区分大小写），返回值的起始位置，没有时返回NULL
+static const char *find_header(const std::string &head, const char *name)
+{
+    size_t len = strlen(name);
+    for (size_t pos = head.find('\n'); pos != std::string::npos; pos = head.find('\n', pos + 1))
+    {
+        if (strncasecmp(head.c_str() + pos + 1, name, len) == 0 && head[pos + 1 + len] == ':')
+        {
+            const char *v = head.c_str() + pos + 2 + len;
+            while (*v == ' ' || *v == '\t')
+            {
+                ++v;
+            }
+            return v;
+        }
+    }
+    return NULL;
+}
+
+// 从发出的字节中找出请求的边界：请求头以空行结束，之后跳过Content-Length个字节的请求体
+struct request_scanner
+{
+    std::string head;
+    long long body_left = 0;
+
+    // 返回本次数据中完整请求头的个数；连接切换到HTTP/2时设置h2
+    int feed(const char *p, size_t n, bool &h2)
+    {
+        int requests = 0;
+        while (n > 0 && !h2)
+        {
+            if (body_left > 0)
+            {
+                size_t skip = std::min((long long)n, body_left);
+                body_left -= skip;
+                p += skip;
+                n -= skip;
+                continue;
+            }
+            head.push_back(*p++);
+            --n;
+            if (head.size() >= 4 && head.compare(head.size() - 4, 4, "\r\n\r\n") == 0)
+            {
+                if (head == "PRI * HTTP/2.0\r\n\r\n")
+                {
+                    h2 = true; // 连接前言，prior knowledge
+                    break;
+                }
+                const char *cl = find_header(head, "Content-Length");
+                body_left = cl ? atoll(cl) : 0;
+                ++requests;
+                head.clear();
+            }
+            else if (head.size() > MAX_HEAD)
+            {
+                head.clear(); // 不是HTTP/1.1，放弃解析
+            }
+        }
+        return requests;
+    }
+};
+
+// 从收到的字节中找出响应的边界：Content-Length或chunked
+struct response_scanner
+{
+    enum STATE
+    {
+        HEAD,
+        BODY,
+        CHUNK_SIZE,
+        CHUNK_DATA,
+        CHUNK_END
+    };
+    STATE state = HEAD;
+    std::string line; // 响应头或chunk的长度行
+    long long left = 0;
+
+    // 返回本次数据中完整响应的个数；收到101时设置h2
+    int feed(const char *p, size_t n, bool &h2)
+    {
+        int responses = 0;
+        while (n > 0 && !h2)
+        {
+            if (state == BODY || state == CHUNK_DATA)
+            {
+                size_t skip = std::min((long long)n, left);
+                left -= skip;
+                p += skip;
+                n -= skip;
+                if (left == 0)
+                {
+                    responses += state == BODY;
+                    state = state == BODY ? HEAD : CHUNK_SIZE;
+                }
+                continue;
+            }
+            line.push_back(*p++);
+            --n;
+            if (state == HEAD)
+            {
+                if (line.size() < 4 || line.compare(line.size() - 4, 4, "\r\n\r\n") != 0)
+                {
+                    continue;
+                }
+                int status = line.size() > 12 ? atoi(line.c_str() + 9) : 0;
+                if (status == 101)
+                {
+                    h2 = true;
+                }
+                else if (status >= 200)
+                {
+                    const char *te = find_header(line, "Transfer-Encoding");
+                    const char *cl = find_header(line, "Content-Length");
+                    if (te && strncasecmp(te, "chunked", 7) == 0)
+                    {
+                        state = CHUNK_SIZE;
+                    }
+                    else if (cl && atoll(cl) > 0)
+                    {
+                        state = BODY;
+                        left = atoll(cl);
+                    }
+                    else
+                    {
+                        ++responses;
+                    }
+                }
+                line.clear();
+            }
+            else if (line.size() >= 2 && line.compare(line.size() - 2, 2, "\r\n") == 0)
+            {
+                if (state == CHUNK_END)
+                {
+                    // 最后一块之后的空行（不支持trailer）
+                    ++responses;
+                    state = HEAD;
+                }
+                else
+                {
+                    left = strtoll(line.c_str(), NULL, 16);
+                    state = left == 0 ? CHUNK_END : CHUNK_DATA;
+                    left += left ? 2 : 0; // 数据之后的CRLF
+                }
+                line.clear();
+            }
+        }
+        return responses;
+    }
+};
+
+struct connection
+{
+    int fd = -1;
+    bool connected = false;
+    bool closing = false; // 录制中客户端已经关闭，发完、收完之后关闭
+    bool h2 = false;
+    std::string out;
+    size_t out_off = 0;
+    request_scanner requests;
+    response_scanner responses;
+    std::deque<long long> pending; // 等待响应的请求的发出时间
+    std::deque<const event *> held; // 等待前一个响应而顺延的记录
+};
+
+struct replay_stats
+{
+    std::vector<long long> latencies;
+    long long requests = 0;
+    long long connect_errors = 0;
+    long long unanswered = 0; // 连接断开或放弃等待时还没有响应的请求
+    long long max_lag_us = 0; // 实际发出时间比时间表晚的最大值
+    long long held = 0;       // 因等待前一个响应而顺延的记录数
+};
+
+static sockaddr_storage target;
+static socklen_t target_len;
+static int epollfd;
+static int open_conns = 0;
+static replay_stats stats;
+
+static void finish(connection &c)
+{
+    if (c.fd >= 0)
+    {
+        stats.unanswered += c.pending.size();
+        c.pending.clear();
+        close(c.fd);
+        c.fd = -1;
+        --open_conns;
+    }
+}
+
+static void flush_out(connection &c)
+{
+    while (c.connected && c.fd >= 0 && c.out_off < c.out.size())
+    {
+        ssize_t n = send(c.fd, c.out.data() + c.out_off, c.out.size() - c.out_off, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno != EAGAIN)
+            {
+                finish(c);
+            }
+            return;
+        }
+        c.out_off += n;
+    }
+    if (c.out_off == c.out.size())
+    {
+        c.out.clear();
+        c.out_off = 0;
+        if (c.closing && c.fd >= 0 && (c.pending.empty() || c.h2))
+        {
+            finish(c);
+        }
+    }
+}
+
+static void open_conn(connection &c)
+{
+    c.fd = socket(target.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c.fd < 0)
+    {
+        ++stats.connect_errors;
+        return;
+    }
+    if (target.ss_family == AF_INET)
+    {
+        int one = 1;
+        setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    if (connect(c.fd, (sockaddr *)&target, target_len) < 0 && errno != EINPROGRESS)
+    {
+        ++stats.connect_errors;
+        close(c.fd);
+        c.fd = -1;
+        return;
+    }
+    ++open_conns;
+    epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.ptr = &c;
+    epoll_ctl(epollfd, EPOLL_CTL_ADD, c.fd, &ev);
+}
+
+// 发送一条DATA或CLOSE记录
+static void apply(connection &c, const event &e, long long now)
+{
+    if (e.type == CAP_DATA)
+    {
+        int n = c.requests.feed(e.data, e.len, c.h2);
+        stats.requests += n;
+        for (int i = 0; i < n && !c.h2; ++i)
+        {
+            c.pending.push_back(now);
+        }
+        c.out.append(e.data, e.len);
+    }
+    else
+    {
+        c.closing = true;
+    }
+    flush_out(c);
+}
+
+// 响应都到达之后，发送顺延的记录，直到又有请求在等待响应
+static void release_held(connection &c, long long now)
+{
+    while (c.fd >= 0 && !c.held.empty() && (c.pending.empty() || c.h2))
+    {
+        const event *e = c.held.front();
+        c.held.pop_front();
+        apply(c, *e, now);
+    }
+}
+
+static void on_event(connection &c, unsigned int events)
+{
+    if (c.fd < 0)
+    {
+        return;
+    }
+    if (!c.connected && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+    {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err)
+        {
+            ++stats.connect_errors;
+            finish(c);
+            return;
+        }
+        c.connected = true;
+    }
+    if (events & EPOLLOUT)
+    {
+        flush_out(c);
+    }
+    if (c.fd >= 0 && (events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+    {
+        char buf[65536];
+        while (c.fd >= 0)
+        {
+            ssize_t n = recv(c.fd, buf, sizeof(buf), 0);
+            if (n < 0 && errno == EAGAIN)
+            {
+                break;
+            }
+            if (n <= 0)
+            {
+                finish(c);
+                break;
+            }
+            long long now = now_us();
+            int done = c.responses.feed(buf, n, c.h2);
+            for (int i = 0; i < done && !c.pending.empty(); ++i)
+            {
+                stats.latencies.push_back(now - c.pending.front());
+                c.pending.pop_front();
+            }
+            if (c.h2)
+            {
+                c.pending.clear(); // 升级之后不再统计
+            }
+            release_held(c, now);
+            if (c.closing && c.pending.empty() && c.out.empty())
+            {
+                finish(c);
+            }
+        }
+    }
+}
+
+static bool load(const char *path, std::vector<char> &file, std::vector<event> &events)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+    {
+        return false;
+    }
+    char chunk[65536];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), fp)) > 0)
+    {
+        file.insert(file.end(), chunk, chunk + n);
+    }
+    fclose(fp);
+    if (file.size() < (size_t)CAPTURE_HEADER_LEN || memcmp(file.data(), CAPTURE_MAGIC, 8) != 0)
+    {
+        errno = EINVAL;
+        return false;
+    }
+    long long at = 0;
+    size_t pos = CAPTURE_HEADER_LEN;
+    while (pos + CAPTURE_RECORD_LEN <= file.size())
+    {
+        const char *p = file.data() + pos;
+        event e;
+        at += traffic_capture::get32(p);
+        e.at_us = at;
+        e.conn = traffic_capture::get32(p + 4);
+        e.type = (unsigned char)p[8];
+        e.len = traffic_capture::get32(p + 9);
+        if (pos + CAPTURE_RECORD_LEN + e.len > file.size())
+        {
+            break; // 录制被中断，最后一条不完整
+        }
+        e.data = p + CAPTURE_RECORD_LEN;
+        events.push_back(e);
+        pos += CAPTURE_RECORD_LEN + e.len;
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *tcp_spec = NULL;
+    const char *unix_path = NULL;
+    double speed = 1.0;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:u:x:")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            tcp_spec = optarg;
+            break;
+        case 'u':
+            unix_path = optarg;
+            break;
+        case 'x':
+            speed = atof(optarg);
+            break;
+        default:
+            break;
+        }
+    }
+    if ((!tcp_spec == !unix_path) || optind >= argc || speed < 0)
+    {
+        printf("按照此格式：%s (-t ip:port | -u unix_path) [-x speed] capture_file\n", argv[0]);
+        return -1;
+    }
+
+    memset(&target, 0, sizeof(target));
+    if (tcp_spec)
+    {
+        sockaddr_in *in = (sockaddr_in *)&target;
+        std::string spec(tcp_spec);
+        size_t colon = spec.rfind(':');
+        in->sin_family = AF_INET;
+        if (colon == std::string::npos || inet_pton(AF_INET, spec.substr(0, colon).c_str(), &in->sin_addr) != 1)
+        {
+            printf("无效的地址：%s\n", tcp_spec);
+            return -1;
+        }
+        in->sin_port = htons(atoi(spec.c_str() + colon + 1));
+        target_len = sizeof(*in);
+    }
+    else
+    {
+        sockaddr_un *un = (sockaddr_un *)&target;
+        size_t len = strlen(unix_path);
+        if (len == 0 || len >= sizeof(un->sun_path))
+        {
+            printf("无效的路径：%s\n", unix_path);
+            return -1;
+        }
+        un->sun_family = AF_UNIX;
+        memcpy(un->sun_path, unix_path, len);
+        if (unix_path[0] == '@')
+        {
+            un->sun_path[0] = '\0';
+        }
+        target_len = offsetof(sockaddr_un, sun_path) + len;
+    }
+
+    std::vector<char> file;
+    std::vector<event> events;
+    if (!load(argv[optind], file, events))
+    {
+        printf("读取录制文件 %s 失败：%s\n", argv[optind], strerror(errno));
+        return -1;
+    }
+    printf("%zu records, %.1fs recorded\n", events.size(), events.empty() ? 0.0 : events.back().at_us / 1e6);
+
+    epollfd = epoll_create1(0);
+    std::unordered_map<uint32_t, connection> conns;
+    epoll_event ready[256];
+    size_t next = 0;
+    long long start = now_us();
+    long long progress = start; // 最近一次发出记录或收到数据的时间
+    while (next < events.size() || open_conns > 0)
+    {
+        long long now = now_us();
+        while (next < events.size())
+        {
+            const event &e = events[next];
+            long long due = speed > 0 ? start + (long long)(e.at_us / speed) : now;
+            if (due > now)
+            {
+                break;
+            }
+            stats.max_lag_us = std::max(stats.max_lag_us, now - due);
+            connection &c = conns[e.conn];
+            if (e.type == CAP_OPEN)
+            {
+                open_conn(c);
+            }
+            else if (c.fd >= 0 && !c.h2 && (!c.pending.empty() || !c.held.empty()))
+            {
+                c.held.push_back(&e);
+                ++stats.held;
+            }
+            else if (c.fd >= 0)
+            {
+                apply(c, e, now);
+            }
+            ++next;
+            progress = now;
+        }
+
+        int timeout = 100;
+        if (next < events.size() && speed > 0)
+        {
+            long long wait = start + (long long)(events[next].at_us / speed) - now;
+            timeout = wait <= 0 ? 0 : (int)std::min(100LL, (wait + 999) / 1000);
+        }
+        int num = epoll_wait(epollfd, ready, 256, timeout);
+        for (int i = 0; i < num; ++i)
+        {
+            on_event(*(connection *)ready[i].data.ptr, ready[i].events);
+            progress = now_us();
+        }
+        if (next == events.size() && now_us() - progress > STALL_US)
+        {
+            break; // 剩下的连接既没有响应也没有关闭（比如录制结束时还开着的keep-alive连接）
+        }
+    }
+    long long elapsed = progress - start; // 不算最后等待超时的时间
+    for (std::unordered_map<uint32_t, connection>::iterator it = conns.begin(); it != conns.end(); ++it)
+    {
+        finish(it->second);
+    }
+
+    std::vector<long long> &l = stats.latencies;
+    std::sort(l.begin(), l.end());
+    printf("replayed %zu connections in %.2fs (speed %gx), max schedule lag %.1fms\n", conns.size(), elapsed / 1e6,
+           speed, stats.max_lag_us / 1000.0);
+    printf("requests %lld, responses %zu, unanswered %lld, connect errors %lld, held records %lld, %.0f req/s\n",
+           stats.requests, l.size(), stats.unanswered, stats.connect_errors, stats.held,
+           elapsed > 0 ? l.size() / (elapsed / 1e6) : 0.0);
+    if (!l.empty())
+    {
+        long long sum = 0;
+        for (size_t i = 0; i < l.size(); ++i)
+        {
+            sum += l[i];
+        }
+        size_t m = l.size();
+        printf("latency  avg %.1fus p50 %lldus p90 %lldus p99 %lldus p99.9 %lldus max %lldus\n", (double)sum / m,
+               l[m / 2], l[m * 9 / 10], l[m * 99 / 100], l[std::min(m - 1, m * 999 / 1000)], l[m - 1]);
+    }
+    return 0;
+}
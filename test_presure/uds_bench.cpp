@@ -0,0 +1,316 @@
+// 比较回环TCP和Unix域套接字上的延迟和吞吐量，服务器用 -U 同时监听两者：
+//   ./server -U /tmp/web.sock 9006
+//   g++ -O2 -std=c++17 test_presure/uds_bench.cpp -lpthread -o uds_bench
+//   ./uds_bench -t 127.0.0.1:9006 -u /tmp/web.sock [-p /index.html] [-n 20000] [-c 32] [-d 5]
+// 延迟：单个keep-alive连接上逐个发送n个请求，统计每个请求的往返时间。
+// 吞吐量：c个线程各自一个keep-alive连接，持续d秒，统计每秒完成的请求数。
+// -u 的路径以@开头时连接抽象命名空间。
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstddef>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <vector>
+
+struct target
+{
+    bool is_unix;
+    sockaddr_in in;
+    sockaddr_un un;
+    socklen_t un_len;
+};
+
+static const char *path = "/index.html";
+static char request[1024];
+static int request_len;
+static volatile bool stop_flag = false;
+
+static long long now_ns()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+static int connect_to(const target &t)
+{
+    int fd;
+    if (t.is_unix)
+    {
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd >= 0 && connect(fd, (const sockaddr *)&t.un, t.un_len) < 0)
+        {
+            close(fd);
+            return -1;
+        }
+    }
+    else
+    {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (fd >= 0 && connect(fd, (const sockaddr *)&t.in, sizeof(t.in)) < 0)
+        {
+            close(fd);
+            return -1;
+        }
+    }
+    return fd;
+}
+
+// 发送一个请求并读完整个响应（按Content-Length），失败返回false
+static bool round_trip(int fd, char *buf, int size)
+{
+    if (send(fd, request, request_len, MSG_NOSIGNAL) != request_len)
+    {
+        return false;
+    }
+    int have = 0;
+    long long body = -1;
+    int head = 0;
+    while (true)
+    {
+        ssize_t n = recv(fd, buf + have, size - have - 1, 0);
+        if (n <= 0)
+        {
+            return false;
+        }
+        have += n;
+        buf[have] = '\0';
+        if (body < 0)
+        {
+            char *end = strstr(buf, "\r\n\r\n");
+            if (!end)
+            {
+                if (have >= size - 1)
+                {
+                    return false;
+                }
+                continue;
+            }
+            head = end + 4 - buf;
+            char *cl = strcasestr(buf, "Content-Length:");
+            if (!cl || cl > end || strncmp(buf + 9, "200", 3) != 0)
+            {
+                return false;
+            }
+            body = atoll(cl + 15);
+        }
+        if (have - head >= body)
+        {
+            return true;
+        }
+        // 响应体比缓冲区大时丢弃已读到的部分
+        if (have >= size - 1)
+        {
+            body -= have - head;
+            have = head = 0;
+        }
+    }
+}
+
+static void latency(const char *name, const target &t, int n)
+{
+    int fd = connect_to(t);
+    if (fd < 0)
+    {
+        printf("%-5s connect failed: %s\n", name, strerror(errno));
+        return;
+    }
+    std::vector<long long> samples;
+    samples.reserve(n);
+    static char buf[65536];
+    for (int i = 0; i < n; ++i)
+    {
+        long long start = now_ns();
+        if (!round_trip(fd, buf, sizeof(buf)))
+        {
+            printf("%-5s request %d failed\n", name, i);
+            break;
+        }
+        samples.push_back(now_ns() - start);
+    }
+    close(fd);
+    if (samples.empty())
+    {
+        return;
+    }
+    std::sort(samples.begin(), samples.end());
+    long long sum = 0;
+    for (size_t i = 0; i < samples.size(); ++i)
+    {
+        sum += samples[i];
+    }
+    size_t m = samples.size();
+    printf("%-5s latency  n=%zu avg %.1fus p50 %.1fus p99 %.1fus p99.9 %.1fus max %.1fus\n", name, m,
+           sum / 1000.0 / m, samples[m / 2] / 1000.0, samples[m * 99 / 100] / 1000.0,
+           samples[std::min(m - 1, m * 999 / 1000)] / 1000.0, samples[m - 1] / 1000.0);
+}
+
+struct worker_arg
+{
+    const target *t;
+    long long done;
+    bool failed;
+};
+
+static void *worker(void *arg)
+{
+    worker_arg *w = (worker_arg *)arg;
+    int fd = connect_to(*w->t);
+    if (fd < 0)
+    {
+        w->failed = true;
+        return NULL;
+    }
+    char buf[65536];
+    while (!stop_flag)
+    {
+        if (!round_trip(fd, buf, sizeof(buf)))
+        {
+            w->failed = true;
+            break;
+        }
+        ++w->done;
+    }
+    close(fd);
+    return NULL;
+}
+
+static void throughput(const char *name, const target &t, int clients, int seconds)
+{
+    std::vector<pthread_t> threads(clients);
+    std::vector<worker_arg> args(clients);
+    stop_flag = false;
+    for (int i = 0; i < clients; ++i)
+    {
+        args[i].t = &t;
+        args[i].done = 0;
+        args[i].failed = false;
+        pthread_create(&threads[i], NULL, worker, &args[i]);
+    }
+    long long start = now_ns();
+    sleep(seconds);
+    stop_flag = true;
+    long long total = 0;
+    int failed = 0;
+    for (int i = 0; i < clients; ++i)
+    {
+        pthread_join(threads[i], NULL);
+        total += args[i].done;
+        failed += args[i].failed;
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+    printf("%-5s throughput c=%d %.0f req/s (%lld requests, %d connections failed)\n", name, clients,
+           total / elapsed, total, failed);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *tcp_spec = NULL;
+    const char *unix_path = NULL;
+    int n = 20000;
+    int clients = 32;
+    int seconds = 5;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:u:p:n:c:d:")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            tcp_spec = optarg;
+            break;
+        case 'u':
+            unix_path = optarg;
+            break;
+        case 'p':
+            path = optarg;
+            break;
+        case 'n':
+            n = atoi(optarg);
+            break;
+        case 'c':
+            clients = atoi(optarg);
+            break;
+        case 'd':
+            seconds = atoi(optarg);
+            break;
+        default:
+            break;
+        }
+    }
+    if ((!tcp_spec && !unix_path) || n <= 0 || clients <= 0 || seconds <= 0)
+    {
+        printf("按照此格式：%s [-t ip:port] [-u unix_path] [-p url] [-n requests] [-c clients] [-d seconds]\n", argv[0]);
+        return -1;
+    }
+    request_len = snprintf(request, sizeof(request),
+                           "GET %s HTTP/1.1\r\nHost: localhost\r\nConnection: keep-alive\r\n\r\n", path);
+
+    target tcp, uds;
+    memset(&tcp, 0, sizeof(tcp));
+    memset(&uds, 0, sizeof(uds));
+    if (tcp_spec)
+    {
+        char ip[64];
+        const char *colon = strrchr(tcp_spec, ':');
+        if (!colon || colon - tcp_spec >= (int)sizeof(ip))
+        {
+            printf("无效的地址：%s\n", tcp_spec);
+            return -1;
+        }
+        memcpy(ip, tcp_spec, colon - tcp_spec);
+        ip[colon - tcp_spec] = '\0';
+        tcp.in.sin_family = AF_INET;
+        tcp.in.sin_port = htons(atoi(colon + 1));
+        if (inet_pton(AF_INET, ip, &tcp.in.sin_addr) != 1)
+        {
+            printf("无效的地址：%s\n", tcp_spec);
+            return -1;
+        }
+    }
+    if (unix_path)
+    {
+        size_t len = strlen(unix_path);
+        if (len == 0 || len >= sizeof(uds.un.sun_path))
+        {
+            printf("无效的路径：%s\n", unix_path);
+            return -1;
+        }
+        uds.is_unix = true;
+        uds.un.sun_family = AF_UNIX;
+        memcpy(uds.un.sun_path, unix_path, len);
+        if (unix_path[0] == '@')
+        {
+            uds.un.sun_path[0] = '\0';
+        }
+        uds.un_len = offsetof(sockaddr_un, sun_path) + len;
+    }
+
+    if (tcp_spec)
+    {
+        latency("tcp", tcp, n);
+    }
+    if (unix_path)
+    {
+        latency("unix", uds, n);
+    }
+    if (tcp_spec)
+    {
+        throughput("tcp", tcp, clients, seconds);
+    }
+    if (unix_path)
+    {
+        throughput("unix", uds, clients, seconds);
+    }
+    return 0;
+}
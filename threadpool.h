@@ -4,121 +4,598 @@
 #include <pthread.h>
 #include<cstdio>
 #include <list>
+#include <vector>
+#include <time.h>
+#include <stdint.h>
+#include <sched.h>
+#include <unistd.h>
 //#include <semaphore.h>
 #include<exception>
 #include "locker.h"
+#include "affinity.h"
+
+// 任务类别。T::process()返回TASK_DONE表示任务已处理完；返回某个类别时，任务以原句柄重新排进该类别的队列，
+// 用于在解析之后才知道代价的任务（大文件）：所有任务先按高优先级排队，解析完发现代价高的再排进低优先级队列
+enum task_class
+{
+    TASK_DONE = -1,
+    TASK_HIGH = 0, // 廉价的任务，以及还没有分类的任务
+    TASK_LOW,      // 代价高的任务
+    TASK_CLASSES
+};
+
+// 线程池的运行统计，用于观察扩缩容的决策
+struct threadpool_stats
+{
+    int live_threads;        // 当前存活的线程数
+    int busy_threads;        // 正在处理任务的线程数
+    int peak_threads;        // 历史最大线程数
+    int queue_size;          // 排队中的任务数
+    long long avg_wait_us;   // 任务排队时间的滑动平均（微秒）
+    long long grow_count;    // 因排队延迟升高而扩容的次数
+    long long shrink_count;  // 因空闲超时而回收线程的次数
+    long long stale_count;   // 出队时连接已经关闭而被丢弃的任务数
+    long long spin_wakeups;  // 忙等期间拿到任务的次数
+    long long yield_wakeups; // 让出CPU之后拿到任务的次数
+    long long park_wakeups;  // 睡眠在信号量上之后被唤醒的次数
+    long long expected_gap_us; // 估算的空闲线程等到下一个任务的时间
+    int reserved_threads;    // 只处理高优先级任务的线程数
+    int class_queue[TASK_CLASSES];         // 各类别排队中的任务数
+    long long class_tasks[TASK_CLASSES];   // 各类别出队的任务数
+    long long class_wait_us[TASK_CLASSES]; // 各类别排队时间的滑动平均（微秒）
+};
+
+// 忙等循环中降低功耗、让出流水线给同核的超线程
+inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield" ::: "memory");
+#else
+    asm volatile("" ::: "memory");
+#endif
+}
 
 // 线程池类，将它定义为模板类是为了代码复用，模板参数T是任务类
+// 任务和句柄一起排队，出队时先用T::valid(handle)检查，对象已经被关闭或换给了别的连接时丢弃任务，不调用process
+// 每个NUMA节点一个请求队列：工作线程优先处理本节点的任务，本节点没有任务时再去其他节点取，
+// 这样在绑定了CPU的情况下，连接对象只会在同一个socket内的核之间传递
+// 线程数在[thread_number, max_thread_number]之间伸缩：没有空闲线程且排队延迟超过阈值时扩容，
+// 线程空闲超过idle_timeout_ms后退出（不低于thread_number个），析构时回收所有线程
+// 等待任务时先忙等再睡眠：append按任务到达的间隔和空闲线程数估算一个空闲线程还要等多久才有任务，
+// 估计值不超过spin_us时先用pause忙等（最多约两倍估计值，不超过spin_us），再sched_yield几次，仍没有任务才睡眠在信号量上。
+// 忙等期间拿到任务时省去了futex唤醒和调度的延迟，append的sem_post也不需要系统调用；
+// 负载低时估计值大，线程直接睡眠，空闲时不消耗CPU。spin_us为0时总是直接睡眠
+// 线程处理完一个任务后，队列中还有任务就直接取下一个，不再等待信号量；因此append_batch一次入队多个任务时
+// 只需唤醒与空闲线程数相当的线程，其余的由正在忙的线程处理完手上的任务后取走
+// 任务分高低两个优先级（见task_class），各自按NUMA节点排队。线程先取高优先级任务，但高优先级队列一直非空时，
+// 每连续取HIGH_WEIGHT个高优先级任务就取一个低优先级任务，避免饿死；同时处理低优先级任务的线程不超过m_live - m_reserved个，
+// 保留的线程始终可以处理廉价任务，大文件请求再多也不会让健康检查之类的请求排在它们后面
 template <typename T>
 class threadpool
 {
 private:
-    int m_thread_number;        // 线程的数量
-    pthread_t *m_threads;        // 描述线程池的数组，大小为m_thread_number    
+    enum SLOT_STATE
+    {
+        SLOT_EMPTY = 0, // 未使用
+        SLOT_RUNNING,   // 线程运行中
+        SLOT_EXITED     // 线程已退出，等待pthread_join
+    };
+
+    struct worker_arg
+    {
+        threadpool *pool;
+        int index;
+    };
+
+    enum WAKE
+    {
+        WAKE_SPIN = 0, // 忙等期间拿到
+        WAKE_YIELD,    // 让出CPU之后拿到
+        WAKE_PARK,     // 睡眠后被唤醒
+        WAKE_TIMEOUT   // 空闲超时
+    };
+
+    static const int YIELD_ROUNDS = 4;            // 忙等之后sched_yield的次数
+    static const long long IDLE_GAP_US = 1000000; // 任务到达间隔的上限，超过的按这个值计入平均
+    static const int HIGH_WEIGHT = 8;             // 低优先级任务在排队时，连续取这么多个高优先级任务后取一个低优先级任务
+
+    struct task
+    {
+        T *request;
+        uint64_t handle;      // 入队时的连接句柄
+        long long enqueue_us; // 入队时间
+    };
+
+    int m_thread_number;        // 最少保留的线程数量
+    int m_max_thread_number;    // 最多允许的线程数量
+    int m_idle_timeout_ms;      // 线程空闲多久后退出，0表示不回收
+    long long m_grow_wait_us;   // 排队延迟超过该值时扩容
+    pthread_t *m_threads;        // 描述线程池的数组，大小为m_max_thread_number
+    worker_arg *m_args;          // 传给每个线程的参数
+    SLOT_STATE *m_slots;         // 每个线程槽的状态
+    std::vector<int> m_cpus;     // 工作线程绑定的CPU，为空表示不绑定，第i个线程绑定到m_cpus[i % size]
+    std::vector<int> m_nodes;    // 第i个线程所在的NUMA节点
     int m_max_requests;         // 请求队列中最多允许的、等待处理的请求的数量
-    std::list<T *> m_workqueue; // 请求队列
-    locker m_queuelocker;       // 保护请求队列的互斥锁
+    int m_queue_size;           // 所有队列中的请求总数
+    std::vector<std::list<task> > m_workqueues[TASK_CLASSES]; // 请求队列，每个类别每个NUMA节点一个
+    int m_class_size[TASK_CLASSES]; // 各类别排队中的任务数
+    locker m_queuelocker;       // 保护请求队列以及下面这些统计量的互斥锁
     sem m_queuestat;            // 是否有任务需要处理
     bool m_stop;                // 是否结束线程
+    int m_live;                 // 存活的线程数
+    int m_busy;                 // 正在处理任务的线程数
+    int m_peak;                 // 历史最大线程数
+    long long m_avg_wait_us;    // 排队时间的滑动平均
+    long long m_grow_count;
+    long long m_shrink_count;
+    long long m_stale_count;
+    int m_spin_us;              // 忙等的上限（微秒）
+    long long m_last_enqueue_us; // 上一个任务入队的时间
+    long long m_avg_gap_us;     // 任务到达间隔的滑动平均
+    long long m_expected_gap_us; // 空闲线程预计要等多久才有任务，append在锁内写，工作线程不加锁读
+    long long m_wakeups[WAKE_TIMEOUT]; // 按WAKE分类的唤醒次数
+    int m_reserved;             // 只处理高优先级任务的线程数
+    int m_busy_low;             // 正在处理低优先级任务的线程数
+    int m_high_streak;          // 低优先级任务排队期间连续取高优先级任务的次数
+    long long m_class_wait_us[TASK_CLASSES]; // 各类别排队时间的滑动平均
+    long long m_class_tasks[TASK_CLASSES];   // 各类别出队的任务数
 
 private:
     static void* worker(void* arg);
-    void run();
+    void run(int index);
+    int queue_index(int node) const;
+    void grow_if_needed(long long now, int node); // 调用者需持有m_queuelocker
+    void note_arrivals(long long now, int count); // 更新到达间隔和空闲线程的预计等待时间，调用者需持有m_queuelocker
+    bool spawn();               // 新建一个工作线程，调用者需持有m_queuelocker
+    bool take(int node, task &t, int &cls, int &queue); // 按优先级取一个本线程可以处理的任务，调用者需持有m_queuelocker
+    WAKE wait_task();           // 等待信号量：忙等、让出CPU、睡眠
+    static long long now_us();
 public:
-    threadpool(int thread_number = 8, int max_request = 10000);
+    struct batch_item
+    {
+        T *request;
+        uint64_t handle;
+        int node;
+    };
+
+    threadpool(int thread_number = 8, int max_request = 10000,
+               const std::vector<int> &cpus = std::vector<int>(),
+               int max_thread_number = 0, int idle_timeout_ms = 0, int grow_wait_us = 1000, int spin_us = 0,
+               int reserved = 0);
     ~threadpool();
-    bool append(T *request); // 添加任务
+    bool append(T *request, uint64_t handle, int node = -1); // 添加任务，node为该连接所在的NUMA节点，-1表示未知
+    // 批量添加（一次epoll_wait得到的所有读事件）：只加一次锁，最多唤醒min(count, 空闲线程数)个线程。
+    // 返回入队的个数n，前n个已入队，其余的因队列已满被拒绝
+    int append_batch(const batch_item *items, int count);
+    void get_stats(threadpool_stats &stats);
 };
 
 template <typename T>
-threadpool<T>::threadpool(int thread_number, int max_request):
-    m_thread_number(thread_number), m_max_requests(max_request),
-    m_stop(false), m_threads(NULL)
+threadpool<T>::threadpool(int thread_number, int max_request, const std::vector<int> &cpus,
+                          int max_thread_number, int idle_timeout_ms, int grow_wait_us, int spin_us, int reserved):
+    m_thread_number(thread_number), m_max_thread_number(max_thread_number),
+    m_idle_timeout_ms(idle_timeout_ms), m_grow_wait_us(grow_wait_us),
+    m_threads(NULL), m_args(NULL), m_slots(NULL), m_cpus(cpus),
+    m_max_requests(max_request), m_queue_size(0), m_stop(false),
+    m_live(0), m_busy(0), m_peak(0), m_avg_wait_us(0), m_grow_count(0), m_shrink_count(0), m_stale_count(0),
+    m_spin_us(spin_us), m_last_enqueue_us(now_us()), m_avg_gap_us(IDLE_GAP_US), m_expected_gap_us(IDLE_GAP_US),
+    m_reserved(reserved), m_busy_low(0), m_high_streak(0)
     {
-        if((thread_number <= 0) || (max_request <= 0))
+        // 保留的线程必须少于最少线程数，否则低优先级任务永远没有线程处理
+        if((thread_number <= 0) || (max_request <= 0) || (spin_us < 0) || (reserved < 0) || (reserved >= thread_number))
         {
             throw std::exception();
         }
-
-        m_threads = new pthread_t[m_thread_number];
-        if(!m_threads)
+        if(m_max_thread_number < m_thread_number)
         {
-            throw std::exception();
+            m_max_thread_number = m_thread_number; // 未配置上限时线程数固定
         }
-        // 创建thread_number 个线程，并将他们设置为脱离线程
-        for(int i = 0; i < thread_number; ++i)
+        if(sysconf(_SC_NPROCESSORS_ONLN) < 2)
         {
-            printf("Create the %dth thread.\n",i);
+            m_spin_us = 0; // 单核上忙等只会占住生产任务的reactor线程
+        }
 
-            if(pthread_create(m_threads + i, NULL, worker, this) != 0)
+        for(int i = 0; i < WAKE_TIMEOUT; ++i)
+        {
+            m_wakeups[i] = 0;
+        }
+        for(int i = 0; i < TASK_CLASSES; ++i)
+        {
+            m_workqueues[i].resize(numa_node_count());
+            m_class_size[i] = 0;
+            m_class_wait_us[i] = 0;
+            m_class_tasks[i] = 0;
+        }
+        m_nodes.resize(m_max_thread_number, 0);
+        m_threads = new pthread_t[m_max_thread_number];
+        m_args = new worker_arg[m_max_thread_number];
+        m_slots = new SLOT_STATE[m_max_thread_number];
+        for(int i = 0; i < m_max_thread_number; ++i)
+        {
+            m_args[i].pool = this;
+            m_args[i].index = i;
+            m_slots[i] = SLOT_EMPTY;
+            if(!m_cpus.empty())
             {
-                delete [] m_threads;
-                throw std::exception();
+                m_nodes[i] = cpu_to_node(m_cpus[i % m_cpus.size()]);
             }
+        }
 
-            if(pthread_detach(m_threads[i]))
+        // 创建thread_number 个线程
+        m_queuelocker.lock();
+        for(int i = 0; i < thread_number; ++i)
+        {
+            if(!spawn())
             {
-                delete [] m_threads;
+                m_queuelocker.unlock();
                 throw std::exception();
             }
         }
+        m_queuelocker.unlock();
     }
 
 template <typename T>
 threadpool<T>::~threadpool()
 {
-    delete[] m_threads;
+    m_queuelocker.lock();
     m_stop = true;
+    int live = m_live;
+    m_queuelocker.unlock();
+    for(int i = 0; i < live; ++i)
+    {
+        m_queuestat.post();
+    }
+    for(int i = 0; i < m_max_thread_number; ++i)
+    {
+        if(m_slots[i] != SLOT_EMPTY)
+        {
+            pthread_join(m_threads[i], NULL);
+        }
+    }
+    delete[] m_threads;
+    delete[] m_args;
+    delete[] m_slots;
+}
+
+template <typename T>
+long long threadpool<T>::now_us()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (long long)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+template <typename T>
+bool threadpool<T>::spawn()
+{
+    int slot = -1;
+    for(int i = 0; i < m_max_thread_number; ++i)
+    {
+        if(m_slots[i] == SLOT_EXITED)
+        {
+            // 回收已经退出的线程后复用这个槽
+            pthread_join(m_threads[i], NULL);
+            m_slots[i] = SLOT_EMPTY;
+        }
+        if(m_slots[i] == SLOT_EMPTY)
+        {
+            slot = i;
+            break;
+        }
+    }
+    if(slot < 0)
+    {
+        return false;
+    }
+
+    printf("Create the %dth thread.\n", slot);
+    if(pthread_create(m_threads + slot, NULL, worker, m_args + slot) != 0)
+    {
+        return false;
+    }
+    if(!m_cpus.empty() && !bind_thread_cpu(m_threads[slot], m_cpus[slot % m_cpus.size()]))
+    {
+        printf("bind the %dth thread to cpu %d failed.\n", slot, m_cpus[slot % m_cpus.size()]);
+    }
+    m_slots[slot] = SLOT_RUNNING;
+    ++m_live;
+    if(m_live > m_peak)
+    {
+        m_peak = m_live;
+    }
+    return true;
 }
 
 template <typename T>
-bool threadpool<T>::append(T* request)
+int threadpool<T>::queue_index(int node) const
 {
+    // 没有绑核时所有线程都视为节点0，任务统一进入0号队列
+    if(m_cpus.empty() || node < 0 || node >= (int)m_workqueues[TASK_HIGH].size())
+    {
+        return 0;
+    }
+    return node;
+}
+
+template <typename T>
+void threadpool<T>::note_arrivals(long long now, int count)
+{
+    // 任务平均每m_avg_gap_us到达一个，在空闲线程之间轮流分配，每个空闲线程大约要等 间隔 * 空闲线程数。
+    // 一批任务按在这段时间内均匀到达计
+    long long gap = (now - m_last_enqueue_us) / count;
+    m_last_enqueue_us = now;
+    m_avg_gap_us += ((gap < IDLE_GAP_US ? gap : IDLE_GAP_US) - m_avg_gap_us) / 8;
+    int idle = m_live - m_busy - m_queue_size;
+    __atomic_store_n(&m_expected_gap_us, m_avg_gap_us * (idle > 1 ? idle : 1), __ATOMIC_RELAXED);
+}
+
+template <typename T>
+void threadpool<T>::grow_if_needed(long long now, int node)
+{
+    // 所有线程都在忙、新任务必须排队，且排队延迟（最近的平均值或队首任务已等待的时间）超过阈值，则扩容
+    if(m_live < m_max_thread_number && m_busy + m_queue_size > m_live &&
+       (m_avg_wait_us >= m_grow_wait_us || now - m_workqueues[TASK_HIGH][node].front().enqueue_us >= m_grow_wait_us))
+    {
+        if(spawn())
+        {
+            ++m_grow_count;
+            printf("threadpool grow to %d threads, avg wait %lldus, queue %d.\n", m_live, m_avg_wait_us, m_queue_size);
+        }
+    }
+}
+
+template <typename T>
+bool threadpool<T>::append(T* request, uint64_t handle, int node)
+{
+    node = queue_index(node);
+
+    task t;
+    t.request = request;
+    t.handle = handle;
+    t.enqueue_us = now_us();
+
     m_queuelocker.lock();
-    if(m_workqueue.size() > m_max_requests)
+    if(m_queue_size > m_max_requests)
     {
         m_queuelocker.unlock();
         return false;
     }
 
-    m_workqueue.push_back(request);
+    m_workqueues[TASK_HIGH][node].push_back(t);
+    ++m_queue_size;
+    ++m_class_size[TASK_HIGH];
+    note_arrivals(t.enqueue_us, 1);
+    grow_if_needed(t.enqueue_us, node);
     m_queuelocker.unlock();
     m_queuestat.post();
     return true;
 }
 
+template <typename T>
+int threadpool<T>::append_batch(const batch_item *items, int count)
+{
+    if(count <= 0)
+    {
+        return 0;
+    }
+    task t;
+    t.enqueue_us = now_us();
+
+    m_queuelocker.lock();
+    int accepted = 0;
+    int last_node = 0;
+    while(accepted < count && m_queue_size <= m_max_requests)
+    {
+        last_node = queue_index(items[accepted].node);
+        t.request = items[accepted].request;
+        t.handle = items[accepted].handle;
+        m_workqueues[TASK_HIGH][last_node].push_back(t);
+        ++m_queue_size;
+        ++accepted;
+    }
+    if(accepted == 0)
+    {
+        m_queuelocker.unlock();
+        return 0;
+    }
+    m_class_size[TASK_HIGH] += accepted;
+    note_arrivals(t.enqueue_us, accepted);
+    grow_if_needed(t.enqueue_us, last_node);
+    // 没有在处理任务的线程都可能在等信号量，多唤醒的只会在发现队列为空后继续等待
+    int idle = m_live - m_busy;
+    int wake = accepted < idle ? accepted : idle;
+    m_queuelocker.unlock();
+    for(int i = 0; i < wake; ++i)
+    {
+        m_queuestat.post();
+    }
+    return accepted;
+}
+
+template <typename T>
+void threadpool<T>::get_stats(threadpool_stats &stats)
+{
+    m_queuelocker.lock();
+    stats.live_threads = m_live;
+    stats.busy_threads = m_busy;
+    stats.peak_threads = m_peak;
+    stats.queue_size = m_queue_size;
+    stats.avg_wait_us = m_avg_wait_us;
+    stats.grow_count = m_grow_count;
+    stats.shrink_count = m_shrink_count;
+    stats.stale_count = m_stale_count;
+    stats.spin_wakeups = m_wakeups[WAKE_SPIN];
+    stats.yield_wakeups = m_wakeups[WAKE_YIELD];
+    stats.park_wakeups = m_wakeups[WAKE_PARK];
+    stats.expected_gap_us = m_expected_gap_us;
+    stats.reserved_threads = m_reserved;
+    for(int i = 0; i < TASK_CLASSES; ++i)
+    {
+        stats.class_queue[i] = m_class_size[i];
+        stats.class_tasks[i] = m_class_tasks[i];
+        stats.class_wait_us[i] = m_class_wait_us[i];
+    }
+    m_queuelocker.unlock();
+}
+
 template <typename T>
 void* threadpool<T>::worker(void* arg)
 {
-    threadpool* pool = (threadpool*) arg;
-    pool->run();
+    worker_arg* warg = (worker_arg*) arg;
+    threadpool* pool = warg->pool;
+    pool->run(warg->index);
     return pool;
 }
 
 template <typename T>
-void threadpool<T>::run()
+typename threadpool<T>::WAKE threadpool<T>::wait_task()
 {
-    while(!m_stop)
+    long long expected = __atomic_load_n(&m_expected_gap_us, __ATOMIC_RELAXED);
+    if(m_spin_us > 0 && expected <= m_spin_us)
     {
-        m_queuestat.wait();
-        m_queuelocker.lock();
-        if(m_workqueue.empty())
+        // 按时间而不是次数限制忙等，pause的耗时在不同的CPU上相差十倍以上
+        long long budget = expected * 2 < m_spin_us ? expected * 2 : m_spin_us;
+        long long deadline = now_us() + (budget > 1 ? budget : 1);
+        for(int i = 1; ; ++i)
         {
-            m_queuelocker.unlock();
-            continue;
+            if(m_queuestat.trywait())
+            {
+                return WAKE_SPIN;
+            }
+            cpu_relax();
+            if((i & 63) == 0 && now_us() >= deadline)
+            {
+                break;
+            }
+        }
+        for(int i = 0; i < YIELD_ROUNDS; ++i)
+        {
+            sched_yield();
+            if(m_queuestat.trywait())
+            {
+                return WAKE_YIELD;
+            }
         }
+    }
+    bool got = (m_idle_timeout_ms > 0) ? m_queuestat.timedwait(m_idle_timeout_ms) : m_queuestat.wait();
+    return got ? WAKE_PARK : WAKE_TIMEOUT;
+}
 
-        T* request = m_workqueue.front();
-        m_workqueue.pop_front();
-        m_queuelocker.unlock();
+template <typename T>
+bool threadpool<T>::take(int node, task &t, int &cls, int &queue)
+{
+    // 正在处理低优先级任务的线程已经达到上限时，本线程只能取高优先级任务
+    bool low_ok = m_class_size[TASK_LOW] > 0 && m_busy_low < m_live - m_reserved;
+    bool low_first = low_ok && (m_class_size[TASK_HIGH] == 0 || m_high_streak >= HIGH_WEIGHT);
+    int queue_count = m_workqueues[TASK_HIGH].size();
+    for(int k = 0; k < TASK_CLASSES; ++k)
+    {
+        cls = low_first ? TASK_CLASSES - 1 - k : k;
+        if(cls == TASK_LOW && !low_ok)
+        {
+            continue;
+        }
+        // 先取本节点队列，空的话依次从其他节点的队列里取
+        for(int i = 0; i < queue_count; ++i)
+        {
+            queue = (node + i) % queue_count;
+            std::list<task> &q = m_workqueues[cls][queue];
+            if(!q.empty())
+            {
+                t = q.front();
+                q.pop_front();
+                --m_queue_size;
+                --m_class_size[cls];
+                long long wait = now_us() - t.enqueue_us;
+                m_avg_wait_us += (wait - m_avg_wait_us) / 8;
+                m_class_wait_us[cls] += (wait - m_class_wait_us[cls]) / 8;
+                ++m_class_tasks[cls];
+                m_high_streak = (cls == TASK_HIGH && m_class_size[TASK_LOW] > 0) ? m_high_streak + 1 : 0;
+                return true;
+            }
+        }
+    }
+    return false;
+}
 
-        if(!request)
+template <typename T>
+void threadpool<T>::run(int index)
+{
+    int node = m_nodes[index];
+    while(true)
+    {
+        WAKE wake = wait_task();
+        bool got = wake != WAKE_TIMEOUT;
+        m_queuelocker.lock();
+        if(m_stop)
         {
+            m_queuelocker.unlock();
+            break;
+        }
+        if(got)
+        {
+            ++m_wakeups[wake];
+        }
+        if(m_queue_size == 0)
+        {
+            // 空闲超时，线程数多于下限时退出，由下一次spawn或析构函数join
+            if(!got && m_live > m_thread_number)
+            {
+                --m_live;
+                ++m_shrink_count;
+                m_slots[index] = SLOT_EXITED;
+                printf("threadpool shrink to %d threads.\n", m_live);
+                m_queuelocker.unlock();
+                break;
+            }
+            m_queuelocker.unlock();
             continue;
         }
 
-        request->process();
+        // 持有锁进入循环，每次取一个任务，队列取空（或线程池析构）时回去等待信号量。
+        // 只剩低优先级任务而本线程不能处理时也回去等待，这些任务由正在处理低优先级任务的线程处理完手上的任务后取走
+        task t;
+        int cls;
+        int queue;
+        while(m_queue_size > 0 && !m_stop && take(node, t, cls, queue))
+        {
+            ++m_busy;
+            if(cls == TASK_LOW)
+            {
+                ++m_busy_low;
+            }
+            m_queuelocker.unlock();
+
+            bool stale = !t.request->valid(t.handle);
+            int next = stale ? (int)TASK_DONE : t.request->process();
+
+            m_queuelocker.lock();
+            --m_busy;
+            if(cls == TASK_LOW)
+            {
+                --m_busy_low;
+            }
+            if(stale)
+            {
+                ++m_stale_count;
+            }
+            if(next > TASK_DONE && next < TASK_CLASSES)
+            {
+                // 重新排队的任务留在原来的节点上，有别的空闲线程时唤醒一个
+                t.enqueue_us = now_us();
+                m_workqueues[next][queue].push_back(t);
+                ++m_queue_size;
+                ++m_class_size[next];
+                if(m_live - m_busy > 1)
+                {
+                    m_queuestat.post();
+                }
+            }
+        }
+        m_queuelocker.unlock();
     }
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,94 @@
+#ifndef TLS_H
+#define TLS_H
+
+// 可选的TLS支持，编译时定义USE_TLS并链接 -lssl -lcrypto。
+// 握手在主线程（reactor）中以非阻塞方式完成；握手完成后OpenSSL把会话密钥交给内核（kTLS），
+// 之后发送方向由内核加密，writev/splice可以直接作用在socket上，零拷贝路径不受影响。
+// 内核不支持kTLS或协商到不支持的加密套件时，发送退化为SSL_write。接收方向始终使用SSL_read。
+#ifdef USE_TLS
+#include <exception>
+#include <cstdio>
+#include <sys/epoll.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+class tls_context
+{
+public:
+    // 加载证书链和私钥
+    tls_context(const char *cert_file, const char *key_file)
+    {
+        m_ctx = SSL_CTX_new(TLS_server_method());
+        if (!m_ctx)
+        {
+            throw std::exception();
+        }
+        SSL_CTX_set_min_proto_version(m_ctx, TLS1_2_VERSION);
+        SSL_CTX_set_options(m_ctx, SSL_OP_ENABLE_KTLS);
+        // 非阻塞socket上writev式的部分写：SSL_write可以只写出一部分，重试时缓冲区地址可以变化
+        SSL_CTX_set_mode(m_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+        if (SSL_CTX_use_certificate_chain_file(m_ctx, cert_file) != 1 ||
+            SSL_CTX_use_PrivateKey_file(m_ctx, key_file, SSL_FILETYPE_PEM) != 1 ||
+            SSL_CTX_check_private_key(m_ctx) != 1)
+        {
+            ERR_print_errors_fp(stderr);
+            SSL_CTX_free(m_ctx);
+            throw std::exception();
+        }
+    }
+
+    ~tls_context()
+    {
+        SSL_CTX_free(m_ctx);
+    }
+
+    // 为新连接创建服务端会话，失败时返回NULL
+    SSL *new_session(int fd)
+    {
+        SSL *ssl = SSL_new(m_ctx);
+        if (ssl && SSL_set_fd(ssl, fd) != 1)
+        {
+            SSL_free(ssl);
+            return NULL;
+        }
+        if (ssl)
+        {
+            SSL_set_accept_state(ssl);
+        }
+        return ssl;
+    }
+
+private:
+    SSL_CTX *m_ctx;
+};
+
+// 推进非阻塞握手：返回1表示完成，0表示需要等待*want（EPOLLIN或EPOLLOUT）后再调用，-1表示失败
+inline int tls_handshake(SSL *ssl, int *want)
+{
+    int ret = SSL_do_handshake(ssl);
+    if (ret == 1)
+    {
+        return 1;
+    }
+    switch (SSL_get_error(ssl, ret))
+    {
+    case SSL_ERROR_WANT_READ:
+        *want = EPOLLIN;
+        return 0;
+    case SSL_ERROR_WANT_WRITE:
+        *want = EPOLLOUT;
+        return 0;
+    default:
+        ERR_clear_error();
+        return -1;
+    }
+}
+
+// 握手后发送方向是否已经由kTLS接管
+inline bool tls_ktls_send(SSL *ssl)
+{
+    return BIO_get_ktls_send(SSL_get_wbio(ssl)) > 0;
+}
+#endif
+
+#endif
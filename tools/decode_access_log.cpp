@@ -0,0 +1,235 @@
+// 把服务器用 -A 写的二进制访问日志转换成文本、CSV或JSON（每行一个对象），按请求开始时间排序后输出：
+//   g++ -O2 -std=c++17 tools/decode_access_log.cpp -I. -o decode_access_log
+//   ./decode_access_log [-f text|csv|json] access.log.1 access.log > access.txt
+// 各阶段耗时的含义同Chrome trace中的分段：connect为连接建立到读到第一个请求，只有连接上的第一个请求有。
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "access_log.h"
+
+enum format
+{
+    FMT_TEXT,
+    FMT_CSV,
+    FMT_JSON
+};
+
+static const char *methods[] = {"GET", "POST", "HEAD", "PUT", "DELETE", "TRACE", "OPTIONS", "CONNECT"};
+static const char *stages[TS_COUNT - 1] = {"connect", "read", "queue", "parse", "do_request", "respond", "send"};
+
+struct entry
+{
+    const access_record *rec;
+    const char *url;
+};
+
+// 读出一个文件中的所有记录，文件保持映射直到进程退出
+static bool load(const char *path, std::vector<entry> &entries)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(access_log_header))
+    {
+        close(fd);
+        return false;
+    }
+    const char *base = (const char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+        return false;
+    }
+    const access_log_header *h = (const access_log_header *)base;
+    if (memcmp(h->magic, ACCESS_LOG_MAGIC, 8) != 0 || h->record_size != sizeof(access_record) || h->block_size == 0)
+    {
+        fprintf(stderr, "%s: not an access log of this version\n", path);
+        return false;
+    }
+    for (size_t block = h->block_size; block + h->block_size <= (size_t)st.st_size; block += h->block_size)
+    {
+        size_t pos = block;
+        while (pos + sizeof(access_record) <= block + h->block_size)
+        {
+            const access_record *r = (const access_record *)(base + pos);
+            if (r->len == 0) // 块中之后没有记录
+            {
+                break;
+            }
+            if (r->len < sizeof(access_record) || pos + r->len > block + h->block_size ||
+                r->url_off + r->url_len > r->len)
+            {
+                fprintf(stderr, "%s: bad record at offset %zu, skipping the rest of the block\n", path, pos);
+                break;
+            }
+            entry e = {r, base + pos + r->url_off};
+            entries.push_back(e);
+            pos += r->len;
+        }
+    }
+    return true;
+}
+
+// CSV字段用双引号包起来，内部的双引号写两次；JSON字符串转义引号、反斜杠和控制字符
+static std::string quote(const char *s, int len, format fmt)
+{
+    std::string out = "\"";
+    for (int i = 0; i < len; ++i)
+    {
+        unsigned char c = s[i];
+        if (fmt == FMT_CSV && c == '"')
+        {
+            out += "\"\"";
+        }
+        else if (fmt == FMT_JSON && (c == '"' || c == '\\'))
+        {
+            out += '\\';
+            out += c;
+        }
+        else if (fmt == FMT_JSON && c < 0x20)
+        {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out += buf;
+        }
+        else
+        {
+            out += c;
+        }
+    }
+    return out + "\"";
+}
+
+static void print(const entry &e, format fmt)
+{
+    const access_record &r = *e.rec;
+    char when[64];
+    time_t sec = r.time_us / 1000000;
+    struct tm tm;
+    localtime_r(&sec, &tm);
+    size_t n = strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", &tm);
+    snprintf(when + n, sizeof(when) - n, ".%06llu", (unsigned long long)(r.time_us % 1000000));
+
+    char client[64];
+    if (r.flags & ACCESS_UNIX)
+    {
+        snprintf(client, sizeof(client), "unix");
+    }
+    else
+    {
+        char ip[INET_ADDRSTRLEN];
+        struct in_addr a;
+        a.s_addr = r.addr;
+        inet_ntop(AF_INET, &a, ip, sizeof(ip));
+        snprintf(client, sizeof(client), "%s:%u", ip, ntohs(r.port));
+    }
+    const char *method = r.method < sizeof(methods) / sizeof(methods[0]) ? methods[r.method] : "?";
+    bool closed = r.flags & ACCESS_CLOSED;
+
+    if (fmt == FMT_TEXT)
+    {
+        printf("%s %s %s %.*s %u %llu conn=%u%s", when, client, method, r.url_len, e.url, r.status,
+               (unsigned long long)r.bytes, r.conn, closed ? " closed" : "");
+        for (int i = 0; i < TS_COUNT - 1; ++i)
+        {
+            if (r.stage_us[i])
+            {
+                printf(" %s=%uus", stages[i], r.stage_us[i]);
+            }
+        }
+        printf("\n");
+    }
+    else if (fmt == FMT_CSV)
+    {
+        printf("%s,%s,%s,%s,%u,%llu,%u,%d", when, client, method, quote(e.url, r.url_len, fmt).c_str(), r.status,
+               (unsigned long long)r.bytes, r.conn, closed);
+        for (int i = 0; i < TS_COUNT - 1; ++i)
+        {
+            printf(",%u", r.stage_us[i]);
+        }
+        printf("\n");
+    }
+    else
+    {
+        printf("{\"time\":\"%s\",\"time_us\":%llu,\"client\":\"%s\",\"method\":\"%s\",\"url\":%s,\"status\":%u,"
+               "\"bytes\":%llu,\"conn\":%u,\"closed\":%s",
+               when, (unsigned long long)r.time_us, client, method, quote(e.url, r.url_len, fmt).c_str(), r.status,
+               (unsigned long long)r.bytes, r.conn, closed ? "true" : "false");
+        for (int i = 0; i < TS_COUNT - 1; ++i)
+        {
+            printf(",\"%s_us\":%u", stages[i], r.stage_us[i]);
+        }
+        printf("}\n");
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    format fmt = FMT_TEXT;
+    int opt;
+    while ((opt = getopt(argc, argv, "f:")) != -1)
+    {
+        if (opt == 'f' && strcmp(optarg, "text") == 0)
+        {
+            fmt = FMT_TEXT;
+        }
+        else if (opt == 'f' && strcmp(optarg, "csv") == 0)
+        {
+            fmt = FMT_CSV;
+        }
+        else if (opt == 'f' && strcmp(optarg, "json") == 0)
+        {
+            fmt = FMT_JSON;
+        }
+        else
+        {
+            optind = argc + 1;
+            break;
+        }
+    }
+    if (optind >= argc)
+    {
+        printf("按照此格式：%s [-f text|csv|json] access_log...\n", argv[0]);
+        return -1;
+    }
+
+    std::vector<entry> entries;
+    for (int i = optind; i < argc; ++i)
+    {
+        if (!load(argv[i], entries))
+        {
+            fprintf(stderr, "read %s failed\n", argv[i]);
+            return -1;
+        }
+    }
+    // 各线程的记录分散在不同的块中
+    std::stable_sort(entries.begin(), entries.end(), [](const entry &a, const entry &b)
+                     { return a.rec->time_us < b.rec->time_us; });
+
+    if (fmt == FMT_CSV)
+    {
+        printf("time,client,method,url,status,bytes,conn,closed");
+        for (int i = 0; i < TS_COUNT - 1; ++i)
+        {
+            printf(",%s_us", stages[i]);
+        }
+        printf("\n");
+    }
+    for (size_t i = 0; i < entries.size(); ++i)
+    {
+        print(entries[i], fmt);
+    }
+    return 0;
+}
@@ -0,0 +1,21 @@
+// 把网站根目录打包成资源包，供 -DEMBED_ASSETS 编译时嵌入可执行文件：
+//   g++ tools/pack_assets.cpp asset_arena.cpp -I. -o pack_assets
+//   ./pack_assets resources resources.bundle
+//   g++ -DEMBED_ASSETS -DASSET_BUNDLE_PATH='"resources.bundle"' main.cpp http_conn.cpp asset_arena.cpp proxy.cpp http2.cpp -lpthread
+#include <cstdio>
+#include "asset_arena.h"
+
+int main(int argc, char *argv[])
+{
+    if (argc != 3)
+    {
+        printf("按照此格式：%s doc_root bundle_file\n", argv[0]);
+        return -1;
+    }
+    if (!asset_arena::write_bundle(argv[1], argv[2]))
+    {
+        printf("pack %s failed\n", argv[1]);
+        return -1;
+    }
+    return 0;
+}
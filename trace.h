@@ -0,0 +1,171 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// 请求级追踪，两种方式共用同一组打点：
+// 1. USDT静态探针（provider为webserver，参数为fd和连接句柄），系统装有sys/sdt.h（systemtap-sdt-dev）时编译进来，
+//    未被perf/bpftrace挂载时只是一条nop。例如：
+//      bpftrace -e 'usdt:./server:webserver:dequeue { @[arg0] = nsecs; }'
+//    没有sys/sdt.h时TRACE_PROBE为空。
+// 2. 进程内采样追踪（-s N：每N个请求采样一个），记录请求各阶段的时间戳，
+//    收到SIGUSR2时把已完成的记录导出为Chrome trace-event JSON（chrome://tracing或Perfetto打开）。
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_SDT 1
+#endif
+#endif
+
+#ifdef HAVE_SDT
+#define TRACE_PROBE(name, fd, handle) DTRACE_PROBE2(webserver, name, fd, handle)
+#else
+#define TRACE_PROBE(name, fd, handle) do {} while (0)
+#endif
+
+#include <stdint.h>
+#include <cstdio>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <vector>
+#include "locker.h"
+
+// 请求的各个阶段，按发生的先后排列
+enum trace_stage
+{
+    TS_ACCEPT = 0, // 连接建立（只有连接上的第一个请求有）
+    TS_READ,       // reactor开始读这个请求
+    TS_ENQUEUE,    // 交给线程池
+    TS_DEQUEUE,    // 工作线程开始处理
+    TS_PARSED,     // 请求头解析完毕，进入do_request
+    TS_HANDLED,    // do_request返回，开始生成响应
+    TS_FIRST_BYTE, // 响应的第一个字节写出
+    TS_DONE,       // 响应发送完毕或连接关闭
+    TS_COUNT
+};
+
+struct trace_record
+{
+    uint64_t handle;       // 连接句柄，0表示这个请求没有被采样
+    long long ts[TS_COUNT]; // 微秒，0表示没有经过这个阶段
+    int tid[TS_COUNT];     // 记录该阶段的线程
+
+    void mark(int stage)
+    {
+        if (ts[stage] == 0) // 一个请求分多次读到时保留第一次
+        {
+            ts[stage] = now_us();
+            tid[stage] = current_tid();
+        }
+    }
+
+    static long long now_us()
+    {
+        struct timespec t;
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        return t.tv_sec * 1000000LL + t.tv_nsec / 1000;
+    }
+
+    static int current_tid()
+    {
+        static thread_local int tid = syscall(SYS_gettid);
+        return tid;
+    }
+};
+
+class tracer
+{
+public:
+    static const int MAX_RECORDS = 100000; // 两次导出之间最多保留的记录数，超出的丢弃
+
+    // 只能在启动阶段调用
+    static void configure(int sample_every)
+    {
+        state().every = sample_every;
+    }
+
+    static bool enabled() { return state().every > 0; }
+
+    // 新请求是否采样，只在reactor中调用
+    static bool sample()
+    {
+        config &c = state();
+        return c.every > 0 && c.counter++ % c.every == 0;
+    }
+
+    // 请求结束，保存记录
+    static void submit(const trace_record &r)
+    {
+        config &c = state();
+        c.lock.lock();
+        if ((int)c.records.size() < MAX_RECORDS)
+        {
+            c.records.push_back(r);
+        }
+        c.lock.unlock();
+    }
+
+    // 导出并清空已保存的记录，每个阶段之间的时间是一个X（complete）事件
+    static bool dump(const char *path)
+    {
+        static const char *span_names[TS_COUNT] = {"connect", "read", "queue", "parse", "do_request", "respond", "send"};
+        config &c = state();
+        std::vector<trace_record> records;
+        c.lock.lock();
+        records.swap(c.records);
+        c.lock.unlock();
+
+        FILE *fp = fopen(path, "w");
+        if (!fp)
+        {
+            return false;
+        }
+        int pid = getpid();
+        fprintf(fp, "{\"traceEvents\":[");
+        bool first = true;
+        for (size_t i = 0; i < records.size(); ++i)
+        {
+            const trace_record &r = records[i];
+            int fd = (int)(uint32_t)r.handle;
+            unsigned generation = (unsigned)(r.handle >> 32);
+            // 相邻的两个已记录阶段之间为一段，以开始阶段命名，记在开始阶段的线程上
+            int from = -1;
+            for (int s = 0; s < TS_COUNT; ++s)
+            {
+                if (r.ts[s] == 0)
+                {
+                    continue;
+                }
+                if (from >= 0)
+                {
+                    fprintf(fp, "%s\n{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,"
+                                "\"pid\":%d,\"tid\":%d,\"args\":{\"fd\":%d,\"generation\":%u}}",
+                            first ? "" : ",", span_names[from], r.ts[from], r.ts[s] - r.ts[from],
+                            pid, r.tid[from], fd, generation);
+                    first = false;
+                }
+                from = s;
+            }
+        }
+        fprintf(fp, "\n]}\n");
+        fclose(fp);
+        printf("trace: %d requests written to %s\n", (int)records.size(), path);
+        return true;
+    }
+
+private:
+    struct config
+    {
+        int every;
+        unsigned long long counter;
+        locker lock;
+        std::vector<trace_record> records;
+    };
+
+    static config &state()
+    {
+        static config c = {0, 0};
+        return c;
+    }
+};
+
+#endif
@@ -0,0 +1,112 @@
+#ifndef WORKER_STATS_H
+#define WORKER_STATS_H
+
+#include <cstdio>
+#include <cstring>
+#include <time.h>
+#include <sys/mman.h>
+
+// prefork模式（-P）下各子进程的计数器。fork之前创建共享匿名映射，每个子进程一个槽位，
+// 槽位按缓存行对齐：每个计数器只有一个写者（子进程的reactor，或者主进程写pid/restarts），
+// 主进程汇总时只读，各子进程的写入不会互相使缓存行失效。
+struct alignas(64) worker_slot
+{
+    int pid;              // 0表示该槽位当前没有子进程
+    int restarts;         // 该槽位的子进程被重建的次数，主进程维护
+    long long started_ms; // 子进程启动的时间（CLOCK_MONOTONIC）
+    long long accepted;   // 接受的连接数
+    long long dispatched; // 交给线程池的读事件数
+    long long stale;      // 句柄不匹配而被丢弃的事件数
+    long long rate_limited;
+    long long local;      // SO_INCOMING_CPU与reactor所在CPU相同的TCP连接数（reactor绑核时才统计）
+    int active;           // 当前打开的连接数
+};
+static_assert(sizeof(worker_slot) == 64, "worker_slot should fill exactly one cache line");
+
+class worker_stats
+{
+public:
+    // 创建n个槽位，fork之前调用，失败返回NULL
+    static worker_slot *create(int n)
+    {
+        void *p = mmap(NULL, n * sizeof(worker_slot), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        return p == MAP_FAILED ? NULL : (worker_slot *)p;
+    }
+
+    static void destroy(worker_slot *slots, int n)
+    {
+        munmap(slots, n * sizeof(worker_slot));
+    }
+
+    // fork之前由主进程调用，清零计数器，restarts保留。fork之后子进程可能立刻开始写计数器，
+    // 所以不能在fork返回后再清零，主进程只用started()记下pid
+    static void reset(worker_slot &s)
+    {
+        int restarts = s.restarts;
+        memset(&s, 0, sizeof(s));
+        s.restarts = restarts;
+        s.started_ms = now_ms();
+    }
+
+    static void started(worker_slot &s, int pid)
+    {
+        __atomic_store_n(&s.pid, pid, __ATOMIC_RELEASE);
+    }
+
+    // 子进程的reactor更新自己的槽位
+    static void add(long long &counter, long long n = 1)
+    {
+        __atomic_store_n(&counter, counter + n, __ATOMIC_RELAXED); // 单一写者，不需要原子的读-改-写
+    }
+
+    static void set(long long &counter, long long value)
+    {
+        __atomic_store_n(&counter, value, __ATOMIC_RELAXED);
+    }
+
+    static void set(int &counter, int value)
+    {
+        __atomic_store_n(&counter, value, __ATOMIC_RELAXED);
+    }
+
+    // 主进程打印每个子进程和合计
+    static void print(const worker_slot *slots, int n)
+    {
+        worker_slot total;
+        memset(&total, 0, sizeof(total));
+        for (int i = 0; i < n; ++i)
+        {
+            const worker_slot &s = slots[i];
+            int pid = __atomic_load_n(&s.pid, __ATOMIC_ACQUIRE);
+            long long accepted = __atomic_load_n(&s.accepted, __ATOMIC_RELAXED);
+            long long dispatched = __atomic_load_n(&s.dispatched, __ATOMIC_RELAXED);
+            long long stale = __atomic_load_n(&s.stale, __ATOMIC_RELAXED);
+            long long limited = __atomic_load_n(&s.rate_limited, __ATOMIC_RELAXED);
+            long long local = __atomic_load_n(&s.local, __ATOMIC_RELAXED);
+            int active = __atomic_load_n(&s.active, __ATOMIC_RELAXED);
+            printf("worker %d: pid %d, up %llds, restarts %d, active %d, accepted %lld, dispatched %lld, stale %lld, rate limited %lld, cpu-local %lld\n",
+                   i, pid, pid ? (now_ms() - s.started_ms) / 1000 : 0, s.restarts, active, accepted, dispatched,
+                   stale, limited, local);
+            total.restarts += s.restarts;
+            total.active += active;
+            total.accepted += accepted;
+            total.dispatched += dispatched;
+            total.stale += stale;
+            total.rate_limited += limited;
+            total.local += local;
+        }
+        printf("workers total: restarts %d, active %d, accepted %lld, dispatched %lld, stale %lld, rate limited %lld, cpu-local %lld\n",
+               total.restarts, total.active, total.accepted, total.dispatched, total.stale, total.rate_limited,
+               total.local);
+        fflush(stdout);
+    }
+
+    static long long now_ms()
+    {
+        struct timespec t;
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        return t.tv_sec * 1000LL + t.tv_nsec / 1000000;
+    }
+};
+
+#endif
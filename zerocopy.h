@@ -0,0 +1,154 @@
+#ifndef ZEROCOPY_H
+#define ZEROCOPY_H
+
+#include <stdint.h>
+#include <cstdio>
+#include <cstring>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+// MSG_ZEROCOPY发送（-Z bytes）：不小于阈值的内存中的响应体（预加载的资源）用sendmsg(MSG_ZEROCOPY)发送，
+// 内核直接引用用户页而不复制到socket缓冲区。每次成功的发送调用在内核中分配一个递增的序号，
+// 数据真正发完后内核把完成的序号区间放进socket的错误队列（有的内核同时报告EPOLLERR，有的不报告），
+// reactor在处理有未完成发送的连接的每个事件之前读出（reap）。
+// 在收到完成通知之前，被引用的内存不能修改或释放：预加载区在运行期间只读，且比所有连接活得久，
+// 因此只对它使用零拷贝；写缓冲区等会被复用的内存仍然用writev。
+// 内核不得不复制时（比如回环设备）完成通知带有COPIED标志，此后该连接不再使用零拷贝。
+// 统计中的CPU时间取自getrusage，按发送的总字节数折算成每GB的CPU毫秒数，开关 -Z 各跑一次即可比较。
+class zerocopy
+{
+public:
+    // 只能在启动阶段调用，threshold为0表示关闭
+    static void configure(size_t threshold) { get().threshold = threshold; }
+
+    static size_t threshold() { return get().threshold; }
+
+    // 在新连接上打开SO_ZEROCOPY，内核或协议不支持（比如Unix域套接字）时返回false
+    static bool enable(int fd)
+    {
+        int one = 1;
+        return setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+    }
+
+    // 以MSG_ZEROCOPY发送，语义同writev。返回值大于0时该调用占用一个完成序号。
+    // 内核为零拷贝分配的锁页内存（optmem）用完时返回-1且errno为ENOBUFS，调用者应改用普通发送
+    static ssize_t send(int fd, const struct iovec *iv, int count)
+    {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = (struct iovec *)iv;
+        msg.msg_iovlen = count;
+        ssize_t n = sendmsg(fd, &msg, MSG_ZEROCOPY | MSG_NOSIGNAL);
+        state &s = get();
+        if (n > 0)
+        {
+            __atomic_add_fetch(&s.sends, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&s.bytes, n, __ATOMIC_RELAXED);
+        }
+        else if (n < 0 && errno == ENOBUFS)
+        {
+            __atomic_add_fetch(&s.fallbacks, 1, __ATOMIC_RELAXED);
+        }
+        return n;
+    }
+
+    // 读出错误队列中所有的完成通知，返回完成的发送调用数，有通知带COPIED标志时置copied
+    static int reap(int fd, bool &copied)
+    {
+        int done = 0;
+        while (true)
+        {
+            char control[128];
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+            {
+                break; // EAGAIN：队列已空
+            }
+            for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+            {
+                if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                      (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+                {
+                    continue;
+                }
+                const struct sock_extended_err *ee = (const struct sock_extended_err *)CMSG_DATA(cm);
+                if (ee->ee_errno != 0 || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                {
+                    continue;
+                }
+                // [ee_info, ee_data]是完成的序号区间，相邻的通知会被内核合并
+                int n = ee->ee_data - ee->ee_info + 1;
+                done += n;
+                if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                {
+                    copied = true;
+                    __atomic_add_fetch(&get().copied, n, __ATOMIC_RELAXED);
+                }
+            }
+        }
+        __atomic_add_fetch(&get().completions, done, __ATOMIC_RELAXED);
+        return done;
+    }
+
+    // 每个请求结束时调用一次，累计发给客户端的总字节数
+    static void account(long long bytes)
+    {
+        if (bytes > 0)
+        {
+            __atomic_add_fetch(&get().total_bytes, bytes, __ATOMIC_RELAXED);
+        }
+    }
+
+    // 没有开启零拷贝时只打印发送量和CPU时间，作为对比的基线
+    static void print()
+    {
+        state &s = get();
+        struct rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+        double cpu_ms = (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000.0 +
+                        (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000.0;
+        long long total = __atomic_load_n(&s.total_bytes, __ATOMIC_RELAXED);
+        if (s.threshold)
+        {
+            printf("zerocopy: threshold %zu, sends %lld, bytes %lld, completions %lld (copied %lld), enobufs %lld\n",
+                   s.threshold, __atomic_load_n(&s.sends, __ATOMIC_RELAXED), __atomic_load_n(&s.bytes, __ATOMIC_RELAXED),
+                   __atomic_load_n(&s.completions, __ATOMIC_RELAXED), __atomic_load_n(&s.copied, __ATOMIC_RELAXED),
+                   __atomic_load_n(&s.fallbacks, __ATOMIC_RELAXED));
+        }
+        printf("sent %lld bytes, cpu %.0fms, %.1fms per GB\n", total, cpu_ms, total > 0 ? cpu_ms / (total / 1e9) : 0.0);
+    }
+
+private:
+    struct state
+    {
+        size_t threshold;
+        long long sends;       // 以MSG_ZEROCOPY成功发送的调用数
+        long long bytes;       // 这些调用发出的字节数
+        long long completions; // 收到完成通知的调用数
+        long long copied;      // 其中内核实际做了复制的调用数
+        long long fallbacks;   // ENOBUFS后改用普通发送的次数
+        long long total_bytes; // 所有响应发给客户端的字节数
+    };
+
+    static state &get()
+    {
+        static state s = {0, 0, 0, 0, 0, 0, 0};
+        return s;
+    }
+};
+
+#endif